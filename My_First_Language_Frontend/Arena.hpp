@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+// ASTArena, a bump-pointer arena that owns all ExprAST nodes of one top-level item
+// the nodes are never destroyed one by one, the arena just drops its slabs,
+// so a node must not own heap memory: names are StringRef and lists are ArrayRef
+// that point back into the arena
+class ASTArena{
+	llvm::BumpPtrAllocator Alloc;
+
+public:
+	template <typename T, typename... ArgsT>
+	T * create(ArgsT &&... Args){
+		return new (Alloc.Allocate<T>()) T(std::forward<ArgsT>(Args)...);
+	}
+
+	llvm::StringRef copyString(llvm::StringRef S){
+		if(S.empty())
+			return llvm::StringRef();
+		char * Mem = Alloc.Allocate<char>(S.size());
+		memcpy(Mem, S.data(), S.size());
+		return llvm::StringRef(Mem, S.size());
+	}
+
+	template <typename T>
+	llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> A){
+		if(A.empty())
+			return llvm::ArrayRef<T>();
+		T * Mem = Alloc.Allocate<T>(A.size());
+		std::uninitialized_copy(A.begin(), A.end(), Mem);
+		return llvm::ArrayRef<T>(Mem, A.size());
+	}
+
+	size_t getBytesAllocated() const { return Alloc.getBytesAllocated(); }
+	size_t getTotalMemory() const { return Alloc.getTotalMemory(); }
+};
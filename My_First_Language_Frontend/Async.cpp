@@ -0,0 +1,405 @@
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "Async.hpp"
+#include "IR.hpp"
+#include "Runtime.hpp"
+#include "Trace.hpp"
+
+using namespace llvm::orc;
+
+// asynchronous evaluation
+// with -async-eval a top-level expression that is JIT compiled doesn't run on
+// the thread that parses: it goes to a pool of -eval-threads workers, and the
+// REPL reads and compiles the next lines while it runs. every expression is
+// compiled then, -fast-eval would run calls on the thread that parses (with
+// -tier-threshold they all are interpreted there, the mode does nothing). the results are printed
+// in the order of the expressions, by the worker that finishes the oldest one.
+// the workers take the expressions in order, with one worker (the default)
+// their side effects keep that order too. a definition read while an
+// expression runs is in place for the calls it makes from then on.
+//
+// -eval-timeout gives every evaluation a wall-clock budget. a cancelled
+// evaluation leaves from the next loop back-edge it reaches, code compiled in
+// this mode checks there (recursion without a loop runs to its end, and a loop
+// of a few constant iterations has no check, see IsShortLoop). the check is a
+// load and a branch, but a loop with it isn't vectorized
+
+bool CancelChecks;
+
+static cl::opt<bool>
+AsyncEval("async-eval",
+		  cl::desc("Run compiled top-level expressions on worker threads while the next "
+				   "lines are read and compiled"),
+		  cl::init(false));
+
+static cl::opt<unsigned>
+EvalThreads("eval-threads",
+			cl::desc("Worker threads of -async-eval, expressions run at the same time "
+					 "with more than one"),
+			cl::init(1));
+
+static cl::opt<unsigned>
+EvalTimeout("eval-timeout",
+			cl::desc("Cancel a top-level expression that runs longer than <ms> (implies "
+					 "-async-eval)"),
+			cl::value_desc("ms"), cl::init(0));
+
+
+// runtime of the cancellation checks
+// toycancelpending counts the evaluations that were cancelled and haven't
+// left yet, loops test it at every back-edge and call toycancelpoint when it
+// isn't 0. that leaves the evaluation of the thread if it is the one cancelled,
+// by a longjmp out of the JIT-ed code: nothing on the stack needs cleaning up
+// but the pfor runtime, a cancelled pfor finishes its iterations first
+enum EvalState{ Eval_Running, Eval_Cancelled, Eval_Finished };
+
+struct EvalContext{
+	std::atomic<int> State{Eval_Running};
+	std::jmp_buf Exit;
+};
+
+extern "C" std::atomic<int32_t> toycancelpending;
+std::atomic<int32_t> toycancelpending{0};
+
+static thread_local EvalContext * CurEval;
+
+extern "C" void toycancelpoint(){
+	if(CurEval && CurEval->State.load(std::memory_order_acquire) == Eval_Cancelled && !pforactive())
+		std::longjmp(CurEval->Exit, 1);
+}
+
+// any thread, an evaluation that is done stays done
+static void CancelEvaluation(EvalContext & Ctx){
+	int Running = Eval_Running;
+	if(Ctx.State.compare_exchange_strong(Running, Eval_Cancelled))
+		toycancelpending.fetch_add(1, std::memory_order_release);
+}
+
+static void FinishEvaluation(EvalContext & Ctx){
+	CurEval = nullptr;
+	// cancelled while it ran, it isn't pending any more
+	if(Ctx.State.exchange(Eval_Finished) == Eval_Cancelled)
+		toycancelpending.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// run FP as the evaluation Ctx, returns false when it was cancelled
+static bool RunCancellable(double (*FP)(), EvalContext & Ctx, double & Result){
+	CurEval = &Ctx;
+	if(setjmp(Ctx.Exit)){
+		FinishEvaluation(Ctx);
+		return false;
+	}
+	Result = FP();
+	FinishEvaluation(Ctx);
+	return true;
+}
+
+
+// codegen
+
+void EmitCancelCheck(){
+	if(!CancelChecks)
+		return;
+	Function * F = Builder->GetInsertBlock()->getParent();
+	Type * I32 = Builder->getInt32Ty();
+	auto * Pending = cast<GlobalVariable>(TheModule->getOrInsertGlobal("toycancelpending", I32));
+	FunctionCallee Point = TheModule->getOrInsertFunction("toycancelpoint", Builder->getVoidTy());
+
+	// monotonic, so the load stays in the loop
+	LoadInst * Count = Builder->CreateAlignedLoad(I32, Pending, MaybeAlign(4), "cancelpending");
+	Count->setAtomic(AtomicOrdering::Monotonic);
+	BasicBlock * CheckBB = BasicBlock::Create(*TheContext, "cancelcheck", F);
+	BasicBlock * ContBB = BasicBlock::Create(*TheContext, "loopend", F);
+	Builder->CreateCondBr(Builder->CreateICmpNE(Count, Builder->getInt32(0)), CheckBB, ContBB,
+						  MDBuilder(*TheContext).createBranchWeights(1, 1 << 20));
+	Builder->SetInsertPoint(CheckBB);
+	Builder->CreateCall(Point);
+	Builder->CreateBr(ContBB);
+	Builder->SetInsertPoint(ContBB);
+}
+
+
+// the evaluation workers
+
+struct EvalResult{
+	double Value = 0;
+	bool Cancelled = false;
+	double Millis = 0;		// wall clock, from its start
+};
+
+class EvalPool{
+	struct Job{
+		std::string Name;
+		double (*FP)();
+		std::promise<EvalResult> Promise;
+	};
+	// an evaluation a worker runs, for the watchdog
+	struct Running{
+		std::chrono::steady_clock::time_point Deadline;
+		EvalContext * Ctx;
+	};
+
+	std::mutex Lock;
+	std::condition_variable Work, Watch;
+	std::deque<Job> Queue;
+	std::list<Running> Budgets;
+	bool Stopping = false;
+	std::vector<std::thread> Workers;
+	std::thread Watchdog;
+
+	void work();
+	void watch();
+
+public:
+	explicit EvalPool(unsigned NumThreads);
+	~EvalPool();
+
+	// the result is ready once FP ran or was cancelled
+	std::future<EvalResult> submit(const std::string & Name, double (*FP)());
+};
+
+EvalPool::EvalPool(unsigned NumThreads){
+	for(unsigned I = 0; I < NumThreads; ++I)
+		Workers.emplace_back([this](){ work(); });
+	if(EvalTimeout)
+		Watchdog = std::thread([this](){ watch(); });
+}
+
+EvalPool::~EvalPool(){
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		Stopping = true;
+	}
+	Work.notify_all();
+	Watch.notify_all();
+	for(auto & T : Workers)
+		T.join();
+	if(Watchdog.joinable())
+		Watchdog.join();
+}
+
+std::future<EvalResult> EvalPool::submit(const std::string & Name, double (*FP)()){
+	std::future<EvalResult> F;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		Queue.push_back(Job{Name, FP, std::promise<EvalResult>()});
+		F = Queue.back().Promise.get_future();
+	}
+	Work.notify_one();
+	return F;
+}
+
+static void PrintFinishedEvaluations();
+static std::atomic<unsigned> NumEvaluations, NumCancelled;
+
+void EvalPool::work(){
+	using Clock = std::chrono::steady_clock;
+	while(1){
+		Job J;
+		{
+			std::unique_lock<std::mutex> Guard(Lock);
+			Work.wait(Guard, [this](){ return Stopping || !Queue.empty(); });
+			if(Queue.empty())
+				return;
+			J = std::move(Queue.front());
+			Queue.pop_front();
+		}
+
+		EvalContext Ctx;
+		EvalResult R;
+		auto Start = Clock::now();
+		std::list<Running>::iterator Budget;
+		if(EvalTimeout){
+			std::lock_guard<std::mutex> Guard(Lock);
+			Budget = Budgets.insert(Budgets.end(),
+									{Start + std::chrono::milliseconds(EvalTimeout), &Ctx});
+			Watch.notify_one();
+		}
+		{
+			TraceScope Span(TP_Run, J.Name);
+			R.Cancelled = !RunCancellable(J.FP, Ctx, R.Value);
+		}
+		R.Millis = std::chrono::duration<double, std::milli>(Clock::now() - Start).count();
+		if(EvalTimeout){
+			std::lock_guard<std::mutex> Guard(Lock);
+			Budgets.erase(Budget);
+		}
+
+		++NumEvaluations;
+		NumCancelled += R.Cancelled;
+		J.Promise.set_value(R);
+		PrintFinishedEvaluations();
+	}
+}
+
+// cancel every evaluation that is over its budget
+void EvalPool::watch(){
+	std::unique_lock<std::mutex> Guard(Lock);
+	while(!Stopping){
+		auto Earliest = std::chrono::steady_clock::time_point::max();
+		for(Running & R : Budgets)
+			Earliest = std::min(Earliest, R.Deadline);
+		if(Earliest == std::chrono::steady_clock::time_point::max()){
+			Watch.wait(Guard);
+			continue;
+		}
+		Watch.wait_until(Guard, Earliest);
+		// the worker takes the entry out when the evaluation has left
+		auto Now = std::chrono::steady_clock::now();
+		for(Running & R : Budgets)
+			if(R.Deadline <= Now){
+				CancelEvaluation(*R.Ctx);
+				R.Deadline = std::chrono::steady_clock::time_point::max();
+			}
+	}
+}
+
+
+// the REPL side
+// every top-level expression read while some are running is in Pending, in
+// order, until its result is printed. the JIT module of a compiled one is
+// removed afterwards by the thread that compiles, the JIT isn't thread safe
+struct PendingEval{
+	std::string Name;
+	bool Compiled = false;
+	VModuleKey Module = 0;
+	std::shared_future<EvalResult> Result;
+	bool Printed = false;
+};
+
+static std::unique_ptr<EvalPool> TheEvalPool;
+static pid_t EvalPoolOwner;
+static std::mutex PendingLock;
+static std::deque<PendingEval> Pending;
+
+// before anything is compiled, not for batch mode or -aot: the checks call
+// into the driver
+void InitAsyncEval(){
+	CancelChecks = AsyncEval || EvalTimeout;
+}
+
+bool AsyncEvalEnabled(){
+	return CancelChecks;
+}
+
+// the workers of this process, started by its first evaluation. a session of
+// the compile server is a fork, it has the memory of the server's workers but
+// not their threads
+static EvalPool & GetEvalPool(){
+	if(!TheEvalPool || EvalPoolOwner != getpid()){
+		(void)TheEvalPool.release();
+		TheEvalPool = std::make_unique<EvalPool>(std::max(1u, (unsigned)EvalThreads));
+		EvalPoolOwner = getpid();
+	}
+	return *TheEvalPool;
+}
+
+static void PrintEvalResult(const EvalResult & R){
+	if(R.Cancelled)
+		fprintf(stderr, "Evaluation cancelled after %.0f ms (timeout %u ms)\n", R.Millis,
+				(unsigned)EvalTimeout);
+	else
+		fprintf(stderr, "Evaluated to %f\n", R.Value);
+}
+
+// print the results that are next in order, any thread
+static void PrintFinishedEvaluations(){
+	std::lock_guard<std::mutex> Guard(PendingLock);
+	for(PendingEval & P : Pending){
+		if(P.Printed)
+			continue;
+		if(P.Result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			break;
+		PrintEvalResult(P.Result.get());
+		P.Printed = true;
+	}
+}
+
+void SubmitEvaluation(const std::string & Name, double (*FP)(), VModuleKey Module){
+	{
+		std::lock_guard<std::mutex> Guard(PendingLock);
+		PendingEval P;
+		P.Name = Name;
+		P.Compiled = true;
+		P.Module = Module;
+		P.Result = GetEvalPool().submit(Name, FP).share();
+		Pending.push_back(std::move(P));
+	}
+	// it may be done already, with nothing before it
+	PrintFinishedEvaluations();
+}
+
+void ReportEvaluated(double Result){
+	{
+		std::lock_guard<std::mutex> Guard(PendingLock);
+		if(!Pending.empty()){
+			std::promise<EvalResult> Done;
+			EvalResult R;
+			R.Value = Result;
+			Done.set_value(R);
+			PendingEval P;
+			P.Name = "__anon_expr";
+			P.Result = Done.get_future().share();
+			Pending.push_back(std::move(P));
+		}else{
+			fprintf(stderr, "Evaluated to %f\n", Result);
+			return;
+		}
+	}
+	PrintFinishedEvaluations();
+}
+
+void RetireEvaluations(){
+	std::vector<VModuleKey> Done;
+	{
+		std::lock_guard<std::mutex> Guard(PendingLock);
+		while(!Pending.empty() && Pending.front().Printed){
+			if(Pending.front().Compiled)
+				Done.push_back(Pending.front().Module);
+			Pending.pop_front();
+		}
+	}
+	for(VModuleKey K : Done){
+		TheJIT->removeModule(K);
+		++NumModulesRemoved;
+	}
+}
+
+void WaitForEvaluations(){
+	std::vector<std::shared_future<EvalResult>> All;
+	{
+		std::lock_guard<std::mutex> Guard(PendingLock);
+		for(PendingEval & P : Pending)
+			All.push_back(P.Result);
+	}
+	for(auto & F : All)
+		F.wait();
+	PrintFinishedEvaluations();
+	RetireEvaluations();
+}
+
+// -repl-stats
+void PrintAsyncStats(){
+	if(AsyncEvalEnabled())
+		fprintf(stderr, "async: %u evaluations on %u threads, %u cancelled\n",
+				NumEvaluations.load(), std::max(1u, (unsigned)EvalThreads), NumCancelled.load());
+}
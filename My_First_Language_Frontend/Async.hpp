@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include "KaleidoscopeJIT.h"
+
+// asynchronous evaluation of top-level expressions, see Async.cpp
+
+// set when the code being compiled may run as an asynchronous evaluation,
+// the loops it has check for cancellation then
+extern bool CancelChecks;
+
+// before anything is compiled, not for batch mode or -aot: the checks call
+// into the driver
+void InitAsyncEval();
+
+// codegen hook, at the back-edge of a loop: leave the evaluation if it was
+// cancelled. does nothing without CancelChecks
+void EmitCancelCheck();
+
+// true when compiled top-level expressions run on the evaluation workers
+bool AsyncEvalEnabled();
+
+// hand the compiled expression Name (FP, in Module) to the workers, its
+// result is printed once it and the expressions before it are done
+void SubmitEvaluation(const std::string & Name, double (*FP)(),
+					  llvm::orc::VModuleKey Module);
+
+// the result of an expression evaluated on this thread, printed after the
+// ones still running
+void ReportEvaluated(double Result);
+
+// between REPL lines: remove the modules of the expressions that are done
+void RetireEvaluations();
+
+// wait for every expression handed to the workers, and print what is left
+void WaitForEvaluations();
+
+// -repl-stats
+void PrintAsyncStats();
@@ -1,6 +1,7 @@
 #include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Attributes.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -9,18 +10,21 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -29,8 +33,12 @@
 #include <string>
 #include <vector>
 
+#include "Async.hpp"
 #include "IR.hpp"
+#include "Memo.hpp"
 #include "Paser.hpp"
+#include "Profile.hpp"
+#include "Trace.hpp"
 
 
 
@@ -39,19 +47,30 @@ using namespace llvm;
 using namespace llvm::orc;
 
 
+thread_local std::unique_ptr<LLVMContext> TheContext;
+thread_local std::unique_ptr<IRBuilder<>> Builder;
+thread_local std::unique_ptr<Module> TheModule;
+thread_local ScopedHashTable<Symbol, AllocaInst *> NamedValues;
+thread_local DenseMap<Symbol, Function *> ModuleFunctions;
+std::unique_ptr<KaleidoscopeJIT> TheJIT;
+DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
+std::mutex FunctionProtosMutex;
+
+
 Value * LogErrorV(const char *  Str){
-	LogErrorV(Str);
+	LogError(Str);
 	return nullptr;
 }
 
 
 
 
-Function *getFunction(std::string Name){
+Function *getFunction(Symbol Name){
 	// check exist
-	if(auto *F = TheModule->getFunction(Name))
+	if(Function * F = ModuleFunctions.lookup(Name))
 		return F;
 	// check whether we can codegen the declaration from some existing prototype
+	std::lock_guard<std::mutex> Lock(FunctionProtosMutex);
 	auto FI = FunctionProtos.find(Name);
 	if(FI != FunctionProtos.end())
 		return FI->second->codegen();
@@ -60,84 +79,256 @@ Function *getFunction(std::string Name){
 	return nullptr;
 }
 
+// call before F is renamed or erased, ModuleFunctions must not keep it
+void forgetFunction(Function * F){
+	Symbol Sym = Symbols.find(F->getName());
+	if(Sym != ~0U && ModuleFunctions.lookup(Sym) == F)
+		ModuleFunctions.erase(Sym);
+}
+
+// int is i64, double is double, array is double*
+static Type * getLLVMType(ValType Ty){
+	if(Ty == Ty_Int)
+		return Type::getInt64Ty(*TheContext);
+	if(Ty == Ty_Array)
+		return Type::getDoublePtrTy(*TheContext);
+	return Type::getDoubleTy(*TheContext);
+}
+
+// convert V to Ty, an int becomes a double with sitofp and a double is
+// truncated toward zero with fptosi. fptosi of a double out of the int range
+// is poison, so like InterpValue::convertTo that saturates and a NaN gives 0
+// (llvm.fptosi.sat is newer than LLVM 10). an array never converts
+static Value * ConvertTo(Value * V, Type * Ty){
+	if(V->getType() == Ty)
+		return V;
+	if(V->getType()->isPointerTy() || Ty->isPointerTy())
+		return LogErrorV("Cannot convert between an array and a number");
+	if(Ty->isIntegerTy()){
+		Value * I = Builder->CreateFPToSI(V, Ty, "toint");
+		Value * Max = ConstantFP::get(V->getType(), 9223372036854775808.0);
+		Value * Min = ConstantFP::get(V->getType(), -9223372036854775808.0);
+		I = Builder->CreateSelect(Builder->CreateFCmpOGE(V, Max, "toobig"),
+								  ConstantInt::get(Ty, INT64_MAX), I);
+		I = Builder->CreateSelect(Builder->CreateFCmpOLT(V, Min, "toosmall"),
+								  ConstantInt::get(Ty, INT64_MIN), I);
+		return Builder->CreateSelect(Builder->CreateFCmpUNO(V, V, "isnan"),
+									 ConstantInt::get(Ty, 0), I, "toint");
+	}
+	return Builder->CreateSIToFP(V, Ty, "todouble");
+}
+
+// a condition is true when it is not 0, ordered so NaN is false
+// (an array when it is not null)
+static Value * CreateIsTrue(Value * V, const Twine &Name){
+	if(V->getType()->isPointerTy())
+		return Builder->CreateIsNotNull(V, Name);
+	if(V->getType()->isIntegerTy())
+		return Builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0), Name);
+	return Builder->CreateFCmpONE(V, ConstantFP::get(*TheContext, APFloat(0.0)), Name);
+}
+
 // create an alloca instrcution in the entry block of the function
 // this is used for mutable variables etc
-static AllocaInst * CreateEntryBlockAlloca(Function * TheFunction,
-										   const std::string &VarName){
+AllocaInst * CreateEntryBlockAlloca(Function * TheFunction,
+									StringRef VarName, Type * Ty){
 	// creates an IRBuilder object that is pointing at the first instruction
 	IRBuilder<> TmpB(&TheFunction->getEntryBlock(),	
 						TheFunction->getEntryBlock().begin());
 
 	// creates an alloca with the expected name and returns it
-	return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), 0, VarName.c_str());
+	return TmpB.CreateAlloca(Ty, 0, VarName);
+}
+
+// a pfor body being compiled into a function of its own, see PForExprAST::codegen
+// the variables of the functions around it come in through Env, an array of
+// pointers to them: each one the body reads is copied into a variable of Fn
+// when a chunk starts
+struct PForOutline{
+	Function * Fn;
+	PForOutline * Parent;				// the pfor Fn is nested in, if any
+	Value * Env;
+	IRBuilder<> Init;					// end of the entry block of Fn, the copies
+	SmallVector<AllocaInst *, 8> Slots;	// the variables outside, by Env slot
+	DenseMap<AllocaInst *, AllocaInst *> Copies;
+
+	PForOutline(Function * Fn, PForOutline * Parent, Value * Env, Instruction * InitPoint)
+		: Fn(Fn), Parent(Parent), Env(Env), Init(InitPoint) {}
+
+	// the pointer in the next Env slot, as a Ty *
+	Value * loadSlot(Type * Ty){
+		Type * I8Ptr = Init.getInt8PtrTy();
+		Value * SlotPtr = Init.CreateConstInBoundsGEP1_64(I8Ptr, Env, Slots.size());
+		return Init.CreateBitCast(Init.CreateLoad(I8Ptr, SlotPtr), Ty->getPointerTo());
+	}
+
+	// the variable of Fn that stands for A, A itself when it is in Fn
+	AllocaInst * capture(AllocaInst * A){
+		if(A->getFunction() == Fn)
+			return A;
+		auto It = Copies.find(A);
+		if(It != Copies.end())
+			return It->second;
+		AllocaInst * Outer = Parent ? Parent->capture(A) : A;
+		AllocaInst * Copy = CreateEntryBlockAlloca(Fn, A->getName(), A->getAllocatedType());
+		Init.CreateStore(Init.CreateLoad(A->getAllocatedType(), loadSlot(A->getAllocatedType())), Copy);
+		Slots.push_back(Outer);
+		Copies[A] = Copy;
+		return Copy;
+	}
+};
+
+static thread_local PForOutline * CurPFor;
+
+// the variable Name in the function being compiled, nullptr when unknown
+static AllocaInst * LookupVariable(Symbol Name){
+	AllocaInst * A = NamedValues.lookup(Name);
+	if(!A || !CurPFor)
+		return A;
+	return CurPFor->capture(A);
 }
 
 // in the LLVM IR that constants are all uniqued together and shared
 // So APU use get() rather than new
 Value * NumberExprAST::codegen(){
-	return ConstantFP::get(TheContext, APFloat(Val));
+	if(IsInt)
+		return ConstantInt::get(Type::getInt64Ty(*TheContext), IntVal, true);
+	return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
 Value *VariableExprAST::codegen() {
   // Look this variable up in the function.
-	Value *V = NamedValues[Name];
+	AllocaInst *V = LookupVariable(Name);
 	if (!V)
 		return LogErrorV("Unknown variable name");
 	
-	// load the value
-	return Builder.CreateLoad(V, Name.c_str());
+	// load the value, with the type the variable was declared with
+	return Builder->CreateLoad(V->getAllocatedType(), V, Symbols.getName(Name));
+}
+
+Value * ExprAST::codegenStore(Value * Val){
+	return LogErrorV("destination of '=' must be a variable or an array element");
+}
+
+Value * VariableExprAST::codegenStore(Value * Val){
+	AllocaInst * Variable = NamedValues.lookup(Name);
+	if(!Variable)
+		return LogErrorV("Unknown variable name");
+	// the iterations of a pfor would race on it, and the body has a copy
+	if(CurPFor && Variable->getFunction() != CurPFor->Fn)
+		return LogErrorV("pfor body can't assign a variable from outside it, use a reduction");
+
+	// the variable keeps its type, the value is converted to it
+	Val = ConvertTo(Val, Variable->getAllocatedType());
+	if(!Val)
+		return nullptr;
+	Builder->CreateStore(Val, Variable);
+	return Val;
+}
+
+
+// address of element Index of Array, the GEP is inbounds: an index outside
+// the array is undefined, like in C
+static Value * CreateElementPtr(Value * Array, Value * Index){
+	if(!Array->getType()->isPointerTy())
+		return LogErrorV("Indexed value is not an array");
+	Index = ConvertTo(Index, Type::getInt64Ty(*TheContext));
+	if(!Index)
+		return nullptr;
+	return Builder->CreateInBoundsGEP(Type::getDoubleTy(*TheContext), Array, Index, "elemptr");
+}
+
+// elements are plain doubles, array(n) allocates them 64 byte aligned
+Value * IndexExprAST::codegen(){
+	Value * A = Array->codegen();
+	Value * I = Index->codegen();
+	if(!A || !I)
+		return nullptr;
+	Value * Ptr = CreateElementPtr(A, I);
+	if(!Ptr)
+		return nullptr;
+	return Builder->CreateAlignedLoad(Type::getDoubleTy(*TheContext), Ptr, MaybeAlign(8), "elem");
+}
+
+Value * IndexExprAST::codegenStore(Value * Val){
+	Val = ConvertTo(Val, Type::getDoubleTy(*TheContext));
+	if(!Val)
+		return nullptr;
+	Value * A = Array->codegen();
+	Value * I = Index->codegen();
+	if(!A || !I)
+		return nullptr;
+	Value * Ptr = CreateElementPtr(A, I);
+	if(!Ptr)
+		return nullptr;
+	Builder->CreateAlignedStore(Val, Ptr, MaybeAlign(8));
+	return Val;
 }
 
 
 Value * BinaryExprAST::codegen(){
 	// Special case '=' , beacuse we don't want to emit the LHS as an expression
 	if(Op == '='){
-		// Assignment requires the LHS to be an identifier
-		// assume we're build LLVM with RTTI this can be changed to a 
-		// dynamic_cast for automatic error checking
-		VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-		if(!LHSE)
-			return LogErrorV("destination of '=' must be a variable");
-
 		// codegen the RHS
 		Value * Val = RHS->codegen();
 		if(!Val)
 			return nullptr;
 
-		// Look up the name
-		Value * Variable = NamedValues[LHSE->getName()];
-		if(!Variable)
-			return LogErrorV("Unknown variable name");
-		Builder.CreateStore(Val, Variable);
-		return Val;
+		// the LHS (a variable or an array element) stores it
+		return LHS->codegenStore(Val);
 	}
 	Value * L = LHS->codegen();
 	Value * R = RHS->codegen();
 	if(!L || !R)
 		return nullptr;
 
+	// int op int stays an int (wrapping on overflow), anything else
+	// promotes the int side and is done in double
+	Type * DoubleTy = Type::getDoubleTy(*TheContext);
+	bool BothInt = L->getType()->isIntegerTy() && R->getType()->isIntegerTy();
+	if(!BothInt && (Op == '+' || Op == '-' || Op == '*' || Op == '<')){
+		L = ConvertTo(L, DoubleTy);
+		R = ConvertTo(R, DoubleTy);
+		if(!L || !R)
+			return nullptr;
+	}
+
 	switch(Op){
 		case '+':
-			return Builder.CreateFAdd(L, R, "addtmp");
+			if(BothInt)
+				return Builder->CreateAdd(L, R, "addtmp");
+			return Builder->CreateFAdd(L, R, "addtmp");
 		case '-':
-			return Builder.CreateFSub(L, R, "subtmp");
+			if(BothInt)
+				return Builder->CreateSub(L, R, "subtmp");
+			return Builder->CreateFSub(L, R, "subtmp");
 		case '*':
-			return Builder.CreateFMul(L, R, "multmp");
+			if(BothInt)
+				return Builder->CreateMul(L, R, "multmp");
+			return Builder->CreateFMul(L, R, "multmp");
 		case '<':
-			L = Builder.CreateFCmpULT(L, R, "cmptmp");
+			if(BothInt){
+				L = Builder->CreateICmpSLT(L, R, "cmptmp");
+				// an int compare gives an int 0 or 1
+				return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
+			}
+			L = Builder->CreateFCmpULT(L, R, "cmptmp");
 			// convert bool to double 0.0 or 1.0 by treat input as unsigned value
-			return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+			return Builder->CreateUIToFP(L, DoubleTy, "booltmp");
 		default:
 			break;
 	}
 
 	// if it wasn't a builin binary operator, it must be a user defined one
 	// emit a call to it
-	Function * F = getFunction(std::string("binary") + Op);
+	Function * F = getFunction(OpFn);
 	assert(F && "binary operator not found!");
 
-	Value * Ops[2] = {L, R};
-	return Builder.CreateCall(F, Ops, "binop");
+	FunctionType * FT = F->getFunctionType();
+	Value * Ops[2] = {ConvertTo(L, FT->getParamType(0)), ConvertTo(R, FT->getParamType(1))};
+	if(!Ops[0] || !Ops[1])
+		return nullptr;
+	return Builder->CreateCall(F, Ops, "binop");
 }
 
 
@@ -146,49 +337,61 @@ Value * IfExprAST::codegen(){
 	if(!CondV)
 		return nullptr;
 
-	// Convert to bool by compare non-equal to 0.0 
-	CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+	// Convert to bool by compare non-equal to 0
+	CondV = CreateIsTrue(CondV, "ifcond");
 
-	Function * TheFunction = Builder.GetInsertBlock()->getParent();
+	Function * TheFunction = Builder->GetInsertBlock()->getParent();
 
 	// create blocks for then and else
 	// insert then block at the end of function
-	BasicBlock * ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-	BasicBlock * ElseBB = BasicBlock::Create(TheContext, "else");
-	BasicBlock * MergeBB = BasicBlock::Create(TheContext, "ifcont");
+	BasicBlock * ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+	BasicBlock * ElseBB = BasicBlock::Create(*TheContext, "else");
+	BasicBlock * MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-	Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+	ProfileBranch(Builder->CreateCondBr(CondV, ThenBB, ElseBB));
 
 	// emit then value
-	Builder.SetInsertPoint(ThenBB);
+	Builder->SetInsertPoint(ThenBB);
 
 	Value * ThenV = Then->codegen();
 	if(!ThenV)
 		return nullptr;
 
-	Builder.CreateBr(MergeBB);
+	Builder->CreateBr(MergeBB);
 	// codegen of then can change the cunrrehnt block,
 	// update ThenBB for the PHI
-	ThenBB = Builder.GetInsertBlock();
+	ThenBB = Builder->GetInsertBlock();
 
 
 	// emit else block
 	TheFunction->getBasicBlockList().push_back(ElseBB);
-	Builder.SetInsertPoint(ElseBB);
+	Builder->SetInsertPoint(ElseBB);
 
 	Value * ElseV = Else->codegen();
 	if(!ElseV)
 		return nullptr;
 
-	Builder.CreateBr(MergeBB);
+	Builder->CreateBr(MergeBB);
 	// because codegen of 'Else' can change the current block, 
 	// update ElseBB for the PHI
-	ElseBB = Builder.GetInsertBlock();
+	ElseBB = Builder->GetInsertBlock();
+
+	// an int arm meeting a double arm is promoted, right before the arm's
+	// branch to the merge block
+	if(ThenV->getType() != ElseV->getType()){
+		Type * DoubleTy = Type::getDoubleTy(*TheContext);
+		Builder->SetInsertPoint(ThenBB->getTerminator());
+		ThenV = ConvertTo(ThenV, DoubleTy);
+		Builder->SetInsertPoint(ElseBB->getTerminator());
+		ElseV = ConvertTo(ElseV, DoubleTy);
+		if(!ThenV || !ElseV)
+			return nullptr;
+	}
 
 	// Emit merge block
 	TheFunction->getBasicBlockList().push_back(MergeBB);
-	Builder.SetInsertPoint(MergeBB);
-	PHINode * PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+	Builder->SetInsertPoint(MergeBB);
+	PHINode * PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
 
 	PN->addIncoming(ThenV, ThenBB);
 	PN->addIncoming(ElseV, ElseBB);
@@ -202,7 +405,7 @@ Value * IfExprAST::codegen(){
 
 
 // Output for-loop as:
-//   var = alloca double
+//   var = alloca double (or i64)
 //   ...
 //   start = startexpr
 //   store start -> var
@@ -220,35 +423,71 @@ Value * IfExprAST::codegen(){
 //   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
-Value * ForExprAST::codegen(){
-	Function * TheFunction = Builder.GetInsertBlock()->getParent();
+// a loop that ends after a few iterations on its own: an int variable from a
+// constant start by a constant step, that the body doesn't assign, while it is
+// below a constant. it gets no cancellation check, it is unrolled and would
+// have a copy of it in every iteration
+static bool IsShortLoop(AllocaInst * Var, Value * Start, Value * Step, Value * EndCond){
+	using namespace PatternMatch;
+	const int64_t MaxIterations = 64;
+	auto * StartC = dyn_cast<ConstantInt>(Start);
+	auto * StepC = dyn_cast<ConstantInt>(Step);
+	ICmpInst::Predicate Pred;
+	ConstantInt * Bound;
+	if(!StartC || !StepC || StepC->getSExtValue() <= 0 ||
+	   !match(EndCond, m_ZExt(m_ICmp(Pred, m_Load(m_Specific(Var)), m_ConstantInt(Bound)))) ||
+	   (Pred != ICmpInst::ICMP_SLT && Pred != ICmpInst::ICMP_SLE))
+		return false;
+	// the stores of the start and of the next value are the only ones
+	unsigned Stores = 0;
+	for(User * U : Var->users())
+		if(auto * SI = dyn_cast<StoreInst>(U))
+			Stores += SI->getPointerOperand() == Var;
+	if(Stores != 2)
+		return false;
+	int64_t Span;
+	if(SubOverflow(Bound->getSExtValue(), StartC->getSExtValue(), Span))
+		return false;
+	return Span / StepC->getSExtValue() < MaxIterations;
+}
 
-	// create an alloca for the variable in the entry block
-	AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+Value * ForExprAST::codegen(){
+	Function * TheFunction = Builder->GetInsertBlock()->getParent();
 
 	// emit the start code first, without 'variable' in scope
 	Value * StartVal = Start->codegen();
 	if(!StartVal)
 		return nullptr;
 
+	// the variable is an int when it starts at an int and the step is an int
+	// constant (or the default 1), this gives the loop a canonical integer
+	// induction variable. it must not overflow
+	bool IntVar = StartVal->getType()->isIntegerTy() && (!Step || Step->isIntConstant());
+	Type * VarTy = IntVar ? Type::getInt64Ty(*TheContext) : Type::getDoubleTy(*TheContext);
+	StartVal = ConvertTo(StartVal, VarTy);
+	if(!StartVal)
+		return nullptr;
+
+	// create an alloca for the variable in the entry block
+	AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, Symbols.getName(VarName), VarTy);
+
 	// Store the value into the alloca
-	Builder.CreateStore(StartVal, Alloca);
+	Builder->CreateStore(StartVal, Alloca);
 
 	// make the new basic block for loop header, inserting after current block
-	BasicBlock * LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+	BasicBlock * LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
 	// insert an explicit fall through from the current block to LoopBB
-	Builder.CreateBr(LoopBB);
+	Builder->CreateBr(LoopBB);
 
 	// start insertion in LoopBB
-	Builder.SetInsertPoint(LoopBB);
+	Builder->SetInsertPoint(LoopBB);
 
 	// within the loop, the varibale is defined equal to the PHI node
-	// if it shadows an existing varibale, we have to restore it,
-	// so save it now
-	// (redefine value name in for ,ex.  i = 5  for i = 1 ...)
-	AllocaInst * OldVal = NamedValues[VarName];
-	NamedValues[VarName] = Alloca;
+	// it may shadow an existing varibale (ex.  i = 5  for i = 1 ...),
+	// which comes back when the scope ends
+	NamedValuesScope Scope(NamedValues);
+	NamedValues.insert(VarName, Alloca);
 
 	// emit the body of the loop
 	// can change the current BB
@@ -262,9 +501,12 @@ Value * ForExprAST::codegen(){
 		StepVal = Step->codegen();
 		if(!StepVal)
 			return nullptr;
+		StepVal = ConvertTo(StepVal, VarTy);
+		if(!StepVal)
+			return nullptr;
 	}else{
-		// if not specified, use 1.0
-		StepVal = ConstantFP::get(TheContext, APFloat(1.0));
+		// if not specified, use 1
+		StepVal = IntVar ? ConstantInt::get(VarTy, 1) : ConstantFP::get(*TheContext, APFloat(1.0));
 	}
 
 
@@ -274,44 +516,207 @@ Value * ForExprAST::codegen(){
 		return nullptr;
 
 	// Reload, increment and restore
-	Value * CurVal = Builder.CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-	Value * NextVar = Builder.CreateFAdd(CurVal, StepVal, "nextvar");
-	Builder.CreateStore(NextVar, Alloca);
+	Value * CurVal = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Symbols.getName(VarName));
+	Value * NextVar = IntVar ? Builder->CreateNSWAdd(CurVal, StepVal, "nextvar")
+							 : Builder->CreateFAdd(CurVal, StepVal, "nextvar");
+	Builder->CreateStore(NextVar, Alloca);
 
-	// covert condition to a bool by comparing non-eqyal to 0.0
-	EndCond = Builder.CreateFCmpONE(EndCond, ConstantFP::get(TheContext, APFloat(0.0)), 
-					"loopcond");
+	// the back-edge, where an asynchronous evaluation can be cancelled
+	bool Short = IsShortLoop(Alloca, StartVal, StepVal, EndCond);
+
+	// covert condition to a bool by comparing non-eqyal to 0
+	EndCond = CreateIsTrue(EndCond, "loopcond");
+
+	if(!Short)
+		EmitCancelCheck();
 
 	// create the "after loop" blcok and insert it
-	BasicBlock * AfterBB = BasicBlock::Create(TheContext, "afterloop", TheFunction);
+	BasicBlock * AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
 
 	// inset the conditional branch into the end of LoopEndBB
-	Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+	ProfileBranch(Builder->CreateCondBr(EndCond, LoopBB, AfterBB));
 
 	// any new code will be inserted in AfterBB
-	Builder.SetInsertPoint(AfterBB);
-
-	// restore the unshadowed variable
-	if(OldVal)
-		NamedValues[VarName] = OldVal;
-	else
-		NamedValues.erase(VarName);
+	Builder->SetInsertPoint(AfterBB);
 
 	// for expr always return 0.0
-	return Constant::getNullValue(Type::getDoubleTy(TheContext));
+	return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
+
+// runtime of pfor, see Runtime.cpp
+// 	double pforrun(int64_t N, int64_t Op, double (*Body)(int64_t, int64_t, void *), void * Env)
+static Function * getPForRun(){
+	if(Function * F = TheModule->getFunction("pforrun"))
+		return F;
+	Type * I64 = Type::getInt64Ty(*TheContext);
+	Type * I8Ptr = Type::getInt8PtrTy(*TheContext);
+	Type * DoubleTy = Type::getDoubleTy(*TheContext);
+	FunctionType * BodyTy = FunctionType::get(DoubleTy, {I64, I64, I8Ptr}, false);
+	FunctionType * FT = FunctionType::get(DoubleTy, {I64, I64, BodyTy->getPointerTo(), I8Ptr}, false);
+	return Function::Create(FT, Function::ExternalLinkage, "pforrun", TheModule.get());
+}
+
+// Output pfor as a call of the runtime, with the loop in a function of its own:
+//   n = trip count of start, end, step
+//   env = { &start, &step, &outer variables the body reads ... }
+//   result = pforrun(n, op, body, env)
+//
+// double body(i64 begin, i64 end, i8 * env):	the iterations [begin, end)
+//   copy start, step and the outer variables in from env
+//   acc = 0 (1 for '*')
+// loop:
+//   var = start + k * step
+//   acc = acc op bodyexpr
+//   br ++k < end, loop, exit
+// exit:
+//   ret acc
+Value * PForExprAST::codegen(){
+	Function * TheFunction = Builder->GetInsertBlock()->getParent();
+	Type * I64 = Type::getInt64Ty(*TheContext);
+	Type * I8Ptr = Type::getInt8PtrTy(*TheContext);
+	Type * DoubleTy = Type::getDoubleTy(*TheContext);
+
+	// start, end and step are evaluated once, before any iteration
+	Value * StartVal = Start->codegen();
+	Value * EndVal = StartVal ? End->codegen() : nullptr;
+	if(!EndVal)
+		return nullptr;
+	Value * StepVal = nullptr;
+	if(Step && !(StepVal = Step->codegen()))
+		return nullptr;
+
+	// same rule as for: an int variable when it starts at an int and steps by an int constant
+	bool IntVar = StartVal->getType()->isIntegerTy() && (!Step || Step->isIntConstant());
+	Type * VarTy = IntVar ? I64 : DoubleTy;
+	StartVal = ConvertTo(StartVal, VarTy);
+	EndVal = ConvertTo(EndVal, VarTy);
+	StepVal = StepVal ? ConvertTo(StepVal, VarTy)
+					  : IntVar ? ConstantInt::get(VarTy, 1) : ConstantFP::get(VarTy, 1.0);
+	if(!StartVal || !EndVal || !StepVal)
+		return nullptr;
+
+	// the trip count, 0 unless end > start and step > 0
+	Value * Span, * Valid, * Count;
+	if(IntVar){
+		Span = Builder->CreateSub(EndVal, StartVal, "pfor.span");
+		Valid = Builder->CreateAnd(Builder->CreateICmpSGT(Span, ConstantInt::get(I64, 0)),
+								   Builder->CreateICmpSGT(StepVal, ConstantInt::get(I64, 0)));
+		Value * SafeStep = Builder->CreateSelect(Valid, StepVal, ConstantInt::get(I64, 1));
+		Count = Builder->CreateSDiv(Builder->CreateAdd(Span, Builder->CreateSub(SafeStep, ConstantInt::get(I64, 1))),
+									SafeStep, "pfor.count");
+	}else{
+		Span = Builder->CreateFSub(EndVal, StartVal, "pfor.span");
+		Valid = Builder->CreateAnd(Builder->CreateFCmpOGT(Span, ConstantFP::get(DoubleTy, 0.0)),
+								   Builder->CreateFCmpOGT(StepVal, ConstantFP::get(DoubleTy, 0.0)));
+		Value * Iters = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, Builder->CreateFDiv(Span, StepVal));
+		Count = Builder->CreateFPToSI(Builder->CreateSelect(Valid, Iters, ConstantFP::get(DoubleTy, 0.0)), I64,
+									  "pfor.count");
+	}
+	Count = Builder->CreateSelect(Valid, Count, ConstantInt::get(I64, 0));
+
+	// the env points at them
+	AllocaInst * StartA = CreateEntryBlockAlloca(TheFunction, "pfor.start", VarTy);
+	AllocaInst * StepA = CreateEntryBlockAlloca(TheFunction, "pfor.step", VarTy);
+	Builder->CreateStore(StartVal, StartA);
+	Builder->CreateStore(StepVal, StepA);
+
+	// the body function, internal so it is never called but through pforrun
+	FunctionType * BodyTy = FunctionType::get(DoubleTy, {I64, I64, I8Ptr}, false);
+	Function * BodyFn = Function::Create(BodyTy, Function::InternalLinkage,
+										 TheFunction->getName() + ".pfor", TheModule.get());
+	auto ArgIt = BodyFn->arg_begin();
+	Argument * Begin = &*ArgIt++;
+	Argument * EndArg = &*ArgIt++;
+	Argument * EnvArg = &*ArgIt;
+	Begin->setName("begin");
+	EndArg->setName("end");
+	EnvArg->setName("env");
+
+	auto SavedIP = Builder->saveIP();
+	BasicBlock * EntryBB = BasicBlock::Create(*TheContext, "entry", BodyFn);
+	BasicBlock * LoopBB = BasicBlock::Create(*TheContext, "pfor.loop", BodyFn);
+	Builder->SetInsertPoint(EntryBB);
+	Value * Env = Builder->CreateBitCast(EnvArg, I8Ptr->getPointerTo(), "env.slots");
+	Instruction * ToLoop = Builder->CreateBr(LoopBB);
+
+	PForOutline Outline(BodyFn, CurPFor, Env, ToLoop);
+	CurPFor = &Outline;
+	Value * BodyStart = Outline.loadSlot(VarTy);
+	Outline.Slots.push_back(StartA);
+	Value * BodyStep = Outline.loadSlot(VarTy);
+	Outline.Slots.push_back(StepA);
+	BodyStart = Outline.Init.CreateLoad(VarTy, BodyStart, "start");
+	BodyStep = Outline.Init.CreateLoad(VarTy, BodyStep, "step");
+
+	double Identity = Reduction == '*' ? 1.0 : 0.0;
+	AllocaInst * Acc = CreateEntryBlockAlloca(BodyFn, "acc", DoubleTy);
+	AllocaInst * K = CreateEntryBlockAlloca(BodyFn, "k", I64);
+	AllocaInst * Var = CreateEntryBlockAlloca(BodyFn, Symbols.getName(VarName), VarTy);
+	Outline.Init.CreateStore(ConstantFP::get(DoubleTy, Identity), Acc);
+	Outline.Init.CreateStore(Begin, K);
+
+	// the variable of iteration k
+	Builder->SetInsertPoint(LoopBB);
+	Value * KVal = Builder->CreateLoad(I64, K, "k");
+	Value * VarVal = IntVar ? Builder->CreateAdd(BodyStart, Builder->CreateMul(KVal, BodyStep))
+							: Builder->CreateFAdd(BodyStart, Builder->CreateFMul(Builder->CreateSIToFP(KVal, DoubleTy),
+																				 BodyStep));
+	Builder->CreateStore(VarVal, Var);
+
+	Value * BodyVal;
+	{
+		NamedValuesScope Scope(NamedValues);
+		NamedValues.insert(VarName, Var);
+		BodyVal = Body->codegen();
+		if(BodyVal && Reduction)
+			BodyVal = ConvertTo(BodyVal, DoubleTy);
+	}
+	CurPFor = Outline.Parent;
+	if(!BodyVal){
+		Builder->restoreIP(SavedIP);
+		BodyFn->eraseFromParent();
+		return nullptr;
+	}
+
+	if(Reduction){
+		Value * AccVal = Builder->CreateLoad(DoubleTy, Acc, "acc");
+		Builder->CreateStore(Reduction == '+' ? Builder->CreateFAdd(AccVal, BodyVal, "acc")
+											  : Builder->CreateFMul(AccVal, BodyVal, "acc"), Acc);
+	}
+	Value * NextK = Builder->CreateAdd(KVal, ConstantInt::get(I64, 1), "nextk");
+	Builder->CreateStore(NextK, K);
+	BasicBlock * ExitBB = BasicBlock::Create(*TheContext, "pfor.exit", BodyFn);
+	Builder->CreateCondBr(Builder->CreateICmpSLT(NextK, EndArg), LoopBB, ExitBB);
+	Builder->SetInsertPoint(ExitBB);
+	Builder->CreateRet(Builder->CreateLoad(DoubleTy, Acc, "acc"));
+	verifyFunction(*BodyFn);
+
+	// the env, and the call
+	Builder->restoreIP(SavedIP);
+	ArrayType * EnvTy = ArrayType::get(I8Ptr, Outline.Slots.size());
+	AllocaInst * EnvA = CreateEntryBlockAlloca(TheFunction, "pfor.env", EnvTy);
+	for(unsigned I = 0, E = Outline.Slots.size(); I != E; ++I)
+		Builder->CreateStore(Builder->CreateBitCast(Outline.Slots[I], I8Ptr),
+							 Builder->CreateConstInBoundsGEP2_32(EnvTy, EnvA, 0, I));
+	Value * Op = ConstantInt::get(I64, Reduction);
+	return Builder->CreateCall(getPForRun(), {Count, Op, BodyFn, Builder->CreateBitCast(EnvA, I8Ptr)},
+							   "pfor");
 }
 
 
 
 Value * VarExprAST::codegen(){
-	std::vector<AllocaInst *> OldBindings;
+	// the variables live until the end of this scope
+	NamedValuesScope Scope(NamedValues);
 
-	Function * TheFunction = Builder.GetInsertBlock()->getParent();
+	Function * TheFunction = Builder->GetInsertBlock()->getParent();
 
 	// register all varibales and emit their initializer
 	for(unsigned i = 0, e = VarNames.size(); i != e; ++i){
-		const std::string & VarName = VarNames[i].first;
-		ExprAST * Init = VarNames[i].second.get();
+		Symbol VarName = VarNames[i].Name;
+		ExprAST * Init = VarNames[i].Init;
+		Type * Ty = getLLVMType(VarNames[i].Ty);
 
 		// emit the initializer before adding the variable to scope, 
 		// this prevents the initializer from referencing the varibale itself,
@@ -323,20 +728,19 @@ Value * VarExprAST::codegen(){
 			InitVal = Init->codegen();
 			if(!InitVal)
 				return nullptr;
+			InitVal = ConvertTo(InitVal, Ty);
+			if(!InitVal)
+				return nullptr;
 		}else{ 
-			// if not specified, use 0.0
-			InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+			// if not specified, use 0
+			InitVal = Constant::getNullValue(Ty);
 		}
 
-		AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-		Builder.CreateStore(InitVal, Alloca);
+		AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, Symbols.getName(VarName), Ty);
+		Builder->CreateStore(InitVal, Alloca);
 
-		// remeber the old varibale binding so that we can restore the binding
-		// when we unrecurse
-		OldBindings.push_back(NamedValues[VarName]);
-
-		// remeber this binding
-		NamedValues[VarName] = Alloca;
+		// remeber this binding, it shadows an outer one until the scope ends
+		NamedValues.insert(VarName, Alloca);
 	}
 
 	// codegen the body, now that all vars are in scope
@@ -344,21 +748,78 @@ Value * VarExprAST::codegen(){
 	if(!BodyVal)
 		return nullptr;
 
-	// pop all our variables from scope
-	for(unsigned i = 0, e = VarNames.size(); i != e; ++i){
-		NamedValues[VarNames[i].first] = OldBindings[i];
-	}
-
 	// return the body computation
 	return BodyVal;
 }
 
 
 
+// runtime of array(n), see toy.cpp. the result is fresh memory (noalias),
+// the first element is 64 byte aligned
+static Function * getArrayAlloc(){
+	if(Function * F = TheModule->getFunction("arrayalloc"))
+		return F;
+	FunctionType * FT = FunctionType::get(Type::getDoublePtrTy(*TheContext),
+										  Type::getInt64Ty(*TheContext), false);
+	Function * F = Function::Create(FT, Function::ExternalLinkage, "arrayalloc", TheModule.get());
+	F->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+	F->addAttribute(AttributeList::ReturnIndex, Attribute::getWithAlignment(*TheContext, Align(64)));
+	return F;
+}
+
+// the array builtins, they come before user functions of the same name
+// 	array(n)	a new array of n doubles set to 0, n is an int
+// 	len(a)		the number of elements of a, as an int
+// interned on first use: Symbols is defined in lexer.cpp, it may not be
+// constructed yet while the statics of this file are
+Symbol getArraySym(){
+	static const Symbol Sym = Symbols.intern("array");
+	return Sym;
+}
+
+static Symbol getLenSym(){
+	static const Symbol Sym = Symbols.intern("len");
+	return Sym;
+}
+
+bool isArrayBuiltin(Symbol Name){
+	return Name == getArraySym() || Name == getLenSym();
+}
+
+static Value * CodegenArrayBuiltin(Symbol Name, ArrayRef<ExprAST *> Args){
+	if(Args.size() != 1)
+		return LogErrorV("Incorrect # arguments passed");
+	Value * V = Args[0]->codegen();
+	if(!V)
+		return nullptr;
+
+	Type * I64 = Type::getInt64Ty(*TheContext);
+	if(Name == getArraySym()){
+		V = ConvertTo(V, I64);
+		if(!V)
+			return nullptr;
+		return Builder->CreateCall(getArrayAlloc(), V, "array");
+	}
+
+	// the length sits in the 8 bytes before the first element and never
+	// changes, so the load is invariant and can leave any loop
+	if(!V->getType()->isPointerTy())
+		return LogErrorV("len needs an array");
+	Value * LenPtr = Builder->CreateInBoundsGEP(I64, Builder->CreateBitCast(V, I64->getPointerTo()),
+												ConstantInt::get(I64, -1, true), "lenptr");
+	LoadInst * Len = Builder->CreateAlignedLoad(I64, LenPtr, MaybeAlign(8), "len");
+	Len->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(*TheContext, None));
+	return Len;
+}
+
+
 // LLVM uses the native C calling conventions by default, 
 // allowing these calls to also call into standard library functions,
 // with no additional effort
 Value * CallExprAST::codegen(){
+	if(isArrayBuiltin(Callee))
+		return CodegenArrayBuiltin(Callee, Args);
+
 	// find name in globe module table
 	Function * CalleeF = getFunction(Callee);
 	if(!CalleeF)
@@ -367,95 +828,125 @@ Value * CallExprAST::codegen(){
 	if(CalleeF->arg_size() != Args.size())
 		return LogErrorV("Incorrect # arguments passed");
 
+	// arguments are converted to the parameter types
 	std::vector<Value *> ArgsV;
 	for(unsigned i = 0, e = Args.size(); i != e; ++i){
-		ArgsV.push_back(Args[i]->codegen());
+		Value * V = Args[i]->codegen();
+		if(!V)
+			return nullptr;
+		ArgsV.push_back(ConvertTo(V, CalleeF->getFunctionType()->getParamType(i)));
 		if(!ArgsV.back())
 			return nullptr;
 	}
 
-	return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+	return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
 
 Function * PrototypeAST::codegen(){
-	// type: double (double , double) etc
+	// type: double (double , i64) etc
 	// There is not vararg (the false parameter indicates this)
-	std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
+	std::vector<Type *> ParamTypes;
+	for(ValType Ty : ArgTypes)
+		ParamTypes.push_back(getLLVMType(Ty));
 
 	FunctionType * FT = 
-		FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+		FunctionType::get(getLLVMType(RetType), ParamTypes, false);
 
 	// “external linkage” means that the function may be defined outside the current
 	//  module and/or that it is callable by functions outside the module
 	Function * F =
 		Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+	// an older declaration of the same name keeps its place (LLVM renamed this one)
+	ModuleFunctions.try_emplace(Sym, F);
 
 	// Set namesfor all arguments
+	// array arguments of one call must not overlap (like Fortran), they are
+	// noalias so loops over them vectorize without runtime checks
 	unsigned Idx = 0;
-	for(auto &Arg : F->args())
+	for(auto &Arg : F->args()){
+		if(ArgTypes[Idx] == Ty_Array)
+			Arg.addAttr(Attribute::NoAlias);
 		Arg.setName(Args[Idx++]);
+	}
 
 	return F;
 }
 
 
 Function * FunctionAST::codegen(){
-	// Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below
+	// copy the prototype into the FunctionProtos map, the definition keeps its own
+	// so it can be compiled again (tier up, profile guided recompile)
 	auto & P = *Proto;
-	FunctionProtos[Proto->getName()] = std::move(Proto);
+	TraceScope Span(TP_Codegen, P.getName());
+	{
+		std::lock_guard<std::mutex> Lock(FunctionProtosMutex);
+		FunctionProtos[P.getSym()] = std::make_unique<PrototypeAST>(P);
+	}
+
+	// without a profile set up by the caller, use the -profile-use one if any
+	ProfileCodegen LoadedPCG;
+	LoadedPCG.Weights = LookupProfile(P.getSym());
+	ProfileCodegenScope ProfScope(CurProfileCG ? *CurProfileCG : LoadedPCG);
 
 	// First, check for an existing function from a previous 'extern' declaration.
-	Function * TheFunction = getFunction(P.getName());
+	Function * TheFunction = getFunction(P.getSym());
 
 	if(!TheFunction)
 		return nullptr;
 
-	// If this is an operator, install it
-	if(P.isBinaryOp())
-		BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+	// only possible when several definitions share one module (batch mode)
+	if(!TheFunction->empty())
+		return (Function *)LogErrorV("Function cannot be redefined.");
+
+	// an earlier 'extern' declaration with another number of arguments
+	if(TheFunction->arg_size() != P.getArgs().size())
+		return (Function *)LogErrorV("Function definition doesn't match its declaration");
 
 	// Create a new basic block to start
-	BasicBlock * BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-	Builder.SetInsertPoint(BB);
+	BasicBlock * BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+	Builder->SetInsertPoint(BB);
+	ProfileFunctionEntry(TheFunction);
 
-	// Record arguments
-	NamedValues.clear();
+	// Record arguments, in the outermost scope of the body
+	NamedValuesScope Scope(NamedValues);
 	for(auto & Arg : TheFunction->args()){
 		// create an alloca for this variable
-		AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+		AllocaInst * Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
 
 		// store the initial value into the alloca
-		Builder.CreateStore(&Arg, Alloca);
+		Builder->CreateStore(&Arg, Alloca);
 
-		// Add arguments to variable symbol table
-		NamedValues[Arg.getName()] = Alloca;
+		// Add arguments to variable symbol table, under the names of the definition
+		NamedValues.insert(P.getArgSyms()[Arg.getArgNo()], Alloca);
 	}
+	MemoSite Memo = MemoFunctionEntry(TheFunction, P.getSym());
 
-	if(Value * RetVal = Body->codegen()){
+	Value * RetVal = Body->codegen();
+	if(RetVal)
+		RetVal = ConvertTo(RetVal, TheFunction->getReturnType());
+	if(RetVal){
 		// finish
-		Builder.CreateRet(RetVal);
+		MemoFunctionExit(Memo, RetVal);
+		Builder->CreateRet(RetVal);
+		FinishProfile(TheFunction);
 
 		// This function does a variety of consistency checks on the generated code, 
 		// to determine if our compiler is doing everything right
 		// it can catch a lot of bugs
 		verifyFunction(*TheFunction);
 
-		// Optimize the function
-		TheFPM->run(*TheFunction);
-
 		return TheFunction;
 	}else{
 		// error body, remove function
+		forgetFunction(TheFunction);
 		TheFunction->eraseFromParent();
 		return nullptr;
 	}
 
 	// TODO:
 	// an earlier ‘extern’ declaration will take precedence over the function 
-	// definition’s signature, which can cause codegen to fail, for instance if the function
-	// arguments are named differently
+	// definition’s signature, so its argument and return types win
 }
 
 
@@ -464,14 +955,84 @@ Value * UnaryExprAST::codegen(){
 	if(!OperandV)
 		return nullptr;
 
-	Function * F = getFunction(std::string("unary") + Opcode);
+	Function * F = getFunction(OpFn);
 	if(!F)
 		return LogErrorV("Unknown unary operator");
 
-	return Builder.CreateCall(F, OperandV, "unop");
+	OperandV = ConvertTo(OperandV, F->getFunctionType()->getParamType(0));
+	if(!OperandV)
+		return nullptr;
+	return Builder->CreateCall(F, OperandV, "unop");
  }
 
 
+// hot swap: a definition is compiled under a versioned name "foo.N" and the JIT
+// keeps an indirection stub "foo" pointing at the newest body. every other module
+// only declares "foo", so its calls go through the stub, and a redefinition just
+// re-points the stub: callers compiled earlier are not touched and run the new
+// body from their next call on
+cl::opt<bool>
+HotSwap("hot-swap",
+		cl::desc("Call functions across modules through JIT indirection stubs, "
+				 "so a redefinition replaces the body for every caller"),
+		cl::init(true));
+
+DenseMap<Symbol, unsigned> BodyVersions;
+
+// rename the definition F of Sym to its body name, before its module is optimized
+// the other functions of the module get a declaration of the stub to call, only
+// the recursive calls of F itself stay direct
+// returns the body name, empty when hot swap is off
+std::string RenameToBody(Function * F, Symbol Sym){
+	if(!HotSwap)
+		return "";
+	// the stub must exist before anything that calls it is linked, it points
+	// nowhere until SwapInBody
+	if(Error Err = TheJIT->reserveStub(Symbols.getName(Sym).str())){
+		logAllUnhandledErrors(std::move(Err), errs(), "hot swap: ");
+		return "";
+	}
+
+	std::string BodyName = (Symbols.getName(Sym) + "." + Twine(++BodyVersions[Sym])).str();
+	forgetFunction(F);
+	F->setName(BodyName);
+
+	Function * Stub = Function::Create(F->getFunctionType(), Function::ExternalLinkage,
+									   Symbols.getName(Sym), F->getParent());
+	Stub->copyAttributesFrom(F);
+	F->replaceUsesWithIf(Stub, [F](Use &U){
+		auto * I = dyn_cast<Instruction>(U.getUser());
+		return !I || I->getFunction() != F;
+	});
+	ModuleFunctions[Sym] = Stub;
+	return BodyName;
+}
+
+// point the stub of Sym at BodyName, once the module holding it is in the JIT
+bool SwapInBody(Symbol Sym, const std::string &BodyName){
+	if(BodyName.empty())
+		return true;
+	auto Body = TheJIT->findSymbol(BodyName);
+	if(!Body){
+		LogError("Function not found");
+		return false;
+	}
+	JITTargetAddress Addr = cantFail(Body.getAddress());
+
+	auto T0 = std::chrono::steady_clock::now();
+	if(Error Err = TheJIT->updateStub(Symbols.getName(Sym).str(), Addr)){
+		logAllUnhandledErrors(std::move(Err), errs(), "hot swap: ");
+		return false;
+	}
+	auto T1 = std::chrono::steady_clock::now();
+
+	if(BodyVersions.lookup(Sym) > 1)
+		fprintf(stderr, "Swapped in %s: stub re-pointed in %.2f us\n", BodyName.c_str(),
+				std::chrono::duration<double, std::micro>(T1 - T0).count());
+	return true;
+}
+
+
 
 
 
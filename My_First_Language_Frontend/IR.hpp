@@ -2,7 +2,9 @@
 
 #include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopedHashTable.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -13,11 +15,9 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
 #include <algorithm>
 #include <cassert>
 #include <cctype>
@@ -26,6 +26,7 @@
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -33,12 +34,46 @@
 
 using namespace llvm;
 
-static LLVMContext TheContext; // owns a lot of core LLVM data structures
-static IRBuilder<> Builder(TheContext); // a helper object that makes it easy to generate LLVM instructions
-static std::unique_ptr<Module> TheModule; // contains functions and global variables
+// codegen state is per thread, so functions can be compiled in parallel (batch -j N),
+// each thread sets up its own in InitializeModuleAndPassManager
+extern thread_local std::unique_ptr<LLVMContext> TheContext; // owns a lot of core LLVM data structures
+extern thread_local std::unique_ptr<IRBuilder<>> Builder; // a helper object that makes it easy to generate LLVM instructions
+extern thread_local std::unique_ptr<Module> TheModule; // contains functions and global variables
 // keeps track of which values address are defined in the current scope and what their LLVM representation is
-static std::map<std::string, AllocaInst *> NamedValues; 
+// a scope stack: a function body, for loop or var/in opens a NamedValuesScope, leaving
+// it drops the bindings made in it and uncovers the ones they shadowed
+extern thread_local ScopedHashTable<Symbol, AllocaInst *> NamedValues;
+using NamedValuesScope = ScopedHashTableScope<Symbol, AllocaInst *>;
+// the functions declared in TheModule, so a call doesn't search the module by name
+extern thread_local DenseMap<Symbol, Function *> ModuleFunctions;
+extern std::unique_ptr<orc::KaleidoscopeJIT> TheJIT;
+extern DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos; //  holds the most recent prototype for each function
+extern std::mutex FunctionProtosMutex; // FunctionProtos is shared by all codegen threads
 
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos; //  holds the most recent prototype for each function
\ No newline at end of file
+// open a new module for the calling thread, see Paser.cpp
+void InitializeModuleAndPassManager(void);
+
+// run the -O pipeline over a finished module, see Paser.cpp
+// LTO runs the link time pipeline instead, for a whole program (toy -aot -lto)
+void OptimizeModule(Module &M, TargetMachine *TM, bool LTO = false);
+
+// the rest of IR.cpp that the driver and the other passes use
+Value * LogErrorV(const char * Str);
+// the declaration of Name in TheModule, from its prototype if it has none yet
+Function * getFunction(Symbol Name);
+// call before F is renamed or erased, ModuleFunctions must not keep it
+void forgetFunction(Function * F);
+AllocaInst * CreateEntryBlockAlloca(Function * TheFunction, StringRef VarName, Type * Ty);
+
+// array(n) and len(a), they come before user functions of the same name
+Symbol getArraySym();
+bool isArrayBuiltin(Symbol Name);
+
+// hot swap: the definitions of the REPL are called through JIT stubs
+extern cl::opt<bool> HotSwap;
+// the last body version of every function that got one
+extern DenseMap<Symbol, unsigned> BodyVersions;
+// rename F to its next body version, returns the name, empty without hot swap
+std::string RenameToBody(Function * F, Symbol Sym);
+// point the stub of Sym at BodyName, once that is in the JIT
+bool SwapInBody(Symbol Sym, const std::string &BodyName);
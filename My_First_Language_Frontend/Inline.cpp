@@ -0,0 +1,271 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "IR.hpp"
+#include "Inline.hpp"
+#include "Paser.hpp"
+#include "Trace.hpp"
+
+// cross-module inlining in the REPL
+// every definition lands in a module of its own, later modules only declare it,
+// so the inliner never sees small helpers like a user defined binary| or unary!.
+// the inline library keeps the optimized body of every small definition, and a
+// new module gets the bodies of the functions it declares imported as
+// available_externally: the inliner may copy them, codegen drops them and the
+// calls left go through the stub as before.
+//
+// a redefinition makes every body that inlined the old one stale: stale bodies
+// are not imported, and their definitions are compiled again (from the code
+// codegen made for them, kept in the library too) and swapped in
+
+static cl::opt<bool>
+CrossModuleInline("cross-module-inline",
+				  cl::desc("Let the inliner see the bodies of functions defined in earlier REPL modules"),
+				  cl::init(true));
+
+static cl::opt<unsigned>
+InlineImportLimit("inline-import-limit",
+				  cl::desc("Largest definition, in instructions, whose body later modules import"),
+				  cl::init(100));
+
+// the library lives in the context of the REPL thread, it is never compiled
+// thread_local like TheContext and declared after it, so it goes first at exit
+static thread_local std::unique_ptr<Module> InlineLibrary;
+
+struct LibraryEntry{
+	Function * Body = nullptr;			// optimized, named like the stub, nullptr when too big
+	Function * Source = nullptr;		// as codegen left it, to compile it again
+	SmallVector<Symbol, 4> Contains;	// functions whose code it may have inlined
+	bool Stale = false;					// one of them was redefined since
+};
+
+static DenseMap<Symbol, LibraryEntry> Library;
+static unsigned NumImportedBodies, NumStaleRecompiles;
+
+
+// the functions an instruction refers to, also inside constant expressions
+// false when it refers to another kind of global or to a function only its own
+// module sees (a pfor body), a body like that isn't copied
+static bool CollectCallees(const User * U, SmallVectorImpl<const Function *> & Callees){
+	for(const Use & Op : U->operands()){
+		if(auto * F = dyn_cast<Function>(Op.get())){
+			if(!F->hasName() || F->hasLocalLinkage())
+				return false;
+			Callees.push_back(F);
+		}else if(isa<GlobalValue>(Op.get())){
+			return false;
+		}else if(auto * CE = dyn_cast<ConstantExpr>(Op.get())){
+			if(!CollectCallees(CE, Callees))
+				return false;
+		}
+	}
+	return true;
+}
+
+// copy the body of From into the empty function To, in another module of the
+// same context. the functions From calls become declarations in the module of
+// To, recursive calls of From call To. false when it can't be copied
+static bool CloneBody(Function * To, const Function * From){
+	Module * M = To->getParent();
+	SmallVector<const Function *, 8> Callees;
+	for(const Instruction & I : instructions(From))
+		if(!CollectCallees(&I, Callees))
+			return false;
+
+	ValueToValueMapTy VMap;
+	VMap[From] = To;
+	for(const Function * Callee : Callees){
+		if(VMap.count(Callee))
+			continue;
+		Function * Decl = M->getFunction(Callee->getName());
+		if(!Decl){
+			Decl = Function::Create(Callee->getFunctionType(), Function::ExternalLinkage,
+									Callee->getName(), M);
+			Decl->copyAttributesFrom(Callee);
+		}else if(Decl->getFunctionType() != Callee->getFunctionType()){
+			return false;
+		}
+		VMap[Callee] = Decl;
+	}
+	auto ToArg = To->arg_begin();
+	for(const Argument & Arg : From->args())
+		VMap[&Arg] = &*ToArg++;
+
+	SmallVector<ReturnInst *, 4> Returns;
+	CloneFunctionInto(To, From, VMap, true, Returns);
+	return true;
+}
+
+// the library function Name of type FT, without a body
+// an old one of another type is left to the bodies still calling it, nameless
+static Function * GetLibraryFunction(Function * Old, StringRef Name, FunctionType * FT){
+	if(!InlineLibrary)
+		InlineLibrary = std::make_unique<Module>("inline library", *TheContext);
+	if(!Old)
+		Old = InlineLibrary->getFunction(Name);
+	if(Old && Old->getFunctionType() == FT){
+		Old->deleteBody();
+		return Old;
+	}
+	if(Old){
+		Old->deleteBody();
+		Old->setName("");
+	}
+	return Function::Create(FT, Function::ExternalLinkage, Name, InlineLibrary.get());
+}
+
+
+// give the declarations of M that have a fresh library body that body
+// Defined is the function M defines, its old body is never imported
+// the symbols whose code came in are added to Contains
+void ImportInlineBodies(Module & M, Symbol Defined, SmallVectorImpl<Symbol> * Contains){
+	if(!CrossModuleInline || Library.empty())
+		return;
+	SmallVector<Function *, 16> Worklist;
+	for(Function & F : M)
+		if(F.isDeclaration())
+			Worklist.push_back(&F);
+
+	while(!Worklist.empty()){
+		Function * F = Worklist.pop_back_val();
+		if(!F->isDeclaration())
+			continue;
+		Symbol Sym = Symbols.find(F->getName());
+		if(Sym == ~0U || Sym == Defined)
+			continue;
+		auto It = Library.find(Sym);
+		if(It == Library.end() || !It->second.Body || It->second.Stale ||
+		   It->second.Body->getFunctionType() != F->getFunctionType())
+			continue;
+		if(!CloneBody(F, It->second.Body))
+			continue;
+		F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+		++NumImportedBodies;
+
+		if(Contains){
+			for(Symbol S : It->second.Contains)
+				if(!is_contained(*Contains, S))
+					Contains->push_back(S);
+			if(!is_contained(*Contains, Sym))
+				Contains->push_back(Sym);
+		}
+
+		// the imported body may call other library functions
+		for(Instruction & I : instructions(F))
+			if(auto * Call = dyn_cast<CallInst>(&I))
+				if(Function * Callee = Call->getCalledFunction())
+					if(Callee->isDeclaration())
+						Worklist.push_back(Callee);
+	}
+}
+
+// every body that has code of Sym in it is stale now
+static void MarkStale(Symbol Sym){
+	for(auto & KV : Library)
+		if(is_contained(KV.second.Contains, Sym))
+			KV.second.Stale = true;
+}
+
+// between codegen and OptimizeModule of F, the definition of Sym: keep its code,
+// and import the bodies it may inline. a redefinition (not a recompile of the
+// same code) makes the bodies that inlined the old one stale
+void PrepareDefinition(Function * F, Symbol Sym, bool Redefinition){
+	if(!CrossModuleInline)
+		return;
+	if(Redefinition)
+		MarkStale(Sym);
+
+	LibraryEntry & E = Library[Sym];
+	// only a stub lets a definition compiled again replace the old one
+	if(HotSwap){
+		E.Source = GetLibraryFunction(E.Source, (Symbols.getName(Sym) + ".src").str(),
+									  F->getFunctionType());
+		if(!CloneBody(E.Source, F)){
+			E.Source->eraseFromParent();
+			E.Source = nullptr;
+		}
+	}
+	E.Contains.clear();
+	ImportInlineBodies(*F->getParent(), Sym, &E.Contains);
+}
+
+// after OptimizeModule of F: later modules import this body of Sym
+void PublishDefinition(Function * F, Symbol Sym){
+	if(!CrossModuleInline)
+		return;
+	LibraryEntry & E = Library[Sym];
+	E.Stale = false;
+	if(F->getInstructionCount() > InlineImportLimit){
+		if(E.Body)
+			E.Body->deleteBody();
+		E.Body = nullptr;
+		return;
+	}
+	E.Body = GetLibraryFunction(E.Body, Symbols.getName(Sym), F->getFunctionType());
+	if(!CloneBody(E.Body, F))
+		E.Body = nullptr;
+}
+
+// compile a stale definition again from its source, its stale imports first
+static void RecompileStale(Symbol Sym, DenseSet<Symbol> & Visited){
+	if(!Visited.insert(Sym).second)
+		return;
+	auto It = Library.find(Sym);
+	if(It == Library.end() || !It->second.Stale || !It->second.Source)
+		return;
+	SmallVector<Symbol, 4> Contains = It->second.Contains;
+	for(Symbol S : Contains)
+		RecompileStale(S, Visited);
+
+	LibraryEntry & E = Library[Sym];
+	Function * F = Function::Create(E.Source->getFunctionType(), Function::ExternalLinkage,
+									Symbols.getName(Sym), TheModule.get());
+	if(!CloneBody(F, E.Source)){
+		InitializeModuleAndPassManager();
+		return;
+	}
+	std::string BodyName = RenameToBody(F, Sym);
+	E.Contains.clear();
+	ImportInlineBodies(*TheModule, Sym, &E.Contains);
+	OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+	PublishDefinition(F, Sym);
+	{
+		TraceScope Span(TP_JIT, Symbols.getName(Sym));
+		TheJIT->addModule(std::move(TheModule));
+	}
+	InitializeModuleAndPassManager();
+	SwapInBody(Sym, BodyName);
+	++NumStaleRecompiles;
+}
+
+// after a redefinition is swapped in: compile everything that inlined
+// the old body again
+void RecompileStaleDefinitions(){
+	if(!CrossModuleInline || !HotSwap)
+		return;
+	SmallVector<Symbol, 8> Stale;
+	for(auto & KV : Library)
+		if(KV.second.Stale)
+			Stale.push_back(KV.first);
+	DenseSet<Symbol> Visited;
+	for(Symbol Sym : Stale)
+		RecompileStale(Sym, Visited);
+}
+
+void PrintInlineStats(){
+	if(CrossModuleInline)
+		fprintf(stderr, "inline library: %u definitions, %u bodies imported, %u stale definitions recompiled\n",
+				Library.size(), NumImportedBodies, NumStaleRecompiles);
+}
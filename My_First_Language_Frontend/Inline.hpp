@@ -0,0 +1,29 @@
+#pragma once
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "Symbol.hpp"
+
+// cross-module inlining in the REPL, see Inline.cpp
+
+// give the declarations of M that have a fresh library body that body
+// Defined is the function M defines, its old body is never imported
+// the symbols whose code came in are added to Contains
+void ImportInlineBodies(llvm::Module & M, Symbol Defined,
+						llvm::SmallVectorImpl<Symbol> * Contains = nullptr);
+
+// between codegen and OptimizeModule of F, the definition of Sym: keep its
+// code and import the bodies it may inline. Redefinition makes the bodies
+// that inlined the old one stale
+void PrepareDefinition(llvm::Function * F, Symbol Sym, bool Redefinition);
+
+// after OptimizeModule of F: later modules import this body of Sym
+void PublishDefinition(llvm::Function * F, Symbol Sym);
+
+// after a redefinition is swapped in: compile everything that inlined the
+// old body again
+void RecompileStaleDefinitions();
+
+// -repl-stats
+void PrintInlineStats();
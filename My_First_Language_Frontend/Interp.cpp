@@ -0,0 +1,738 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "IR.hpp"
+#include "Interp.hpp"
+#include "Paser.hpp"
+#include "Runtime.hpp"
+#include "Trace.hpp"
+
+using namespace llvm;
+
+
+// tiered execution: definitions are not compiled when they are read, calls run
+// in this tree-walking interpreter until a function has been called TierThreshold
+// times, then it goes through FunctionAST::codegen and the JIT, and every later
+// call jumps to the native code. top-level expressions are always interpreted
+cl::opt<unsigned>
+TierThreshold("tier-threshold",
+			  cl::desc("Interpret functions until they are called N times, then JIT them "
+					   "(0 compiles every definition right away)"),
+			  cl::init(0));
+
+
+// InterpFrame, the variables of one interpreted call, innermost binding last
+// a variable keeps the type it was declared with, see BinaryExprAST::eval
+class InterpFrame{
+	SmallVector<std::pair<Symbol, InterpValue>, 8> Vars;
+
+public:
+	void push(Symbol Name, InterpValue Val){ Vars.push_back(std::make_pair(Name, Val)); }
+	void pop(size_t N = 1){ Vars.resize(Vars.size() - N); }
+
+	// the pointer is only valid until the next push
+	InterpValue * lookup(Symbol Name){
+		for(auto I = Vars.rbegin(), E = Vars.rend(); I != E; ++I)
+			if(I->first == Name)
+				return &I->second;
+		return nullptr;
+	}
+};
+
+
+// a function defined while tiering is on
+struct TieredFunction{
+	std::unique_ptr<FunctionAST> AST;		// body for the interpreter
+	std::unique_ptr<PrototypeAST> Proto;	// codegen takes the one in AST
+	unsigned Calls = 0;
+	void * Native = nullptr;				// set once it is compiled, see GetNativeEntry
+};
+
+// an extern or builtin called from the interpreter
+struct ExternFunction{
+	std::unique_ptr<PrototypeAST> Proto;
+	void * Native = nullptr;
+};
+
+// keyed by the symbol of the function name, entries move when the maps grow
+static DenseMap<Symbol, TieredFunction> TieredFunctions;
+static DenseMap<Symbol, ExternFunction> ExternFunctions;
+
+static unsigned NumInterpretedCalls = 0, NumNativeCalls = 0, NumTierUps = 0;
+
+// a new definition or extern of Sym: its cached prototype and entry may be stale
+void ForgetExtern(Symbol Sym){
+	ExternFunctions.erase(Sym);
+}
+
+
+Optional<InterpValue> LogErrorI(const char * Str){
+	LogError(Str);
+	return None;
+}
+
+
+Optional<InterpValue> InterpValue::convertTo(ValType T) const{
+	if(Ty == T)
+		return *this;
+	if(Ty == Ty_Array || T == Ty_Array)
+		return LogErrorI("Cannot convert between an array and a number");
+	if(T == Ty_Double)
+		return getDouble((double)I);
+	// saturate like the ConvertTo of codegen, a plain cast is UB out of range
+	if(std::isnan(D))
+		return getInt(0);
+	if(D >= 9223372036854775808.0)
+		return getInt(INT64_MAX);
+	if(D < -9223372036854775808.0)
+		return getInt(INT64_MIN);
+	return getInt((int64_t)D);
+}
+
+
+static bool IsAllDouble(const PrototypeAST &P){
+	return P.getRetType() == Ty_Double &&
+		   llvm::all_of(P.getArgTypes(), [](ValType Ty){ return Ty == Ty_Double; });
+}
+
+// address the interpreter calls for a function that is in the JIT
+// a function of doubles is called directly, one with an int argument or result
+// goes through a wrapper "name.bits" that takes and returns every value as the
+// 64 bits of an int64_t, so one C signature per arity covers all of them
+static void * GetNativeEntry(const PrototypeAST &P){
+	std::string EntryName = P.getName();
+	if(!IsAllDouble(P)){
+		EntryName += ".bits";
+		Function * F = getFunction(P.getSym());
+		if(!F)
+			return nullptr;
+
+		Type * I64 = Type::getInt64Ty(*TheContext);
+		std::vector<Type *> Params(F->arg_size(), I64);
+		Function * W = Function::Create(FunctionType::get(I64, Params, false),
+										Function::ExternalLinkage, EntryName, TheModule.get());
+		Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", W));
+		std::vector<Value *> Args;
+		for(auto &Arg : W->args()){
+			Type * Ty = F->getFunctionType()->getParamType(Arg.getArgNo());
+			Args.push_back(Builder->CreateBitOrPointerCast(&Arg, Ty));
+		}
+		Value * Ret = Builder->CreateCall(F, Args, "calltmp");
+		Builder->CreateRet(Builder->CreateBitOrPointerCast(Ret, I64));
+
+		OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+		TraceScope Span(TP_JIT, EntryName);
+		TheJIT->addModule(std::move(TheModule));
+		InitializeModuleAndPassManager();
+	}
+
+	auto Sym = TheJIT->findSymbol(EntryName);
+	if(!Sym)
+		return nullptr;
+	return (void *)(intptr_t)cantFail(Sym.getAddress());
+}
+
+
+// codegen Name, and every function it needs that is still interpreted, into
+// one module and hand it to the JIT
+static bool TierUp(Symbol Name){
+	std::vector<Symbol> Pending{Name}, Compiled;
+	while(!Pending.empty()){
+		Symbol Cur = Pending.back();
+		Pending.pop_back();
+		auto &TF = TieredFunctions[Cur];
+		Function * Existing = ModuleFunctions.lookup(Cur);
+		if(TF.Native || (Existing && !Existing->empty()))
+			continue;
+
+		if(!TF.AST->codegen()){
+			// drop the half built module
+			InitializeModuleAndPassManager();
+			return false;
+		}
+		Compiled.push_back(Cur);
+
+		// the module declares every callee, the interpreted ones must come along
+		for(auto &F : *TheModule){
+			if(!F.isDeclaration())
+				continue;
+			// ~0U is the empty key of the DenseMap, it must not be looked up
+			Symbol Sym = Symbols.find(F.getName());
+			if(Sym == ~0U)
+				continue;
+			auto It = TieredFunctions.find(Sym);
+			if(It != TieredFunctions.end() && !It->second.Native)
+				Pending.push_back(It->first);
+		}
+	}
+
+	// each body is reached through its stub, see RenameToBody
+	std::vector<std::string> BodyNames;
+	for(Symbol Cur : Compiled)
+		BodyNames.push_back(RenameToBody(ModuleFunctions.lookup(Cur), Cur));
+
+	OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+	{
+		TraceScope Span(TP_JIT);
+		if(TraceEnabled)
+			Span.setDetail(ModuleDetail(*TheModule));
+		TheJIT->addModule(std::move(TheModule));
+	}
+	InitializeModuleAndPassManager();
+
+	for(unsigned i = 0, e = Compiled.size(); i != e; ++i){
+		if(!SwapInBody(Compiled[i], BodyNames[i]))
+			return false;
+		TieredFunction &TF = TieredFunctions[Compiled[i]];
+		TF.Native = GetNativeEntry(*TF.Proto);
+		assert(TF.Native && "Function not found");
+		++NumTierUps;
+	}
+	return true;
+}
+
+
+// call native code that takes N values of type T and returns a T
+// N is at most MaxNativeCallArgs
+template <typename T>
+static Optional<T> CallNativeN(void * Addr, ArrayRef<T> A){
+	switch(A.size()){
+		case 0: return ((T (*)())Addr)();
+		case 1: return ((T (*)(T))Addr)(A[0]);
+		case 2: return ((T (*)(T, T))Addr)(A[0], A[1]);
+		case 3: return ((T (*)(T, T, T))Addr)(A[0], A[1], A[2]);
+		case 4: return ((T (*)(T, T, T, T))Addr)(A[0], A[1], A[2], A[3]);
+		case 5: return ((T (*)(T, T, T, T, T))Addr)(A[0], A[1], A[2], A[3], A[4]);
+		case 6: return ((T (*)(T, T, T, T, T, T))Addr)(A[0], A[1], A[2], A[3], A[4], A[5]);
+		default:
+			LogError("Too many arguments for a native call from the interpreter");
+			return None;
+	}
+}
+
+// call the entry GetNativeEntry returned for P, Args already have P's types
+static Optional<InterpValue> CallNative(void * Addr, const PrototypeAST &P,
+										ArrayRef<InterpValue> Args){
+	if(IsAllDouble(P)){
+		SmallVector<double, 6> A;
+		for(auto &V : Args)
+			A.push_back(V.D);
+		auto R = CallNativeN<double>(Addr, A);
+		if(!R)
+			return None;
+		return InterpValue::getDouble(*R);
+	}
+
+	SmallVector<int64_t, 6> A;
+	for(auto &V : Args){
+		int64_t Bits = V.I;
+		if(V.Ty == Ty_Double)
+			memcpy(&Bits, &V.D, sizeof(Bits));
+		else if(V.Ty == Ty_Array)
+			Bits = (int64_t)(intptr_t)V.A;
+		A.push_back(Bits);
+	}
+	auto R = CallNativeN<int64_t>(Addr, A);
+	if(!R)
+		return None;
+	if(P.getRetType() == Ty_Int)
+		return InterpValue::getInt(*R);
+	if(P.getRetType() == Ty_Array)
+		return InterpValue::getArray((double *)(intptr_t)*R);
+	double D;
+	memcpy(&D, &*R, sizeof(D));
+	return InterpValue::getDouble(D);
+}
+
+
+static Optional<InterpValue> CallFunction(Symbol Name, ArrayRef<InterpValue> Args){
+	const PrototypeAST * P;
+	void * Native;
+	auto It = TieredFunctions.find(Name);
+	if(It == TieredFunctions.end()){
+		// an extern, or something defined before tiering: look it up in the JIT / process
+		ExternFunction &EF = ExternFunctions[Name];
+		if(!EF.Proto){
+			{
+				std::lock_guard<std::mutex> Lock(FunctionProtosMutex);
+				auto PI = FunctionProtos.find(Name);
+				if(PI == FunctionProtos.end())
+					return LogErrorI("Unknown function referenced");
+				EF.Proto = std::make_unique<PrototypeAST>(*PI->second);
+			}
+			EF.Native = GetNativeEntry(*EF.Proto);
+		}
+		if(!EF.Native)
+			return LogErrorI("Function not found");
+		P = EF.Proto.get();
+		Native = EF.Native;
+	}else{
+		TieredFunction &TF = It->second;
+		if(!TF.Native && ++TF.Calls >= TierThreshold && !TierUp(Name))
+			return None;
+		P = TF.Proto.get();
+		Native = TF.Native;
+	}
+
+	if(P->getArgs().size() != Args.size())
+		return LogErrorI("Incorrect # arguments passed");
+
+	// arguments are converted to the parameter types, like a call in codegen
+	SmallVector<InterpValue, 8> ArgsV;
+	for(unsigned i = 0, e = Args.size(); i != e; ++i){
+		auto V = Args[i].convertTo(P->getArgTypes()[i]);
+		if(!V)
+			return None;
+		ArgsV.push_back(*V);
+	}
+
+	if(Native){
+		++NumNativeCalls;
+		return CallNative(Native, *P, ArgsV);
+	}
+
+	++NumInterpretedCalls;
+	InterpFrame Frame;
+	for(unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+		Frame.push(P->getArgSyms()[i], ArgsV[i]);
+	auto RetVal = It->second.AST->getBody()->eval(Frame);
+	if(!RetVal)
+		return None;
+	return RetVal->convertTo(P->getRetType());
+}
+
+// result type of a call, what the prototype says
+static ValType GetRetType(Symbol Name){
+	auto It = TieredFunctions.find(Name);
+	if(It != TieredFunctions.end())
+		return It->second.Proto->getRetType();
+	std::lock_guard<std::mutex> Lock(FunctionProtosMutex);
+	auto PI = FunctionProtos.find(Name);
+	if(PI != FunctionProtos.end())
+		return PI->second->getRetType();
+	return Ty_Double;
+}
+
+
+Optional<InterpValue> NumberExprAST::eval(InterpFrame &Frame){
+	if(IsInt)
+		return InterpValue::getInt(IntVal);
+	return InterpValue::getDouble(Val);
+}
+
+ValType NumberExprAST::evalType(InterpFrame &Frame){
+	return IsInt ? Ty_Int : Ty_Double;
+}
+
+Optional<InterpValue> VariableExprAST::eval(InterpFrame &Frame){
+	if(InterpValue * V = Frame.lookup(Name))
+		return *V;
+	return LogErrorI("Unknown variable name");
+}
+
+ValType VariableExprAST::evalType(InterpFrame &Frame){
+	if(InterpValue * V = Frame.lookup(Name))
+		return V->Ty;
+	return Ty_Double;
+}
+
+Optional<InterpValue> ExprAST::evalStore(InterpFrame &Frame, InterpValue Val){
+	return LogErrorI("destination of '=' must be a variable or an array element");
+}
+
+Optional<InterpValue> VariableExprAST::evalStore(InterpFrame &Frame, InterpValue Val){
+	InterpValue * Variable = Frame.lookup(Name);
+	if(!Variable)
+		return LogErrorI("Unknown variable name");
+	auto V = Val.convertTo(Variable->Ty);
+	if(!V)
+		return None;
+	*Variable = *V;
+	return V;
+}
+
+// address of element Index of Array, no bounds check like the compiled code
+static double * ElementPtr(InterpValue Array, InterpValue Index){
+	if(Array.Ty != Ty_Array){
+		LogError("Indexed value is not an array");
+		return nullptr;
+	}
+	auto I = Index.convertTo(Ty_Int);
+	if(!I)
+		return nullptr;
+	return Array.A + I->I;
+}
+
+Optional<InterpValue> IndexExprAST::eval(InterpFrame &Frame){
+	auto A = Array->eval(Frame);
+	auto I = Index->eval(Frame);
+	if(!A || !I)
+		return None;
+	double * P = ElementPtr(*A, *I);
+	if(!P)
+		return None;
+	return InterpValue::getDouble(*P);
+}
+
+ValType IndexExprAST::evalType(InterpFrame &Frame){
+	return Ty_Double;
+}
+
+Optional<InterpValue> IndexExprAST::evalStore(InterpFrame &Frame, InterpValue Val){
+	auto V = Val.convertTo(Ty_Double);
+	if(!V)
+		return None;
+	auto A = Array->eval(Frame);
+	auto I = Index->eval(Frame);
+	if(!A || !I)
+		return None;
+	double * P = ElementPtr(*A, *I);
+	if(!P)
+		return None;
+	*P = V->D;
+	return V;
+}
+
+// the comparisons below follow the IR that codegen emits: a double '<' is an
+// unordered compare (true on NaN) and a double condition is "ordered and not
+// equal to 0.0"
+static bool IsTrue(InterpValue V){
+	if(V.Ty == Ty_Array)
+		return V.A != nullptr;
+	if(V.Ty == Ty_Int)
+		return V.I != 0;
+	return !std::isnan(V.D) && V.D != 0.0;
+}
+
+Optional<InterpValue> BinaryExprAST::eval(InterpFrame &Frame){
+	if(Op == '='){
+		auto Val = RHS->eval(Frame);
+		if(!Val)
+			return None;
+		return LHS->evalStore(Frame, *Val);
+	}
+
+	auto L = LHS->eval(Frame);
+	auto R = RHS->eval(Frame);
+	if(!L || !R)
+		return None;
+
+	// ints wrap around like the i64 ops codegen emits
+	if(L->Ty == Ty_Int && R->Ty == Ty_Int){
+		uint64_t UL = L->I, UR = R->I;
+		switch(Op){
+			case '+':
+				return InterpValue::getInt((int64_t)(UL + UR));
+			case '-':
+				return InterpValue::getInt((int64_t)(UL - UR));
+			case '*':
+				return InterpValue::getInt((int64_t)(UL * UR));
+			case '<':
+				return InterpValue::getInt(L->I < R->I);
+			default:
+				break;
+		}
+	}else if(Op == '+' || Op == '-' || Op == '*' || Op == '<'){
+		auto LD = L->convertTo(Ty_Double);
+		auto RD = R->convertTo(Ty_Double);
+		if(!LD || !RD)
+			return None;
+		switch(Op){
+			case '+':
+				return InterpValue::getDouble(LD->D + RD->D);
+			case '-':
+				return InterpValue::getDouble(LD->D - RD->D);
+			case '*':
+				return InterpValue::getDouble(LD->D * RD->D);
+			default:
+				return InterpValue::getDouble(!(LD->D >= RD->D) ? 1.0 : 0.0);
+		}
+	}
+
+	InterpValue Ops[2] = {*L, *R};
+	return CallFunction(OpFn, Ops);
+}
+
+ValType BinaryExprAST::evalType(InterpFrame &Frame){
+	switch(Op){
+		case '=':
+			return LHS->evalType(Frame);
+		case '+':
+		case '-':
+		case '*':
+		case '<':
+			if(LHS->evalType(Frame) == Ty_Int && RHS->evalType(Frame) == Ty_Int)
+				return Ty_Int;
+			return Ty_Double;
+		default:
+			return GetRetType(OpFn);
+	}
+}
+
+Optional<InterpValue> UnaryExprAST::eval(InterpFrame &Frame){
+	auto OperandV = Operand->eval(Frame);
+	if(!OperandV)
+		return None;
+	return CallFunction(OpFn, *OperandV);
+}
+
+ValType UnaryExprAST::evalType(InterpFrame &Frame){
+	return GetRetType(OpFn);
+}
+
+Optional<InterpValue> IfExprAST::eval(InterpFrame &Frame){
+	auto CondV = Cond->eval(Frame);
+	if(!CondV)
+		return None;
+	bool Taken = IsTrue(*CondV);
+	auto V = Taken ? Then->eval(Frame) : Else->eval(Frame);
+	if(!V)
+		return None;
+	// arms of different types meet as a double, like codegen's phi
+	if(V->Ty != (Taken ? Else : Then)->evalType(Frame))
+		return V->convertTo(Ty_Double);
+	return V;
+}
+
+ValType IfExprAST::evalType(InterpFrame &Frame){
+	ValType ThenTy = Then->evalType(Frame);
+	return ThenTy == Else->evalType(Frame) ? ThenTy : Ty_Double;
+}
+
+// same order as the loop codegen builds: body, step, end condition,
+// then the increment of the (possibly reassigned) variable
+Optional<InterpValue> ForExprAST::eval(InterpFrame &Frame){
+	auto StartVal = Start->eval(Frame);
+	if(!StartVal)
+		return None;
+
+	// same rule as codegen for an int loop variable
+	bool IntVar = StartVal->Ty == Ty_Int && (!Step || Step->isIntConstant());
+	ValType VarTy = IntVar ? Ty_Int : Ty_Double;
+
+	auto StartVar = StartVal->convertTo(VarTy);
+	if(!StartVar)
+		return None;
+	Frame.push(VarName, *StartVar);
+	while(1){
+		if(!Body->eval(Frame))
+			return None;
+
+		InterpValue StepVal = IntVar ? InterpValue::getInt(1) : InterpValue::getDouble(1.0);
+		if(Step){
+			auto S = Step->eval(Frame);
+			if(!S)
+				return None;
+			auto SV = S->convertTo(VarTy);
+			if(!SV)
+				return None;
+			StepVal = *SV;
+		}
+
+		auto EndCond = End->eval(Frame);
+		if(!EndCond)
+			return None;
+
+		InterpValue * Var = Frame.lookup(VarName);
+		if(IntVar)
+			Var->I = (int64_t)((uint64_t)Var->I + (uint64_t)StepVal.I);
+		else
+			Var->D += StepVal.D;
+		if(!IsTrue(*EndCond))
+			break;
+	}
+	Frame.pop();
+
+	// for expr always return 0.0
+	return InterpValue::getDouble(0.0);
+}
+
+ValType ForExprAST::evalType(InterpFrame &Frame){
+	return Ty_Double;
+}
+
+// the iterations in order, the body can't tell: each one only sees the
+// variables around the loop (it can't assign them) and its own
+Optional<InterpValue> PForExprAST::eval(InterpFrame &Frame){
+	auto StartVal = Start->eval(Frame);
+	if(!StartVal)
+		return None;
+	auto EndVal = End->eval(Frame);
+	if(!EndVal)
+		return None;
+	Optional<InterpValue> StepVal;
+	if(Step && !(StepVal = Step->eval(Frame)))
+		return None;
+
+	// same rule as codegen for an int loop variable
+	bool IntVar = StartVal->Ty == Ty_Int && (!Step || Step->isIntConstant());
+	ValType VarTy = IntVar ? Ty_Int : Ty_Double;
+	if(!StepVal)
+		StepVal = IntVar ? InterpValue::getInt(1) : InterpValue::getDouble(1.0);
+	auto Var = StartVal->convertTo(VarTy);
+	auto Bound = EndVal->convertTo(VarTy);
+	auto Inc = StepVal->convertTo(VarTy);
+	if(!Var || !Bound || !Inc)
+		return None;
+
+	// the trip count as codegen works it out
+	int64_t Count = 0;
+	if(IntVar){
+		int64_t Span = (int64_t)((uint64_t)Bound->I - (uint64_t)Var->I);
+		if(Span > 0 && Inc->I > 0)
+			Count = (int64_t)((uint64_t)Span + (uint64_t)(Inc->I - 1)) / Inc->I;
+	}else{
+		double Span = Bound->D - Var->D;
+		if(Span > 0 && Inc->D > 0)
+			Count = InterpValue::getDouble(std::ceil(Span / Inc->D)).convertTo(Ty_Int)->I;
+	}
+
+	// a deterministic pfor reduces its chunks on their own and then in
+	// order, like the runtime does for the JIT-ed code
+	double Identity = Reduction == '*' ? 1.0 : 0.0;
+	int64_t Grain = Reduction ? pforgrain(Count) : 0;
+	double Acc = Identity, ChunkAcc = Identity;
+	for(int64_t K = 0; K < Count; ++K){
+		InterpValue V = *Var;
+		if(IntVar)
+			V.I = (int64_t)((uint64_t)Var->I + (uint64_t)K * (uint64_t)Inc->I);
+		else
+			V.D = Var->D + K * Inc->D;
+
+		Frame.push(VarName, V);
+		auto BodyVal = Body->eval(Frame);
+		Frame.pop();
+		if(!BodyVal)
+			return None;
+		if(Reduction){
+			auto D = BodyVal->convertTo(Ty_Double);
+			if(!D)
+				return None;
+			ChunkAcc = Reduction == '+' ? ChunkAcc + D->D : ChunkAcc * D->D;
+			if(!Grain || (K + 1) % Grain == 0 || K + 1 == Count){
+				Acc = Reduction == '+' ? Acc + ChunkAcc : Acc * ChunkAcc;
+				ChunkAcc = Identity;
+			}
+		}
+	}
+	return InterpValue::getDouble(Reduction ? Acc : 0.0);
+}
+
+ValType PForExprAST::evalType(InterpFrame &Frame){
+	return Ty_Double;
+}
+
+Optional<InterpValue> VarExprAST::eval(InterpFrame &Frame){
+	for(auto &Var : VarNames){
+		// the initializer can't see the variable itself
+		InterpValue InitVal = InterpValue::getZero(Var.Ty);
+		if(Var.Init){
+			auto V = Var.Init->eval(Frame);
+			if(!V)
+				return None;
+			auto IV = V->convertTo(Var.Ty);
+			if(!IV)
+				return None;
+			InitVal = *IV;
+		}
+		Frame.push(Var.Name, InitVal);
+	}
+
+	auto BodyVal = Body->eval(Frame);
+	Frame.pop(VarNames.size());
+	return BodyVal;
+}
+
+ValType VarExprAST::evalType(InterpFrame &Frame){
+	// only the declared types matter, not the values
+	for(auto &Var : VarNames)
+		Frame.push(Var.Name, InterpValue::getZero(Var.Ty));
+	ValType Ty = Body->evalType(Frame);
+	Frame.pop(VarNames.size());
+	return Ty;
+}
+
+// array(n) and len(a), see CodegenArrayBuiltin
+static Optional<InterpValue> EvalArrayBuiltin(Symbol Name, ArrayRef<InterpValue> Args){
+	if(Args.size() != 1)
+		return LogErrorI("Incorrect # arguments passed");
+	if(Name == getArraySym()){
+		auto N = Args[0].convertTo(Ty_Int);
+		if(!N)
+			return None;
+		return InterpValue::getArray(arrayalloc(N->I));
+	}
+	if(Args[0].Ty != Ty_Array)
+		return LogErrorI("len needs an array");
+	int64_t Len;
+	memcpy(&Len, (const char *)Args[0].A - sizeof(Len), sizeof(Len));
+	return InterpValue::getInt(Len);
+}
+
+Optional<InterpValue> CallExprAST::eval(InterpFrame &Frame){
+	SmallVector<InterpValue, 8> ArgsV;
+	for(auto * Arg : Args){
+		auto V = Arg->eval(Frame);
+		if(!V)
+			return None;
+		ArgsV.push_back(*V);
+	}
+	if(isArrayBuiltin(Callee))
+		return EvalArrayBuiltin(Callee, ArgsV);
+	return CallFunction(Callee, ArgsV);
+}
+
+ValType CallExprAST::evalType(InterpFrame &Frame){
+	if(isArrayBuiltin(Callee))
+		return Callee == getArraySym() ? Ty_Array : Ty_Int;
+	return GetRetType(Callee);
+}
+
+
+// register a definition with the interpreter instead of compiling it
+void DefineTiered(std::unique_ptr<FunctionAST> FnAST){
+	const PrototypeAST &P = FnAST->getProto();
+	{
+		// callers compiled later need the prototype for their declarations
+		std::lock_guard<std::mutex> Lock(FunctionProtosMutex);
+		FunctionProtos[P.getSym()] = std::make_unique<PrototypeAST>(P);
+	}
+
+	// a redefinition starts over in the interpreter
+	Symbol Sym = P.getSym();
+	TieredFunction &TF = TieredFunctions[Sym];
+	TF.Proto = std::make_unique<PrototypeAST>(P);
+	TF.AST = std::move(FnAST);
+	TF.Calls = 0;
+	TF.Native = nullptr;
+
+	// unless the old body is in the JIT: compiled callers reach it through its
+	// stub, the new one is compiled right away so they don't keep calling the old
+	if(HotSwap && BodyVersions.count(Sym))
+		TierUp(Sym);
+}
+
+// the value is converted to the double __anon_expr returns
+Optional<InterpValue> InterpretTopLevel(FunctionAST &FnAST){
+	InterpFrame Frame;
+	auto V = FnAST.getBody()->eval(Frame);
+	if(!V)
+		return None;
+	return V->convertTo(FnAST.getProto().getRetType());
+}
+
+void PrintTierStats(){
+	fprintf(stderr, "tiered: %u functions, %u compiled, %u interpreted calls, %u native calls\n",
+			TieredFunctions.size(), NumTierUps, NumInterpretedCalls, NumNativeCalls);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <memory>
+#include "llvm/ADT/Optional.h"
+#include "llvm/Support/CommandLine.h"
+#include "Paser.hpp"
+#include "Symbol.hpp"
+
+// tiered execution, see Interp.cpp
+
+// -tier-threshold, 0 when every definition is compiled right away
+extern llvm::cl::opt<unsigned> TierThreshold;
+
+// register a definition with the interpreter instead of compiling it
+void DefineTiered(std::unique_ptr<FunctionAST> FnAST);
+
+// a new definition or extern of Sym: its cached prototype and entry may be stale
+void ForgetExtern(Symbol Sym);
+
+// run a top-level expression in the interpreter, None on a runtime error
+// the value is converted to the double __anon_expr returns
+llvm::Optional<InterpValue> InterpretTopLevel(FunctionAST &FnAST);
+
+// -repl-stats
+void PrintTierStats();
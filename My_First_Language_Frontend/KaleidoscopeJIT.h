@@ -17,7 +17,9 @@
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
@@ -26,8 +28,12 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#ifdef __linux__
+#include "SlabMemoryManager.h"
+#endif
 #include <algorithm>
 #include <map>
 #include <memory>
@@ -37,25 +43,58 @@
 namespace llvm {
 namespace orc {
 
+/// A TargetMachine for the host, like EngineBuilder().selectTarget(), but for
+/// the CPU and the features of this machine when HostCPU is set. Otherwise the
+/// code only uses what every CPU of the triple has (SSE2 on x86-64).
+inline TargetMachine *selectHostTarget(bool HostCPU,
+                                       Optional<Reloc::Model> RM = None,
+                                       Optional<CodeModel::Model> CM = None) {
+  EngineBuilder EB;
+  if (RM)
+    EB.setRelocationModel(*RM);
+  if (CM)
+    EB.setCodeModel(*CM);
+  if (HostCPU) {
+    std::vector<std::string> Attrs;
+    StringMap<bool> Features;
+    if (sys::getHostCPUFeatures(Features))
+      for (auto &F : Features)
+        Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    EB.setMCPU(sys::getHostCPUName()).setMAttrs(Attrs);
+  }
+  return EB.selectTarget();
+}
+
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
-  KaleidoscopeJIT()
+  // ObjCache, if given, is asked for every module before it is compiled
+  // and receives every newly compiled object.
+  // PoolMemory packs the sections of all modules into shared slabs (Linux),
+  // otherwise every module gets a SectionMemoryManager of its own.
+  // HostCPU compiles for the CPU the JIT runs on, see selectHostTarget.
+  KaleidoscopeJIT(ObjectCache *ObjCache = nullptr, bool PoolMemory = true,
+                  bool HostCPU = true)
       : Resolver(createLegacyLookupResolver(
             ES,
             [this](const std::string &Name) {
               return findMangledSymbol(Name);
             },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        TM(selectHostTarget(HostCPU)), DL(TM->createDataLayout()),
         ObjectLayer(ES,
                     [this](VModuleKey) {
-                      return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                      return ObjLayerT::Resources{createMemoryManager(),
+                                                  Resolver};
                     }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+        CompileLayer(ObjectLayer, SimpleCompiler(*TM, ObjCache)),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())()) {
+#ifdef __linux__
+    if (PoolMemory)
+      MemPool = std::make_shared<SlabPool>();
+#endif
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
@@ -68,6 +107,15 @@ public:
     return K;
   }
 
+  // Add an object file that was compiled outside the JIT (e.g. by a codegen
+  // worker thread with its own TargetMachine).
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj) {
+    auto K = ES.allocateVModule();
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    ModuleKeys.push_back(K);
+    return K;
+  }
+
   void removeModule(VModuleKey K) {
     ModuleKeys.erase(find(ModuleKeys, K));
     cantFail(CompileLayer.removeModule(K));
@@ -77,7 +125,39 @@ public:
     return findMangledSymbol(mangle(Name));
   }
 
+  // Create the indirection stub Name unless it exists. It points nowhere until
+  // updateStub, but code that calls Name can already be linked against it.
+  Error reserveStub(const std::string &Name) {
+    std::string MangledName = mangle(Name);
+    if (StubsMgr->findStub(MangledName, false))
+      return Error::success();
+    return StubsMgr->createStub(MangledName, 0, JITSymbolFlags::Exported);
+  }
+
+  // Point the indirection stub Name at Addr, creating the stub on first use.
+  // Stubs shadow the module symbols of the same name, so code that calls Name
+  // from another module jumps through the stub and follows every update.
+  Error updateStub(const std::string &Name, JITTargetAddress Addr) {
+    std::string MangledName = mangle(Name);
+    if (StubsMgr->findStub(MangledName, false))
+      return StubsMgr->updatePointer(MangledName, Addr);
+    return StubsMgr->createStub(MangledName, Addr, JITSymbolFlags::Exported);
+  }
+
+#ifdef __linux__
+  // The pool the modules' sections come from, null without PoolMemory.
+  SlabPool *getMemoryPool() { return MemPool.get(); }
+#endif
+
 private:
+  std::shared_ptr<RuntimeDyld::MemoryManager> createMemoryManager() {
+#ifdef __linux__
+    if (MemPool)
+      return std::make_shared<SlabMemoryManager>(MemPool);
+#endif
+    return std::make_shared<SectionMemoryManager>();
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -101,6 +181,10 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
+    // A function that has a stub is always called through it.
+    if (auto Sym = StubsMgr->findStub(Name, ExportedSymbolsOnly))
+      return Sym;
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
@@ -126,11 +210,15 @@ private:
   }
 
   ExecutionSession ES;
+#ifdef __linux__
+  std::shared_ptr<SlabPool> MemPool;
+#endif
   std::shared_ptr<SymbolResolver> Resolver;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
   std::vector<VModuleKey> ModuleKeys;
 };
 
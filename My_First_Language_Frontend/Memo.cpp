@@ -0,0 +1,389 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "IR.hpp"
+#include "Memo.hpp"
+#include "Paser.hpp"
+
+// memoization of pure recursive functions
+// with -memoize every pure REPL definition that calls itself gets a memo table,
+// a bounded hash cache from its arguments to its result. the compiled function
+// looks its arguments up on entry and returns the cached result on a hit, a
+// miss runs the body and caches what it returns: fib(n) takes n calls then.
+//
+// a function is pure when it takes and returns numbers, calls no extern but the
+// math functions of the C library, no impure function and no array builtin, and
+// never reads or writes an array element: its only state are its own variables.
+// purity goes by the definitions so far. a redefinition that makes a function
+// impure makes the functions whose purity counted on it impure too, their tables
+// are turned off. every redefinition empties all tables, results cached so far
+// may have come from the old body.
+//
+// a table has sets of MemoWays entries, a full set replaces its entries in turn.
+// only REPL definitions are memoized, not batch or -aot code
+
+static cl::opt<bool>
+Memoize("memoize",
+		cl::desc("Cache the results of pure recursive REPL definitions by their arguments"),
+		cl::init(false));
+
+static cl::opt<unsigned>
+MemoSize("memo-size",
+		 cl::desc("Entries of the memo table of a function"),
+		 cl::init(16384));
+
+static const unsigned MaxMemoArgs = 4;
+static const unsigned MemoWays = 4;
+
+struct MemoEntry{
+	uint64_t Key[MaxMemoArgs];	// the arguments, a double by its bits
+	uint64_t Result;
+	bool Valid = false;
+};
+
+struct MemoSet{
+	MemoEntry Ways[MemoWays];
+	unsigned Next = 0;			// the way a full set replaces next
+};
+
+// JIT-ed code calls memofind / memostore with the address of its table
+struct MemoTable{
+	Symbol Sym;
+	unsigned NumArgs;
+	// M guards the rest, the JIT-ed code of pfor bodies and of -async-eval
+	// calls memofind / memostore from other threads
+	bool Enabled = true;
+	std::vector<MemoSet> Sets;	// allocated by the first store
+	uint64_t Hits = 0, Misses = 0, Evictions = 0;
+	std::mutex M;
+
+	MemoTable(Symbol Sym, unsigned NumArgs) : Sym(Sym), NumArgs(NumArgs) {}
+
+	void clear(){
+		std::lock_guard<std::mutex> Lock(M);
+		std::vector<MemoSet>().swap(Sets);
+	}
+	// the code calling it runs its body every time from now on
+	void disable(){
+		std::lock_guard<std::mutex> Lock(M);
+		std::vector<MemoSet>().swap(Sets);
+		Enabled = false;
+	}
+};
+
+// what the memoization knows about a REPL definition
+struct MemoFunction{
+	bool Pure = false;
+	SmallVector<Symbol, 4> Callees;	// the functions its purity counts on
+	MemoTable * Table = nullptr;	// the table of its newest body, if memoized
+};
+
+static DenseMap<Symbol, MemoFunction> MemoFunctions;
+// JIT-ed code has the addresses of the tables, a deque never moves them
+// the table of a replaced body stays, turned off
+static std::deque<MemoTable> MemoTables;
+
+
+// the low bits pick the set, and a small number as a double has only zeros
+// there, so every word is mixed all through (the murmur3 finalizer)
+static uint64_t HashKey(const uint64_t * Key, unsigned N){
+	uint64_t H = N;
+	for(unsigned I = 0; I != N; ++I){
+		H ^= Key[I];
+		H ^= H >> 33;
+		H *= 0xff51afd7ed558ccdULL;
+		H ^= H >> 33;
+		H *= 0xc4ceb9fe1a85ec53ULL;
+		H ^= H >> 33;
+	}
+	return H;
+}
+
+static MemoSet & FindSet(MemoTable * T, const uint64_t * Key){
+	return T->Sets[HashKey(Key, T->NumArgs) & (T->Sets.size() - 1)];
+}
+
+static bool SameKey(const MemoTable * T, const MemoEntry & E, const uint64_t * Key){
+	return std::equal(Key, Key + T->NumArgs, E.Key);
+}
+
+// the runtime of memoized functions
+// memofind: 1 and the cached result in *Result, or 0 on a miss
+extern "C" int64_t memofind(MemoTable * T, const uint64_t * Key, uint64_t * Result){
+	std::lock_guard<std::mutex> Lock(T->M);
+	if(!T->Enabled)
+		return 0;
+	if(!T->Sets.empty())
+		for(MemoEntry & E : FindSet(T, Key).Ways)
+			if(E.Valid && SameKey(T, E, Key)){
+				*Result = E.Result;
+				++T->Hits;
+				return 1;
+			}
+	++T->Misses;
+	return 0;
+}
+
+// memostore: cache Result for Key
+extern "C" void memostore(MemoTable * T, const uint64_t * Key, uint64_t Result){
+	std::lock_guard<std::mutex> Lock(T->M);
+	if(!T->Enabled)
+		return;
+	if(T->Sets.empty())
+		T->Sets.resize(PowerOf2Ceil(std::max(1u, MemoSize / MemoWays)));
+
+	MemoSet & S = FindSet(T, Key);
+	MemoEntry * E = nullptr;
+	for(MemoEntry & W : S.Ways)
+		if(!W.Valid || SameKey(T, W, Key)){
+			E = &W;
+			break;
+		}
+	if(!E){
+		E = &S.Ways[S.Next];
+		S.Next = (S.Next + 1) % MemoWays;
+		++T->Evictions;
+	}
+	std::copy(Key, Key + T->NumArgs, E->Key);
+	E->Result = Result;
+	E->Valid = true;
+}
+
+
+// purity
+
+// math functions of the C library, pure unless the REPL defines them
+static bool isPureLibraryFunction(StringRef Name){
+	static const char * const Names[] = {
+		"sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh",
+		"exp", "exp2", "log", "log2", "log10", "pow", "sqrt", "cbrt", "hypot",
+		"fabs", "floor", "ceil", "round", "trunc", "fmod", "fmin", "fmax"};
+	for(const char * N : Names)
+		if(Name == N)
+			return true;
+	return false;
+}
+
+static bool isPureCallee(Symbol Callee, PurityInfo & PI){
+	if(Callee == PI.Self){
+		PI.Recursive = true;
+		return true;
+	}
+	auto It = MemoFunctions.find(Callee);
+	if(It == MemoFunctions.end())
+		return isPureLibraryFunction(Symbols.getName(Callee));
+	if(!It->second.Pure)
+		return false;
+	if(!is_contained(PI.Callees, Callee))
+		PI.Callees.push_back(Callee);
+	return true;
+}
+
+bool NumberExprAST::checkPure(PurityInfo &PI) const { return true; }
+
+// an argument or a variable of the function
+bool VariableExprAST::checkPure(PurityInfo &PI) const { return true; }
+
+// memory that may change between calls
+bool IndexExprAST::checkPure(PurityInfo &PI) const { return false; }
+
+// '=' is pure as long as it stores into a variable, not an array element
+bool BinaryExprAST::checkPure(PurityInfo &PI) const{
+	if(!LHS->checkPure(PI) || !RHS->checkPure(PI))
+		return false;
+	switch(Op){
+		case '=': case '+': case '-': case '*': case '<':
+			return true;
+		default:
+			return isPureCallee(OpFn, PI);
+	}
+}
+
+bool VarExprAST::checkPure(PurityInfo &PI) const{
+	for(const VarDecl &Var : VarNames)
+		if(Var.Init && !Var.Init->checkPure(PI))
+			return false;
+	return Body->checkPure(PI);
+}
+
+bool IfExprAST::checkPure(PurityInfo &PI) const{
+	return Cond->checkPure(PI) && Then->checkPure(PI) && Else->checkPure(PI);
+}
+
+bool ForExprAST::checkPure(PurityInfo &PI) const{
+	return Start->checkPure(PI) && End->checkPure(PI) && (!Step || Step->checkPure(PI)) &&
+		   Body->checkPure(PI);
+}
+
+// the iterations may run on other threads, the memo tables are locked
+bool PForExprAST::checkPure(PurityInfo &PI) const{
+	return Start->checkPure(PI) && End->checkPure(PI) && (!Step || Step->checkPure(PI)) &&
+		   Body->checkPure(PI);
+}
+
+bool UnaryExprAST::checkPure(PurityInfo &PI) const{
+	return Operand->checkPure(PI) && isPureCallee(OpFn, PI);
+}
+
+// array(n) returns new memory every time
+bool CallExprAST::checkPure(PurityInfo &PI) const{
+	if(isArrayBuiltin(Callee) || !isPureCallee(Callee, PI))
+		return false;
+	return llvm::all_of(Args, [&PI](ExprAST * Arg){ return Arg->checkPure(PI); });
+}
+
+// Sym is impure now, and so is every function whose purity counted on it
+static void MakeCallersImpure(Symbol Sym){
+	SmallVector<Symbol, 8> Worklist{Sym};
+	while(!Worklist.empty()){
+		Symbol S = Worklist.pop_back_val();
+		for(auto & KV : MemoFunctions){
+			MemoFunction & MF = KV.second;
+			if(!MF.Pure || !is_contained(MF.Callees, S))
+				continue;
+			MF.Pure = false;
+			if(MF.Table)
+				MF.Table->disable();
+			MF.Table = nullptr;
+			Worklist.push_back(KV.first);
+		}
+	}
+}
+
+void NoteDefinition(const FunctionAST & FnAST){
+	if(!Memoize)
+		return;
+	const PrototypeAST & P = FnAST.getProto();
+	PurityInfo PI;
+	PI.Self = P.getSym();
+	bool Pure = FnAST.getBody()->checkPure(PI) && P.getRetType() != Ty_Array &&
+				llvm::none_of(P.getArgTypes(), [](ValType Ty){ return Ty == Ty_Array; });
+
+	for(MemoTable & T : MemoTables)
+		T.clear();
+
+	MemoFunction & MF = MemoFunctions[PI.Self];
+	bool WasPure = MF.Pure;
+	MF.Pure = Pure;
+	MF.Callees = std::move(PI.Callees);
+	// the table of the old body
+	if(MF.Table)
+		MF.Table->disable();
+	MF.Table = nullptr;
+	if(WasPure && !Pure)
+		MakeCallersImpure(PI.Self);
+
+	if(Pure && PI.Recursive && P.getArgs().size() <= MaxMemoArgs){
+		MemoTables.emplace_back(PI.Self, P.getArgs().size());
+		MF.Table = &MemoTables.back();
+	}
+}
+
+
+// codegen
+
+static Function * getMemoRuntime(StringRef Name, Type * Result, Type * Last){
+	if(Function * F = TheModule->getFunction(Name))
+		return F;
+	Type * I8Ptr = Type::getInt8PtrTy(*TheContext);
+	Type * I64Ptr = Type::getInt64PtrTy(*TheContext);
+	FunctionType * FT = FunctionType::get(Result, {I8Ptr, I64Ptr, Last}, false);
+	return Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+}
+
+// the table and the key, as arguments of memofind / memostore
+static Value * TableAddress(IRBuilder<> & B, MemoTable * T){
+	return ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)T), B.getInt8PtrTy());
+}
+
+static Value * KeyAddress(IRBuilder<> & B, AllocaInst * Key){
+	return B.CreateConstInBoundsGEP2_32(Key->getAllocatedType(), Key, 0, 0, "memo.keyptr");
+}
+
+MemoSite MemoFunctionEntry(Function * F, Symbol Sym){
+	MemoSite Site;
+	if(MemoFunctions.empty())
+		return Site;
+	auto It = MemoFunctions.find(Sym);
+	if(It == MemoFunctions.end() || !It->second.Table)
+		return Site;
+	Site.Table = It->second.Table;
+
+	// the key holds the arguments as they came in, the body may assign them
+	IRBuilder<> & B = *Builder;
+	Type * I64 = B.getInt64Ty();
+	Site.Key = CreateEntryBlockAlloca(F, "memo.key", ArrayType::get(I64, std::max(1u, (unsigned)F->arg_size())));
+	for(Argument & Arg : F->args()){
+		Value * Word = Arg.getType()->isDoubleTy() ? B.CreateBitCast(&Arg, I64) : (Value *)&Arg;
+		B.CreateStore(Word, B.CreateConstInBoundsGEP2_32(Site.Key->getAllocatedType(), Site.Key, 0,
+														 Arg.getArgNo()));
+	}
+
+	AllocaInst * Cached = CreateEntryBlockAlloca(F, "memo.result", I64);
+	Function * Find = getMemoRuntime("memofind", I64, I64->getPointerTo());
+	Value * Hit = B.CreateCall(Find, {TableAddress(B, Site.Table), KeyAddress(B, Site.Key), Cached}, "memo.hit");
+
+	BasicBlock * HitBB = BasicBlock::Create(*TheContext, "memo.cached", F);
+	BasicBlock * MissBB = BasicBlock::Create(*TheContext, "memo.miss", F);
+	B.CreateCondBr(B.CreateICmpNE(Hit, B.getInt64(0)), HitBB, MissBB);
+
+	B.SetInsertPoint(HitBB);
+	Value * Result = B.CreateLoad(I64, Cached, "memo.value");
+	if(F->getReturnType()->isDoubleTy())
+		Result = B.CreateBitCast(Result, F->getReturnType());
+	B.CreateRet(Result);
+
+	B.SetInsertPoint(MissBB);
+	return Site;
+}
+
+void MemoFunctionExit(const MemoSite & Site, Value * RetVal){
+	if(!Site.Table)
+		return;
+	IRBuilder<> & B = *Builder;
+	Type * I64 = B.getInt64Ty();
+	Value * Word = RetVal->getType()->isDoubleTy() ? B.CreateBitCast(RetVal, I64) : RetVal;
+	Function * Store = getMemoRuntime("memostore", B.getVoidTy(), I64);
+	B.CreateCall(Store, {TableAddress(B, Site.Table), KeyAddress(B, Site.Key), Word});
+}
+
+
+// hit rates per function, over the tables of all its bodies
+void PrintMemoStats(){
+	if(!Memoize)
+		return;
+	struct Counts{ uint64_t Hits = 0, Misses = 0, Evictions = 0, Cached = 0; };
+	std::map<std::string, Counts> All;
+	for(MemoTable & T : MemoTables){
+		std::lock_guard<std::mutex> Lock(T.M);
+		Counts & C = All[Symbols.getName(T.Sym).str()];
+		C.Hits += T.Hits;
+		C.Misses += T.Misses;
+		C.Evictions += T.Evictions;
+		for(MemoSet & S : T.Sets)
+			for(MemoEntry & E : S.Ways)
+				C.Cached += E.Valid;
+	}
+	fprintf(stderr, "memo: %zu memoized functions\n", All.size());
+	for(auto & KV : All){
+		const Counts & C = KV.second;
+		uint64_t Calls = C.Hits + C.Misses;
+		fprintf(stderr, "memo %s: %llu calls, %.1f%% hits, %llu results cached, %llu evicted\n",
+				KV.first.c_str(), (unsigned long long)Calls, Calls ? 100.0 * C.Hits / Calls : 0.0,
+				(unsigned long long)C.Cached, (unsigned long long)C.Evictions);
+	}
+}
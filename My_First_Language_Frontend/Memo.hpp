@@ -0,0 +1,28 @@
+#pragma once
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "Paser.hpp"
+#include "Symbol.hpp"
+
+// memoization of pure recursive functions, see Memo.cpp
+
+struct MemoTable;
+
+// the memo code of the function codegen is working on
+struct MemoSite{
+	MemoTable * Table = nullptr;			// nullptr when it isn't memoized
+	llvm::AllocaInst * Key = nullptr;		// the arguments as 64 bit words
+};
+
+// a REPL definition of Sym, before its codegen: decide if it is memoized
+void NoteDefinition(const FunctionAST & FnAST);
+
+// codegen hooks, they do nothing for a function that isn't memoized
+// the entry hook returns the cached result if there is one, the exit hook
+// caches the result before the function returns it
+MemoSite MemoFunctionEntry(llvm::Function * F, Symbol Sym);
+void MemoFunctionExit(const MemoSite & Site, llvm::Value * RetVal);
+
+// -repl-stats: hit rates per function, over the tables of all its bodies
+void PrintMemoStats();
@@ -0,0 +1,135 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <cstdio>
+#include <string>
+
+#include "IR.hpp"
+#include "Multiversion.hpp"
+#include "Profile.hpp"
+
+// function multiversioning for -aot executables
+// an executable compiled for this machine may not run on an older one, one
+// compiled for the generic CPU leaves the vector units of a newer one idle.
+// with -multiversion the module is compiled for the generic CPU, and every hot
+// function gets a copy per ISA level, compiled with the features of that level.
+// the name of the function becomes an ifunc: its resolver asks the runtime for
+// the level of the CPU (toyisalevel, see Runtime.cpp) when the program is
+// loaded, and every call goes to the version it picked.
+//
+// a version calls the versions of its own level directly, the inliner may
+// copy them. the code that isn't versioned calls through the ifunc
+
+cl::opt<bool>
+Multiversion("multiversion",
+			 cl::desc("With -aot, compile hot functions for SSE2, AVX2 and AVX-512 and pick the "
+					  "version for the CPU when the program is loaded"),
+			 cl::init(false));
+
+// an ISA level above the generic CPU (SSE2 on x86-64), highest first
+// Level is what toyisalevel() returns on a CPU that has it
+struct ISALevel{
+	const char * Suffix;
+	const char * Features;
+	int64_t Level;
+};
+
+static const ISALevel ISALevels[] = {
+	{"avx512", "+avx512f,+avx512vl,+avx512dq,+avx512bw,+avx2,+fma", 2},
+	{"avx2", "+avx2,+fma", 1},
+};
+
+unsigned NumMultiversioned;
+
+// a function with a loop, the wider vectors pay off there. with -profile-use
+// only one the profiled run entered. top-level expressions run once
+static bool IsHotFunction(Function & F){
+	if(F.isDeclaration() || F.getName() == "main" || F.getName().startswith("__toplevel."))
+		return false;
+	DominatorTree DT(F);
+	LoopInfo LI(DT);
+	if(LI.empty())
+		return false;
+	if(!HaveProfileUse())
+		return true;
+	// the body of a pfor goes by the function it is in
+	Symbol Sym = Symbols.find(F.getName().split('.').first);
+	const FunctionProfile * P = Sym == ~0U ? nullptr : LookupProfile(Sym);
+	return P && P->Entries;
+}
+
+// before OptimizeModule of the -aot module, TM is for the generic CPU
+void MultiversionModule(Module & M){
+	if(!Multiversion)
+		return;
+	SmallVector<Function *, 16> Hot;
+	for(Function & F : M)
+		if(IsHotFunction(F))
+			Hot.push_back(&F);
+	if(Hot.empty())
+		return;
+
+	// Versions[L][F] is the version of F for ISALevels[L], LevelOf the level
+	// of every version, the original is the generic one
+	constexpr unsigned NumLevels = array_lengthof(ISALevels);
+	DenseMap<Function *, Function *> Versions[NumLevels];
+	DenseMap<Function *, unsigned> LevelOf;
+	for(Function * F : Hot){
+		LevelOf[F] = NumLevels;
+		for(unsigned L = 0; L < NumLevels; ++L){
+			ValueToValueMapTy VMap;
+			Function * V = CloneFunction(F, VMap);
+			V->setName(F->getName() + "." + ISALevels[L].Suffix);
+			V->setLinkage(GlobalValue::InternalLinkage);
+			V->addFnAttr("target-features", ISALevels[L].Features);
+			Versions[L][F] = V;
+			LevelOf[V] = L;
+		}
+	}
+
+	// the versions of one level call each other
+	for(Function * F : Hot)
+		for(Use & U : make_early_inc_range(F->uses()))
+			if(auto * I = dyn_cast<Instruction>(U.getUser())){
+				auto It = LevelOf.find(I->getFunction());
+				if(It != LevelOf.end() && It->second < NumLevels)
+					U.set(Versions[It->second][F]);
+			}
+
+	LLVMContext & Ctx = M.getContext();
+	FunctionCallee CPULevel = M.getOrInsertFunction("toyisalevel", Type::getInt64Ty(Ctx));
+	for(Function * F : Hot){
+		std::string Name = F->getName().str();
+		GlobalValue::LinkageTypes Linkage = F->getLinkage();
+		F->setName(Name + ".sse2");
+		F->setLinkage(GlobalValue::InternalLinkage);
+
+		Function * Resolver = Function::Create(FunctionType::get(F->getType(), false),
+											   GlobalValue::InternalLinkage, Name + ".resolver", &M);
+		GlobalIFunc * IFunc = GlobalIFunc::create(F->getFunctionType(), 0, Linkage, Name,
+												  Resolver, &M);
+		// the rest calls through the ifunc, the generic versions call each other
+		for(Use & U : make_early_inc_range(F->uses()))
+			if(auto * I = dyn_cast<Instruction>(U.getUser()))
+				if(!LevelOf.count(I->getFunction()))
+					U.set(IFunc);
+
+		// the highest level the CPU has, the generic version without any
+		IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Resolver));
+		Value * Level = B.CreateCall(CPULevel, {}, "level");
+		Value * Choice = F;
+		for(unsigned L = NumLevels; L--;)
+			Choice = B.CreateSelect(B.CreateICmpSGE(Level, B.getInt64(ISALevels[L].Level)),
+									Versions[L][F], Choice);
+		B.CreateRet(Choice);
+		++NumMultiversioned;
+	}
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+// function multiversioning for -aot, see Multiversion.cpp
+
+extern llvm::cl::opt<bool> Multiversion;
+
+// the functions MultiversionModule versioned
+extern unsigned NumMultiversioned;
+
+// before OptimizeModule of the -aot module, TM is for the generic CPU
+void MultiversionModule(llvm::Module & M);
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+// bump when the layout of the cache entries changes
+#define TOY_OBJECT_CACHE_VERSION "toy-objcache-1"
+
+// KaleidoscopeObjectCache, an on-disk object cache for the JIT
+// SimpleCompiler asks getObject() before running codegen and hands every freshly
+// compiled object to notifyObjectCompiled()
+// entries are named after a hash of the optimized module (its bitcode) plus the
+// target triple, CPU, features and LLVM version, so anything that would change
+// the object also changes the name and a stale entry can never be hit
+// the entries are kept under a size budget: beyond it the least recently used
+// ones are removed, a hit refreshes the modification time of its entry. the
+// directory may be shared by several processes, see evict()
+class KaleidoscopeObjectCache : public llvm::ObjectCache{
+	std::string CacheDir;
+	std::string TargetKey;
+	// key computed in getObject(), reused by notifyObjectCompiled() on a miss
+	std::map<const llvm::Module *, std::string> PendingKeys;
+
+	uint64_t Budget;				// bytes, 0 for no limit
+	uint64_t CacheBytes = 0;		// of the entries, as of the last scan
+	bool SizeKnown = false;
+
+	unsigned Hits = 0, Misses = 0, Invalid = 0, Evictions = 0;
+
+	std::string computeKey(const llvm::Module &M){
+		llvm::SmallVector<char, 0> Bitcode;
+		llvm::raw_svector_ostream OS(Bitcode);
+		llvm::WriteBitcodeToFile(M, OS);
+
+		llvm::MD5 Hash;
+		Hash.update(TargetKey);
+		Hash.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+		llvm::MD5::MD5Result Result;
+		Hash.final(Result);
+		return Result.digest().str().str();
+	}
+
+	std::string getPath(const std::string &Key){
+		llvm::SmallString<128> Path(CacheDir);
+		llvm::sys::path::append(Path, Key + ".o");
+		return Path.str().str();
+	}
+
+	// bring the cache down to 3/4 of its budget, so this doesn't run after every
+	// store. the directory is scanned each time, other processes add and remove
+	// entries too. Keep is the entry just stored
+	void evict(const std::string &Keep){
+		struct Entry{
+			llvm::sys::TimePoint<> Used;
+			uint64_t Size;
+			std::string Path;
+		};
+		std::vector<Entry> Entries;
+		uint64_t Total = 0;
+		llvm::sys::TimePoint<> Now = std::chrono::system_clock::now();
+
+		std::error_code EC;
+		for(llvm::sys::fs::directory_iterator I(CacheDir, EC), E; I != E && !EC; I.increment(EC)){
+			llvm::ErrorOr<llvm::sys::fs::basic_file_status> Status = I->status();
+			if(!Status || !llvm::sys::fs::is_regular_file(*Status))
+				continue;
+			llvm::StringRef Name = llvm::sys::path::filename(I->path());
+			if(Name.contains(".o.tmp-")){
+				// left by a process that died while writing it
+				if(Now - Status->getLastModificationTime() > std::chrono::minutes(10))
+					llvm::sys::fs::remove(I->path());
+				continue;
+			}
+			if(!Name.endswith(".o"))
+				continue;
+			Total += Status->getSize();
+			if(I->path() != Keep)
+				Entries.push_back({Status->getLastModificationTime(), Status->getSize(), I->path()});
+		}
+
+		std::sort(Entries.begin(), Entries.end(),
+				  [](const Entry &A, const Entry &B){ return A.Used < B.Used; });
+		uint64_t Target = Budget / 4 * 3;
+		for(size_t I = 0; I < Entries.size() && Total > Target; ++I){
+			// another process may have removed it already
+			if(llvm::sys::fs::remove(Entries[I].Path, false))
+				continue;
+			Total -= Entries[I].Size;
+			++Evictions;
+		}
+		CacheBytes = Total;
+		SizeKnown = true;
+	}
+
+public:
+	// Budget is the size of the entries in bytes, 0 for no limit
+	KaleidoscopeObjectCache(const std::string &Dir, const llvm::TargetMachine &TM, uint64_t Budget)
+		: CacheDir(Dir), Budget(Budget){
+		TargetKey = std::string(TOY_OBJECT_CACHE_VERSION) + "|" LLVM_VERSION_STRING "|" +
+					TM.getTargetTriple().str() + "|" + TM.getTargetCPU().str() + "|" +
+					TM.getTargetFeatureString().str();
+		llvm::sys::fs::create_directories(CacheDir);
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override{
+		std::string Key = computeKey(*M);
+		std::string Path = getPath(Key);
+
+		int FD;
+		if(!llvm::sys::fs::openFileForRead(Path, FD)){
+			auto BufOrErr = llvm::MemoryBuffer::getOpenFile(FD, Path, -1, false);
+			if(BufOrErr){
+				// a truncated or foreign file is dropped and compiled again
+				auto ObjOrErr = llvm::object::ObjectFile::createObjectFile((*BufOrErr)->getMemBufferRef());
+				if(ObjOrErr){
+					// recently used, for the eviction order
+					llvm::sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+					llvm::sys::fs::closeFile(FD);
+					++Hits;
+					return std::move(*BufOrErr);
+				}
+				llvm::consumeError(ObjOrErr.takeError());
+				llvm::sys::fs::remove(Path);
+				++Invalid;
+			}
+			llvm::sys::fs::closeFile(FD);
+		}
+
+		++Misses;
+		PendingKeys[M] = Key;
+		return nullptr;
+	}
+
+	void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override{
+		auto It = PendingKeys.find(M);
+		std::string Key = It != PendingKeys.end() ? It->second : computeKey(*M);
+		if(It != PendingKeys.end())
+			PendingKeys.erase(It);
+
+		// write to a temporary file and rename it, so a reader never sees half an object
+		std::string Path = getPath(Key);
+		int FD;
+		llvm::SmallString<128> TmpPath;
+		if(llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TmpPath))
+			return;
+		{
+			llvm::raw_fd_ostream OS(FD, true);
+			OS << Obj.getBuffer();
+			if(OS.has_error()){
+				OS.clear_error();
+				llvm::sys::fs::remove(TmpPath);
+				return;
+			}
+		}
+		if(llvm::sys::fs::rename(TmpPath, Path)){
+			llvm::sys::fs::remove(TmpPath);
+			return;
+		}
+
+		CacheBytes += Obj.getBufferSize();
+		if(Budget && (!SizeKnown || CacheBytes > Budget))
+			evict(Path);
+	}
+
+	// BatchWorkers: batch -j compiled on its workers, their objects go to the
+	// JIT without the cache
+	void printStats(bool BatchWorkers) const{
+		fprintf(stderr, "object cache %s: %u hits, %u misses, %u invalid entries dropped, %u evictions\n",
+				CacheDir.c_str(), Hits, Misses, Invalid, Evictions);
+		if(BatchWorkers)
+			fprintf(stderr, "object cache: the objects of the batch -j workers bypass the cache\n");
+	}
+};
@@ -1,6 +1,7 @@
 #include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -11,42 +12,145 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <malloc.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 
 using namespace llvm;
 using namespace llvm::orc;
 
-#include "lexer.cpp"
 //#include "Paser.hpp"
-#include "IR.cpp"
+#include "Async.hpp"
+#include "IR.hpp"
+#include "Inline.hpp"
+#include "Interp.hpp"
+#include "Memo.hpp"
+#include "Profile.hpp"
+#include "Trace.hpp"
+
+
+std::unique_ptr<Parser> TheParser;
+
+Parser::Parser(std::unique_ptr<Lexer> L) : Lex(std::move(L)){
+	// install standard binary operators
+	// 1 is lowest precedence
+	std::fill(std::begin(BinopPrecedence), std::end(BinopPrecedence), 0);
+	BinopPrecedence['='] = 2;
+	BinopPrecedence['<'] = 10;
+	BinopPrecedence['+'] = 20;
+	BinopPrecedence['-'] = 20;
+	BinopPrecedence['*'] = 40; // highest precedence
+}
 
+void Parser::scanOperators(Lexer &L){
+	int Tok = L.gettok();
+	while(Tok != tok_eof){
+		if(Tok != tok_def){
+			Tok = L.gettok();
+			continue;
+		}
+		if((Tok = L.gettok()) != tok_binary)
+			continue;
+		int Op = L.gettok();
+		if(!isascii(Op)){
+			Tok = Op;
+			continue;
+		}
+		// the default and the range of ParsePrototype
+		unsigned Precedence = 30;
+		Tok = L.gettok();
+		if(Tok == tok_number && L.getNumVal() >= 1 && L.getNumVal() <= 100)
+			Precedence = (unsigned)L.getNumVal();
+		BinopPrecedence[(unsigned char)Op] = Precedence;
+	}
+}
 
-// save cunrrent token
-static int CurTok; // it is key->number or char
-static int getNextToken(){
-	return	CurTok = gettok();
+int Parser::getNextToken(){
+	if(!TraceEnabled)
+		return	CurTok = Lex->gettok();
+	uint64_t Start = TraceNow();
+	CurTok = Lex->gettok();
+	TraceLexNanos += TraceNow() - Start;
+	++TraceTokens;
+	return CurTok;
 }
 
 
+static cl::opt<bool>
+ParseStats("parse-stats",
+		   cl::desc("Print parse time, heap growth and arena size per top-level item"),
+		   cl::init(false));
+
+// the bytes malloc has handed out and not got back, from glibc's mallinfo2
+// (2.33 and later). it covers every thread: parsers running at the same time
+// (batch -j, several input files) show up in each other's numbers
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define HAVE_MALLINFO2 1
+static int64_t HeapBytesInUse(){
+	struct mallinfo2 MI = mallinfo2();
+	return MI.uordblks + MI.hblkhd;
+}
+#endif
+
+// measures one top-level item from its first token to the finished AST
+class ParseStatsScope{
+	std::chrono::steady_clock::time_point Start;
+#ifdef HAVE_MALLINFO2
+	int64_t HeapStart = 0;
+#endif
+
+public:
+	ParseStatsScope(){
+		if(!ParseStats)
+			return;
+#ifdef HAVE_MALLINFO2
+		HeapStart = HeapBytesInUse();
+#endif
+		Start = std::chrono::steady_clock::now();
+	}
+
+	void report(const PrototypeAST &Proto, const ASTArena &Arena){
+		if(!ParseStats)
+			return;
+		double Us = std::chrono::duration<double, std::micro>(
+						std::chrono::steady_clock::now() - Start).count();
+#ifdef HAVE_MALLINFO2
+		fprintf(stderr, "parse %s: %.1f us, %+lld heap bytes, %zu arena bytes\n",
+				Proto.getName().c_str(), Us, (long long)(HeapBytesInUse() - HeapStart),
+				Arena.getBytesAllocated());
+#else
+		fprintf(stderr, "parse %s: %.1f us, %zu arena bytes\n",
+				Proto.getName().c_str(), Us, Arena.getBytesAllocated());
+#endif
+	}
+};
+
+
 // LogError*
-std::unique_ptr<ExprAST> LogError(const char *Str){
+ExprAST * LogError(const char *Str){
 	fprintf(stderr, "LogError: %s\n", Str);
 	return nullptr;
 }
@@ -58,14 +162,14 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str){
 
 
 // numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr(){
-	auto Result = std::make_unique<NumberExprAST>(NumVal);
+ExprAST * Parser::ParseNumberExpr(){
+	auto Result = NewNode<NumberExprAST>(Lex->getNumVal(), Lex->isIntNum(), Lex->getIntNumVal());
 	getNextToken();	// eat number
-	return std::move(Result);
+	return Result;
 }
 
 // parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr(){
+ExprAST * Parser::ParseParenExpr(){
 	getNextToken(); // eat (
 
 	auto V = ParseExpression();
@@ -84,23 +188,37 @@ static std::unique_ptr<ExprAST> ParseParenExpr(){
 // identifierexpr
 // 	::= identifier
 // 	::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr(){
-	std::string IdName = IdentifierStr;
+// 	::= identifier '[' expression ']'
+ExprAST * Parser::ParseIdentifierExpr(){
+	Symbol IdName = Lex->getIdentifierSym();
 
 	getNextToken(); // eat identifier
 
+	// array element
+	if(CurTok == '['){
+		getNextToken(); // eat [
+		auto Index = ParseExpression();
+		if(!Index)
+			return nullptr;
+		if(CurTok != ']')
+			return LogError("Expected ']'");
+		getNextToken(); // eat ]
+		return NewNode<IndexExprAST>(NewNode<VariableExprAST>(IdName), Index);
+	}
+
 	if(CurTok != '(') // simple variable ref
-		return std::make_unique<VariableExprAST> (IdName);
+		return NewNode<VariableExprAST> (IdName);
 
 	// identifier + '(', we can conduce it is a fucntion call
 	// Call
 	getNextToken(); // eat (
-	std::vector<std::unique_ptr<ExprAST>> Args;
+	// collect on the stack, then copy the list into the arena
+	SmallVector<ExprAST *, 8> Args;
 	if(CurTok != ')'){
 		// has arguments
 		while(1){
 			if(auto Arg = ParseExpression()){
-				Args.push_back(std::move(Arg));
+				Args.push_back(Arg);
 			}else{
 				return nullptr;
 			}
@@ -116,26 +234,52 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr(){
 
 	getNextToken(); // eat ')'
 
-	return std::make_unique<CallExprAST> (IdName, std::move(Args));
+	return NewNode<CallExprAST> (IdName, CurArena->copyArray<ExprAST *>(Args));
+}
+
+// type ::= 'int' | 'double' | 'array'
+// the names are not keywords, they only mean a type after a ':'
+bool Parser::ParseType(ValType &Ty){
+	if(CurTok != tok_identifier)
+		return false;
+	StringRef Name = Lex->getIdentifierStr();
+	if(Name == "int")
+		Ty = Ty_Int;
+	else if(Name == "double")
+		Ty = Ty_Double;
+	else if(Name == "array")
+		Ty = Ty_Array;
+	else
+		return false;
+	getNextToken(); // eat type
+	return true;
 }
 
-// varexpr ::= 'var' identifier ('=' expression)?
-// 					 (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr(){
+// varexpr ::= 'var' identifier (':' type)? ('=' expression)?
+// 					 (',' identifier (':' type)? ('=' expression)?)* 'in' expression
+ExprAST * Parser::ParseVarExpr(){
 	getNextToken(); // eat var
 
-	std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+	SmallVector<VarDecl, 4> VarNames;
 
 	// At least one variable name is required
 	if(CurTok != tok_identifier)
 		return LogError("Expected identifier after var");
 
 	while(1){
-		std::string Name = IdentifierStr;
+		Symbol Name = Lex->getIdentifierSym();
 		getNextToken(); // eat identifier
 
+		// read the optional type
+		ValType Ty = Ty_Double;
+		if(CurTok == ':'){
+			getNextToken(); // eat ':'
+			if(!ParseType(Ty))
+				return LogError("Expected type after ':'");
+		}
+
 		// read the optional initializer
-		std::unique_ptr<ExprAST> Init;
+		ExprAST * Init = nullptr;
 		if(CurTok == '='){
 			getNextToken(); // eat '='
 
@@ -144,7 +288,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr(){
 				return nullptr;
 		}
 
-		VarNames.push_back(std::make_pair(Name, std::move(Init)));
+		VarNames.push_back({Name, Init, Ty});
 
 		// End of var list, exit loop
 		if(CurTok != ',')
@@ -164,7 +308,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr(){
 	if(!Body)
 		return nullptr;
 
-	return std::make_unique<VarExprAST> (std::move(VarNames), std::move(Body));
+	return NewNode<VarExprAST> (CurArena->copyArray<VarDecl>(VarNames), Body);
 }
 
 
@@ -173,7 +317,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr(){
 // 	::= numberexpr
 // 	::= parenexpr
 //  ::= ifexpr
-static std::unique_ptr<ExprAST> ParsePrimary(){
+ExprAST * Parser::ParsePrimary(){
 	switch(CurTok){
 		default:
 			return LogError("Unknown token when expcting an expression");
@@ -187,6 +331,8 @@ static std::unique_ptr<ExprAST> ParsePrimary(){
 			return ParseIfExpr();
 		case tok_for:
 			return ParseForExpr();
+		case tok_pfor:
+			return ParsePForExpr();
 		case tok_var:
 			return ParseVarExpr();
 	}
@@ -195,8 +341,13 @@ static std::unique_ptr<ExprAST> ParsePrimary(){
 
 
 
+// symbol of the function behind operator Op, "binary" Op or "unary" Op
+Symbol Parser::getOperatorSym(StringRef Prefix, char Op){
+	return Lex->intern((Prefix + Twine(Op)).str());
+}
+
 // GetTokPrecedence
-static int GetTokPrecedence(){
+int Parser::GetTokPrecedence(){
 	if(!isascii(CurTok))
 		return -1;
 
@@ -210,19 +361,19 @@ static int GetTokPrecedence(){
 
 // expression
 // 	::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression(){
+ExprAST * Parser::ParseExpression(){
 	auto LHS = ParseUnary(); // primary | unary
 	if(!LHS)
 		return nullptr;
 
 	// we set 0, beause first LHS, will not be evaulated
-	return ParseBinOpRHS(0, std::move(LHS));
+	return ParseBinOpRHS(0, LHS);
 }
 
 
 // binoprhs
 // 	::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS){
+ExprAST * Parser::ParseBinOpRHS(int ExprPrec, ExprAST * LHS){
 	while(1){
 		int TokPrec = GetTokPrecedence();
 
@@ -247,21 +398,21 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
     		// we know that any sequence of pairs whose operators are all higher precedence 
     		// than "TokPrec" should be parsed together and returned as “RHS”
     		// specifying “TokPrec+1” as the minimum precedence required for it to continue
-    		RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+    		RHS = ParseBinOpRHS(TokPrec + 1, RHS);
     		if(!RHS)
     			return nullptr;
     	}
 
     	// merge
-    	LHS = std:: make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    	LHS = NewNode<BinaryExprAST>(BinOp, LHS, RHS, getOperatorSym("binary", BinOp));
 	}
 }
 
 
 // prototype
-// 	::= id '(' id* ')'
+// 	::= id '(' (id (':' type)?)* ')' (':' type)?
 //  ::= binary LETTER number? (id, id)
-static std::unique_ptr<PrototypeAST> ParsePrototype(){
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype(){
 	std::string FnName;
 
 	unsigned Kind = 0; // 0 => identifier, 1 => unary, 2 => binary (number)
@@ -271,7 +422,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype(){
 		default:
 			return LogErrorP("Expected function name in prototype");
 		case tok_identifier:
-			FnName = IdentifierStr;
+			FnName = Lex->getIdentifierStr().str();
 			Kind = 0;
 			getNextToken();
 			break;
@@ -295,9 +446,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype(){
 
 			// read the precedence if present
 			if(CurTok == tok_number){
-				if(NumVal < 1 || NumVal > 100)
+				if(Lex->getNumVal() < 1 || Lex->getNumVal() > 100)
 					return LogErrorP("Invalid precedence: must be 1..100");
-				BinaryPrecedence = (unsigned)NumVal;
+				BinaryPrecedence = (unsigned)Lex->getNumVal();
 				getNextToken();
 			}
 			break;
@@ -307,29 +458,49 @@ static std::unique_ptr<PrototypeAST> ParsePrototype(){
 	if(CurTok != '(')
 		return LogErrorP("Expected '(' in prototype");
 
-	// read argument names
+	// read argument names and their optional types
 	std::vector<std::string> ArgNames;
-	while(getNextToken() == tok_identifier)
-		ArgNames.push_back(IdentifierStr);
+	std::vector<ValType> ArgTypes;
+	getNextToken(); // eat '('
+	while(CurTok == tok_identifier){
+		ArgNames.push_back(Lex->getIdentifierStr().str());
+		getNextToken(); // eat identifier
+
+		ValType Ty = Ty_Double;
+		if(CurTok == ':'){
+			getNextToken(); // eat ':'
+			if(!ParseType(Ty))
+				return LogErrorP("Expected type after ':' in prototype");
+		}
+		ArgTypes.push_back(Ty);
+	}
 	if(CurTok != ')')
 		return LogErrorP("Expected ')' in prototype");
 
 	// finish
 	getNextToken(); // eat ')'
 
+	// read the optional return type
+	ValType RetType = Ty_Double;
+	if(CurTok == ':'){
+		getNextToken(); // eat ':'
+		if(!ParseType(RetType))
+			return LogErrorP("Expected return type after ':' in prototype");
+	}
+
 	// verify right number of names for operator
 	if(Kind && ArgNames.size() != Kind)
 		return LogErrorP("Invalid number of operands for operator");
 
 	return std::make_unique<PrototypeAST> (FnName, std::move(ArgNames), Kind != 0,
-											BinaryPrecedence);
+											BinaryPrecedence, std::move(ArgTypes), RetType);
 }
 
 
 // unary
 //    ::= primary
 //    ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary(){
+ExprAST * Parser::ParseUnary(){
 	// if current token is not an operator, it must be a primary expr
 	if(!isascii(CurTok) || CurTok == '(' || CurTok == ',')
 		return ParsePrimary();
@@ -338,32 +509,42 @@ static std::unique_ptr<ExprAST> ParseUnary(){
 	int Opc = CurTok;
 	getNextToken(); // eat
 	if(auto Operand = ParseUnary())
-		return std::make_unique<UnaryExprAST> (Opc, std::move(Operand));
+		return NewNode<UnaryExprAST> (Opc, Operand, getOperatorSym("unary", Opc));
 	return nullptr;
 }
 
 // definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition(){
+std::unique_ptr<FunctionAST> Parser::ParseDefinition(){
+	ParseStatsScope Stats;
 	getNextToken(); // eat def
 	auto Proto = ParsePrototype();
 	if(!Proto)
 		return nullptr;
 
-	if(auto E = ParseExpression())
-		return std::make_unique<FunctionAST> (std::move(Proto), std::move(E));
+	// the body nodes go into a fresh arena owned by the FunctionAST
+	auto Arena = std::make_unique<ASTArena>();
+	CurArena = Arena.get();
+	if(auto E = ParseExpression()){
+		Stats.report(*Proto, *Arena);
+
+		// If this is an operator, install it, the rest of the input may already use it
+		if(Proto->isBinaryOp())
+			BinopPrecedence[(unsigned char)Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+		return std::make_unique<FunctionAST> (std::move(Proto), E, std::move(Arena));
+	}
 	return nullptr;
 }
 
 
 // external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern(){
+std::unique_ptr<PrototypeAST> Parser::ParseExtern(){
 	getNextToken(); // eat extern
 	return ParsePrototype();
 }
 
 
 // ifexpr := 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr(){
+ExprAST * Parser::ParseIfExpr(){
 	getNextToken(); // eat if
 
 	// condition
@@ -388,7 +569,7 @@ static std::unique_ptr<ExprAST> ParseIfExpr(){
 	if(!Else)
 		return nullptr;
 
-	return std::make_unique<IfExprAST> (std::move(Cond), std::move(Then), std::move(Else));
+	return NewNode<IfExprAST> (Cond, Then, Else);
 }
 
 
@@ -402,13 +583,13 @@ def printstar(n)
 */
 
 // forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr(){
+ExprAST * Parser::ParseForExpr(){
 	getNextToken(); // eat for
 
 	if(CurTok != tok_identifier)
 		return LogError("Expected identifier after for");
 
-	std::string IdName = IdentifierStr;
+	Symbol IdName = Lex->getIdentifierSym();
 	getNextToken(); // eat identifier
 
 	if(CurTok != '=')
@@ -427,7 +608,7 @@ static std::unique_ptr<ExprAST> ParseForExpr(){
 		return nullptr;
 
 	// Step value is optional
-	std::unique_ptr<ExprAST> Step;
+	ExprAST * Step = nullptr;
 	if(CurTok == ','){
 		getNextToken(); // eate ','
 		Step = ParseExpression();
@@ -443,19 +624,73 @@ static std::unique_ptr<ExprAST> ParseForExpr(){
 	if(!Body)
 		return nullptr;
 
-	return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), 
-							std::move(Step), std::move(Body));
+	return NewNode<ForExprAST>(IdName, Start, End, Step, Body);
+}
+
+// pforexpr ::= 'pfor' ('+' | '*')? identifier '=' expr ',' expr (',' expr)? 'in' expression
+ExprAST * Parser::ParsePForExpr(){
+	getNextToken(); // eat pfor
+
+	// the reduction, if any
+	char Reduction = 0;
+	if(CurTok == '+' || CurTok == '*'){
+		Reduction = CurTok;
+		getNextToken();
+	}
+
+	if(CurTok != tok_identifier)
+		return LogError("Expected identifier after pfor");
+
+	Symbol IdName = Lex->getIdentifierSym();
+	getNextToken(); // eat identifier
+
+	if(CurTok != '=')
+		return LogError("Expected '=' after pfor");
+	getNextToken(); // eat '='
+
+	auto Start = ParseExpression();
+	if(!Start)
+		return nullptr;
+	if(CurTok != ',')
+		return LogError("Expected ',' after pfor start value");
+	getNextToken(); // eat ','
+
+	auto End = ParseExpression();
+	if(!End)
+		return nullptr;
+
+	ExprAST * Step = nullptr;
+	if(CurTok == ','){
+		getNextToken(); // eat ','
+		Step = ParseExpression();
+		if(!Step)
+			return nullptr;
+	}
+
+	if(CurTok != tok_in)
+		return LogError("Expected 'in' after pfor");
+	getNextToken(); // eat 'in'
+
+	auto Body = ParseExpression();
+	if(!Body)
+		return nullptr;
+
+	return NewNode<PForExprAST>(IdName, Reduction, Start, End, Step, Body);
 }
 
 
 
 
 // toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr(){
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr(){
+	ParseStatsScope Stats;
+	auto Arena = std::make_unique<ASTArena>();
+	CurArena = Arena.get();
 	if(auto E = ParseExpression()){
 		// make an anonymous proto
 		auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-		return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+		Stats.report(*Proto, *Arena);
+		return std::make_unique<FunctionAST>(std::move(Proto), E, std::move(Arena));
 	}
 	return nullptr;
 }
@@ -464,31 +699,112 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr(){
 
 
 // Top-Level Parsing and JIT Driver
+// without it a double reduction (s = s + x[i] * y[i]) keeps its order and
+// can't be vectorized
+cl::opt<bool>
+FastMath("fast-math",
+		 cl::desc("Allow double arithmetic to be reassociated and contracted"),
+		 cl::init(false));
+
+// without it the code only uses the instructions every CPU of the target
+// triple has, for x86-64 that means SSE2 and no FMA
+cl::opt<bool>
+HostCPU("host-cpu",
+		cl::desc("Compile for the CPU and the features of this machine (JIT, batch, and -aot "
+				 "without -multiversion)"),
+		cl::init(true));
+
 void InitializeModuleAndPassManager(void){
+    // every thread keeps one context for all of its modules
+    if(!TheContext){
+        TheContext = std::make_unique<LLVMContext>();
+        Builder = std::make_unique<IRBuilder<>>(*TheContext);
+        if(FastMath){
+            FastMathFlags FMF;
+            FMF.setAllowReassoc();
+            FMF.setAllowContract(true);
+            Builder->setFastMathFlags(FMF);
+        }
+    }
+
     // Open a new module
-    TheModule = std::make_unique<Module>("my cool jit", TheContext);
+    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    ++NumModulesCreated;
+    ModuleFunctions.clear();
     TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
 
-    // create a pass manager
-    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+    // the passes are no longer per function, OptimizeModule runs the -O
+    // pipeline over the finished module
+}
 
-    // promote allocas to registers
-    TheFPM->add(createPromoteMemoryToRegisterPass());
 
-    // Do simple "peephole" optimizations and bit-twidding optzns
-    TheFPM->add(createInstructionCombiningPass());
-    
-    // Reassociate expressions
-    TheFPM->add(createReassociatePass());
+cl::opt<char>
+OptLevel("O",
+		 cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+		 cl::Prefix, cl::ZeroOrMore, cl::init('2'));
 
-    // Eliminate Common SubExpressions
-    TheFPM->add(createGVNPass());
+// -time-passes (LLVM's own option) for the new pass manager, the handler lives
+// as long as the thread so the timings add up over all modules
+struct PassTiming{
+	PassInstrumentationCallbacks PIC;
+	TimePassesHandler TimePasses{TimePassesIsEnabled};
 
-    // Simplify the control flow graph (deleting unreachable blocks)
-    TheFPM->add(createCFGSimplificationPass());
+	PassTiming(){ TimePasses.registerCallbacks(PIC); }
+};
+static thread_local PassTiming ThePassTiming;
 
-    TheFPM->doInitialization();
+static bool ParseOptLevel(PassBuilder::OptimizationLevel &Level){
+	switch(OptLevel){
+		case '1': Level = PassBuilder::OptimizationLevel::O1; return true;
+		case '2': Level = PassBuilder::OptimizationLevel::O2; return true;
+		case '3': Level = PassBuilder::OptimizationLevel::O3; return true;
+		default: return false;
+	}
+}
 
+// run the default new pass manager pipeline for -O1..-O3 over M: SROA / mem2reg,
+// the inliner, loop passes, ... at module level, so calls inside one module
+// (batch mode) can be inlined. -O0 leaves the IR alone
+// TM provides the target info for the cost models, pass the one of the calling thread
+void OptimizeModule(Module &M, TargetMachine *TM, bool LTO){
+	PassBuilder::OptimizationLevel Level;
+	if(OptLevel == '0' || !ParseOptLevel(Level))
+		return;
+	TraceScope Span(TP_Optimize);
+	if(TraceEnabled)
+		Span.setDetail(ModuleDetail(M));
+
+	// fresh analysis managers each time, nothing cached may outlive the module
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+
+	// the loop and SLP vectorizers are off unless asked for, clang turns them
+	// on from -O2 as well
+	PipelineTuningOptions PTO;
+	PTO.LoopVectorization = OptLevel >= '2';
+	PTO.SLPVectorization = OptLevel >= '2';
+
+	PassBuilder PB(TM, PTO, None, &ThePassTiming.PIC);
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+	// profile counts on the functions are only used with a summary
+	AttachProfileSummary(M);
+
+	ModulePassManager MPM = LTO ? PB.buildLTODefaultPipeline(Level, false, nullptr)
+								: PB.buildPerModuleDefaultPipeline(Level);
+	MPM.run(M, MAM);
+}
+
+// print the -time-passes report of the calling thread
+void PrintPassTimings(){
+	if(TimePassesIsEnabled)
+		ThePassTiming.TimePasses.print();
 }
 
 /*
@@ -496,94 +812,573 @@ void InitializeModuleAndPassManager(void){
 static void InitializeModule(){
 	// open a new context and module
 	TheContext = std::make_unique<LLVMContext>();
-	TheModule = std::make_unique<Module>("my cool jit", TheContext);
+	TheModule = std::make_unique<Module>("my cool jit", *TheContext);
 
 	// create a new builder
 	Builder = std::make_unique<IRBuilder<>>(*TheContext);
 }
 */
 
-static void HandleDefinition(){
-	if(auto FnAST = ParseDefinition()){
-		if(auto *FnIR = FnAST->codegen()){
+static cl::opt<bool>
+FastEval("fast-eval",
+		 cl::desc("Interpret top-level expressions without a loop instead of JIT compiling them"),
+		 cl::init(true));
+
+static cl::opt<bool>
+ReplStats("repl-stats",
+		  cl::desc("Print the latency of REPL lines per kind at exit"),
+		  cl::init(false));
+
+// -repl-stats, the latency of each line from its first token to its result
+enum ReplLineKind{ RL_Definition, RL_Extern, RL_Interpreted, RL_Compiled, RL_NumKinds };
+static const char * const ReplLineNames[RL_NumKinds] = {
+	"definition", "extern", "expr interpreted", "expr compiled"};
+static std::vector<double> ReplLatencies[RL_NumKinds];
+static ReplLineKind LastLineKind; // set while a line is handled
+
+// parse a top-level item in a parse span, Item and the span get the name of
+// its function
+static const std::string & ItemName(const PrototypeAST & P){ return P.getName(); }
+static const std::string & ItemName(const FunctionAST & F){ return F.getProto().getName(); }
+
+template<typename AST>
+static std::unique_ptr<AST> TracedParse(std::unique_ptr<AST> (Parser::*Parse)(), TraceScope & Item){
+	TraceScope Span(TP_Parse);
+	std::unique_ptr<AST> Node = (*TheParser.*Parse)();
+	if(Node && TraceEnabled){
+		Span.setDetail(ItemName(*Node));
+		Item.setDetail(ItemName(*Node));
+	}
+	return Node;
+}
+
+void HandleDefinition(){
+	TraceScope Item(TP_Item);
+	if(auto FnAST = TracedParse(&Parser::ParseDefinition, Item)){
+		NoteDefinition(*FnAST);
+		if(TierThreshold){
+			DefineTiered(std::move(FnAST));
+			fprintf(stderr, "Read function definition (interpreted)\n");
+			return;
+		}
+
+		Symbol Sym = FnAST->getProto().getSym();
+		std::vector<BranchCounts *> Counters;
+		Function * FnIR = PGOInstrument ? CodegenInstrumented(*FnAST, Counters) : FnAST->codegen();
+		if(FnIR){
+			std::string BodyName = RenameToBody(FnIR, Sym);
+			PrepareDefinition(FnIR, Sym, true);
+
 			fprintf(stderr, "Read function definition:");
+			OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+			PublishDefinition(FnIR, Sym);
 			FnIR->print(errs());
 			fprintf(stderr, "\n");
 
-			TheJIT->addModule(std::move(TheModule));
+			{
+				TraceScope Span(TP_JIT, FnAST->getProto().getName());
+				TheJIT->addModule(std::move(TheModule));
+			}
 			InitializeModuleAndPassManager();
+			SwapInBody(Sym, BodyName);
+			ForgetExtern(Sym);
+			RecompileStaleDefinitions();
+			if(PGOInstrument)
+				KeepInstrumented(Sym, std::move(FnAST), std::move(Counters));
 		}
 	}else{
 		// Skip token for error recovery
-		getNextToken();
+		TheParser->getNextToken();
 	}
 }
 
-static void HandleExtern(){
-	if(auto ProtoAST = ParseExtern()){
+void HandleExtern(){
+	TraceScope Item(TP_Item);
+	if(auto ProtoAST = TracedParse(&Parser::ParseExtern, Item)){
 		if(auto * FnIR = ProtoAST->codegen()){
 			fprintf(stderr, "Read extern: ");
 			FnIR->print(errs());
 			fprintf(stderr, "\n");
-			FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+			ForgetExtern(ProtoAST->getSym());
+			FunctionProtos[ProtoAST->getSym()] = std::move(ProtoAST);
 		}
 	}else{
 		// Skip token for error recovery
-		getNextToken();
+		TheParser->getNextToken();
 	}
 }
 
 
-static void HandleTopLevelExpression(){
+void HandleTopLevelExpression(){
 	// Evaluate a top-level expression into an anonymous function
-	if(auto FnAST = ParseTopLevelExpr()){
+	TraceScope Item(TP_Item);
+	if(auto FnAST = TracedParse(&Parser::ParseTopLevelExpr, Item)){
+		// run-once code never pays for codegen when tiering is on, and without
+		// a loop it isn't worth a module / JIT round trip either: the calls in
+		// it go to the cached entries of the compiled functions. with -async-eval
+		// it runs on a worker instead, a call can take as long as a loop
+		if(TierThreshold || (FastEval && !AsyncEvalEnabled() && FnAST->getBody()->isLoopFree())){
+			LastLineKind = RL_Interpreted;
+			TraceScope Span(TP_Interpret, FnAST->getProto().getName());
+			if(auto V = InterpretTopLevel(*FnAST))
+				ReportEvaluated(V->D);
+			return;
+		}
+
 		if(auto * FnIR = FnAST->codegen()){
+			// let the inliner see the functions it calls
+			ImportInlineBodies(*FnIR->getParent(), FnAST->getProto().getSym());
+
+			// it may still run while the next one is compiled, each gets a name of its own
+			std::string Name = "__anon_expr";
+			if(AsyncEvalEnabled()){
+				static unsigned NumAsyncExprs;
+				Name = "__async_expr." + std::to_string(NumAsyncExprs++);
+				forgetFunction(FnIR);
+				FnIR->setName(Name);
+			}
 
 			// JIT
-			auto H = TheJIT->addModule(std::move(TheModule));
+			OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+			VModuleKey H;
+			{
+				TraceScope Span(TP_JIT, FnAST->getProto().getName());
+				H = TheJIT->addModule(std::move(TheModule));
+			}
 
 			// Once the module has been added to the JIT it can no longer be modified, 
 			// so we also open a new module to hold subsequent code
 			InitializeModuleAndPassManager();
 
 			// search the JIT for the anonymous expression
-			auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-			assert(ExprSymbol && "Function not found");
-
-			// Get the symbol's address and cast it to the right type (takes no
-      		// arguments, returns a double) so we can call it as a native function
-			double (*FP)() = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
-			fprintf(stderr, "Evaluated to %f\n", FP());
+			double (*FP)();
+			{
+				TraceScope Span(TP_Lookup, FnAST->getProto().getName());
+				auto ExprSymbol = TheJIT->findSymbol(Name);
+				assert(ExprSymbol && "Function not found");
+
+				// Get the symbol's address and cast it to the right type (takes no
+				// arguments, returns a double) so we can call it as a native function
+				FP = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
+			}
+			if(AsyncEvalEnabled()){
+				// the module goes once the result is printed, see RetireEvaluations
+				SubmitEvaluation(Name, FP, H);
+				return;
+			}
+			double Result;
+			{
+				TraceScope Span(TP_Run, FnAST->getProto().getName());
+				Result = FP();
+			}
+			fprintf(stderr, "Evaluated to %f\n", Result);
 
 			// Remove the anonymous expression
 			TheJIT->removeModule(H);
+			++NumModulesRemoved;
 		}
 	}else{
 		// Skip token for error recovery
-		getNextToken();
+		TheParser->getNextToken();
 	}
 }
 
+// print "ready>" before each line, the compile server doesn't
+bool ReplPrompt = true;
+
 // top := definition | extern1 | expression | ';'
-static void MainLoop(){
+void MainLoop(){
 	while(1){
-		fprintf(stderr, "ready>");
-		switch(CurTok){
+		if(ReplPrompt)
+			fprintf(stderr, "ready>");
+		auto Start = std::chrono::steady_clock::now();
+		RetireEvaluations();
+		switch(TheParser->getCurTok()){
 			case tok_eof:
+				WaitForEvaluations();
 				return ;
 			case ';': // ignore
-				getNextToken();
-				break;
+				TheParser->getNextToken();
+				continue;
 			case tok_def:
+				LastLineKind = RL_Definition;
 				HandleDefinition();
 				break;
 			case tok_extern:
+				LastLineKind = RL_Extern;
 				HandleExtern();
 				break;
 			default:
+				LastLineKind = RL_Compiled;
 				HandleTopLevelExpression();
 				break;
 		}
+		RecompileHotFunctions();
+		if(ReplStats)
+			ReplLatencies[LastLineKind].push_back(std::chrono::duration<double, std::micro>(
+				std::chrono::steady_clock::now() - Start).count());
+	}
+}
+
+// -repl-stats summary, one line per kind of item
+void PrintReplStats(){
+	if(!ReplStats)
+		return;
+	for(unsigned K = 0; K != RL_NumKinds; ++K){
+		std::vector<double> &L = ReplLatencies[K];
+		if(L.empty())
+			continue;
+		std::sort(L.begin(), L.end());
+		double Sum = 0;
+		for(double Us : L)
+			Sum += Us;
+		fprintf(stderr, "repl %-17s %6zu lines, mean %9.1f us, median %9.1f us, p90 %9.1f us, max %9.1f us\n",
+				ReplLineNames[K], L.size(), Sum / L.size(), L[L.size() / 2], L[L.size() * 9 / 10],
+				L.back());
+	}
+	PrintInlineStats();
+	PrintAsyncStats();
+}
+
+
+
+// batch mode: parse the whole input first, emit every function into one module,
+// optimize that module once and hand it to the JIT in one step,
+// then run the top-level expressions in source order
+
+
+// run the codegen passes of TM over M and return the object file
+static std::unique_ptr<MemoryBuffer> EmitObject(Module &M, TargetMachine &TM){
+	SmallVector<char, 0> ObjBuffer;
+	{
+		raw_svector_ostream ObjStream(ObjBuffer);
+		legacy::PassManager PM;
+		MCContext * Ctx;
+		if(TM.addPassesToEmitMC(PM, Ctx, ObjStream))
+			return nullptr;
+		PM.run(M);
+	}
+	return std::make_unique<SmallVectorMemoryBuffer>(std::move(ObjBuffer));
+}
+
+
+// batch -j N: the items are handed to N worker threads, each one has its own
+// LLVMContext / module / pass manager (the thread_local codegen state) and its own
+// TargetMachine, so IR generation, the function passes and machine code generation
+// all run in parallel. every worker ends up with one object file, those are
+// added to the JIT afterwards. returns false on error
+bool BatchCompileParallel(std::vector<BatchItem> &Items, unsigned NumThreads){
+	// every prototype must be known before any worker looks up a callee
+	std::vector<BatchItem *> Work;
+	std::set<std::string> Defined;
+	for(auto &Item : Items){
+		if(Item.Extern){
+			FunctionProtos[Item.Extern->getSym()] = std::move(Item.Extern);
+			continue;
+		}
+		if(Item.ExprName.empty()){
+			const PrototypeAST &P = Item.Fn->getProto();
+			if(!Defined.insert(P.getName()).second){
+				LogError("Function cannot be redefined.");
+				return false;
+			}
+			FunctionProtos[P.getSym()] = std::make_unique<PrototypeAST>(P);
+		}
+		Work.push_back(&Item);
 	}
+
+	// TargetMachine is not thread safe, create one per worker up front
+	std::vector<std::unique_ptr<TargetMachine>> TMs;
+	for(unsigned W = 0; W < NumThreads; ++W)
+		TMs.emplace_back(selectHostTarget(HostCPU));
+
+	std::atomic<size_t> Next{0};
+	std::atomic<bool> Failed{false};
+	std::vector<std::unique_ptr<MemoryBuffer>> Objects(NumThreads);
+	std::vector<std::thread> Workers;
+	for(unsigned W = 0; W < NumThreads; ++W){
+		Workers.emplace_back([&, W](){
+			InitializeModuleAndPassManager();
+
+			for(size_t I; (I = Next.fetch_add(1, std::memory_order_relaxed)) < Work.size(); ){
+				BatchItem &Item = *Work[I];
+				Function * F = Item.Fn->codegen();
+				if(!F){
+					Failed = true;
+					continue;
+				}
+				if(!Item.ExprName.empty()){
+					forgetFunction(F);
+					F->setName(Item.ExprName);
+				}
+			}
+
+			OptimizeModule(*TheModule, TMs[W].get());
+			{
+				TraceScope Span(TP_JIT);
+				if(TraceEnabled)
+					Span.setDetail(ModuleDetail(*TheModule));
+				Objects[W] = EmitObject(*TheModule, *TMs[W]);
+			}
+			if(!Objects[W])
+				Failed = true;
+
+			// the module and builder must go before the context they live in
+			ModuleFunctions.clear();
+			TheModule.reset();
+			Builder.reset();
+			TheContext.reset();
+		});
+	}
+	for(auto &T : Workers)
+		T.join();
+
+	if(Failed)
+		return false;
+	for(auto &Obj : Objects)
+		TheJIT->addObject(std::move(Obj));
+	return true;
 }
 
+// parse the rest of the input, top-level expressions are named ExprPrefix + N
+// in source order and listed in ExprNames. returns false if an item had an
+// error, the others are kept
+bool ParseBatchItems(Parser &P, std::vector<BatchItem> &Items,
+					 std::vector<std::string> &ExprNames, const std::string &ExprPrefix){
+	bool Ok = true;
+	while(P.getCurTok() != tok_eof){
+		if(P.getCurTok() == ';'){ // ignore
+			P.getNextToken();
+			continue;
+		}
+		BatchItem Item;
+		TraceScope Span(TP_Parse);
+		switch(P.getCurTok()){
+			case tok_def:
+				Item.Fn = P.ParseDefinition();
+				break;
+			case tok_extern:
+				Item.Extern = P.ParseExtern();
+				break;
+			default:
+				Item.Fn = P.ParseTopLevelExpr();
+				break;
+		}
+		if(!Item.Fn && !Item.Extern){
+			// Skip token for error recovery
+			Ok = false;
+			P.getNextToken();
+			continue;
+		}
+		// top-level expressions all come out as __anon_expr, give each its own name
+		if(Item.Fn && Item.Fn->getProto().getName() == "__anon_expr"){
+			Item.ExprName = ExprPrefix + std::to_string(ExprNames.size());
+			ExprNames.push_back(Item.ExprName);
+		}
+		if(TraceEnabled)
+			Span.setDetail(!Item.ExprName.empty() ? Item.ExprName
+							: Item.Fn ? ItemName(*Item.Fn) : ItemName(*Item.Extern));
+		Items.push_back(std::move(Item));
+	}
+	return Ok;
+}
+
+// codegen every item into TheModule, returns false if one had an error
+bool CodegenBatchItems(std::vector<BatchItem> &Items){
+	bool Ok = true;
+	for(auto &Item : Items){
+		if(Item.Extern){
+			if(Item.Extern->codegen())
+				FunctionProtos[Item.Extern->getSym()] = std::move(Item.Extern);
+			else
+				Ok = false;
+			continue;
+		}
+
+		Function * F = Item.Fn->codegen();
+		if(!F){
+			Ok = false;
+			continue;
+		}
+		if(!Item.ExprName.empty()){
+			forgetFunction(F);
+			F->setName(Item.ExprName);
+		}
+	}
+	return Ok;
+}
+
+// run the JIT'd top-level expressions of a batch, in source order
+static void RunBatchExprs(const std::vector<std::string> &ExprNames){
+	for(auto &Name : ExprNames){
+		double (*FP)();
+		{
+			TraceScope Span(TP_Lookup, Name);
+			auto ExprSymbol = TheJIT->findSymbol(Name);
+			assert(ExprSymbol && "Function not found");
+			FP = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
+		}
+		double Result;
+		{
+			TraceScope Span(TP_Run, Name);
+			Result = FP();
+		}
+		fprintf(stderr, "Evaluated to %f\n", Result);
+	}
+}
+
+// returns the end-to-end time in seconds, or a negative value on error
+double BatchMain(unsigned NumThreads){
+	using Clock = std::chrono::steady_clock;
+	auto Seconds = [](Clock::time_point A, Clock::time_point B){
+		return std::chrono::duration<double>(B - A).count();
+	};
+	bool HadError = false;
+
+	// parse
+	auto T0 = Clock::now();
+	std::vector<BatchItem> Items;
+	std::vector<std::string> ExprNames;
+	if(!ParseBatchItems(*TheParser, Items, ExprNames, "__batch_expr."))
+		HadError = true;
+	auto T1 = Clock::now();
+
+	if(NumThreads > 1){
+		// codegen, optimize and emit in parallel, one object per worker
+		if(!BatchCompileParallel(Items, NumThreads))
+			return -1;
+	}else{
+		// codegen, every item goes into TheModule
+		if(!CodegenBatchItems(Items))
+			HadError = true;
+
+		// optimize the module once
+		OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+
+		// JIT the module in one step
+		{
+			TraceScope Span(TP_JIT);
+			if(TraceEnabled)
+				Span.setDetail(ModuleDetail(*TheModule));
+			TheJIT->addModule(std::move(TheModule));
+		}
+		InitializeModuleAndPassManager();
+	}
+	Items.clear();
+
+	// run the top-level expressions in source order
+	auto T2 = Clock::now();
+	RunBatchExprs(ExprNames);
+	auto T3 = Clock::now();
+
+	fprintf(stderr, "batch -j %u: parse %.3f s, compile %.3f s, run %.3f s, total %.3f s\n",
+			NumThreads, Seconds(T0, T1), Seconds(T1, T2), Seconds(T2, T3), Seconds(T0, T3));
+	return HadError ? -1 : Seconds(T0, T3);
+}
+
+
+// several input files: they are parsed at the same time, each by a worker with
+// a Lexer and Parser of its own, and funnelled into one code generator. the
+// main thread takes the files in command line order as their ASTs are done
+// and codegens them into TheModule while the workers parse the next ones, then
+// the module is compiled and run like in batch mode.
+// parsers share nothing but the symbol table. the first file is the prelude:
+// it is parsed before the others, which start with the operators it defines.
+// files 2..N don't see each other's operators: a binary operator defined in
+// one of them is only known inside that file (toy-bench -parse-threads pre-scans
+// its input instead, see Parser::scanOperators), shared operators go in the
+// prelude
+struct ParsedFile{
+	std::vector<BatchItem> Items;
+	std::vector<std::string> ExprNames;
+	size_t Bytes = 0;
+	bool Ok = false;
+	bool Done = false;		// under the lock of MultiFileMain
+};
+
+// returns the end-to-end time in seconds, or a negative value on error
+double MultiFileMain(const std::vector<std::string> &Files, unsigned NumThreads){
+	using Clock = std::chrono::steady_clock;
+	auto Seconds = [](Clock::time_point A, Clock::time_point B){
+		return std::chrono::duration<double>(B - A).count();
+	};
+	if(!NumThreads)
+		NumThreads = std::max(1u, std::thread::hardware_concurrency());
+	NumThreads = std::min<size_t>(NumThreads, std::max<size_t>(Files.size() - 1, 1));
+
+	auto T0 = Clock::now();
+	std::vector<ParsedFile> Parsed(Files.size());
+	auto ParseFile = [&Files, &Parsed](size_t I, Parser &P){
+		ParsedFile &F = Parsed[I];
+		auto L = Lexer::fromFile(Files[I]);
+		if(!L)
+			return;
+		F.Bytes = L->getBufferSize();
+		P.setLexer(std::move(L));
+		P.getNextToken();
+		F.Ok = ParseBatchItems(P, F.Items, F.ExprNames, "__file" + std::to_string(I) + ".");
+	};
+	Parser Prelude;
+	ParseFile(0, Prelude);
+	Parsed[0].Done = true;
+
+	std::atomic<size_t> Next{1};
+	std::mutex Lock;
+	std::condition_variable FileDone;
+	Clock::time_point ParseEnd = Clock::now();	// the last file parsed, under Lock
+	std::vector<std::thread> Workers;
+	for(unsigned W = 0; W < NumThreads; ++W){
+		Workers.emplace_back([&](){
+			for(size_t I; (I = Next.fetch_add(1, std::memory_order_relaxed)) < Files.size(); ){
+				Parser P;
+				P.copyOperators(Prelude);
+				ParseFile(I, P);
+				std::lock_guard<std::mutex> Guard(Lock);
+				Parsed[I].Done = true;
+				ParseEnd = std::max(ParseEnd, Clock::now());
+				FileDone.notify_all();
+			}
+		});
+	}
+
+	// codegen in file order, each file as soon as it is parsed
+	bool HadError = false;
+	std::vector<std::string> ExprNames;
+	size_t Bytes = 0;
+	for(ParsedFile &F : Parsed){
+		{
+			std::unique_lock<std::mutex> Guard(Lock);
+			FileDone.wait(Guard, [&F](){ return F.Done; });
+		}
+		Bytes += F.Bytes;
+		if(!F.Ok || !CodegenBatchItems(F.Items))
+			HadError = true;
+		F.Items.clear();
+		ExprNames.insert(ExprNames.end(), F.ExprNames.begin(), F.ExprNames.end());
+	}
+	for(auto &T : Workers)
+		T.join();
+	auto T1 = Clock::now();
+	if(HadError)
+		return -1;
+
+	OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+	{
+		TraceScope Span(TP_JIT);
+		if(TraceEnabled)
+			Span.setDetail(ModuleDetail(*TheModule));
+		TheJIT->addModule(std::move(TheModule));
+	}
+	InitializeModuleAndPassManager();
+
+	auto T2 = Clock::now();
+	RunBatchExprs(ExprNames);
+	auto T3 = Clock::now();
+
+	double MB = Bytes / (1024.0 * 1024.0);
+	fprintf(stderr, "%zu files, %.2f MB, %u parse threads: parse %.3f s (%.1f MB/s), "
+			"parse + codegen %.3f s, compile %.3f s, run %.3f s, total %.3f s\n", Files.size(), MB,
+			NumThreads, Seconds(T0, ParseEnd), MB / Seconds(T0, ParseEnd), Seconds(T0, T1),
+			Seconds(T1, T2), Seconds(T2, T3), Seconds(T0, T3));
+	return Seconds(T0, T3);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
@@ -9,7 +10,9 @@
 #include <utility>
 #include <vector>
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -19,135 +22,311 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "Arena.hpp"
+#include "Symbol.hpp"
+#include "lexer.hpp"
 using namespace llvm;
 
-namespace{
+class InterpFrame; // see Interp.cpp
 
-// ExprAST
+// value types of the language, a name without an annotation is a double
+// an int is 64 bit, int op double promotes the int to double
+// an array is a pointer to its first double, see array(n) in IR.cpp
+enum ValType{
+	Ty_Double,
+	Ty_Int,
+	Ty_Array,
+};
+
+// InterpValue, a value of the interpreter, tagged with the type codegen
+// gives the same expression
+struct InterpValue{
+	ValType Ty;
+	union{
+		double D;
+		int64_t I;
+		double * A;
+	};
+
+	static InterpValue getDouble(double V){ InterpValue R; R.Ty = Ty_Double; R.D = V; return R; }
+	static InterpValue getInt(int64_t V){ InterpValue R; R.Ty = Ty_Int; R.I = V; return R; }
+	static InterpValue getArray(double * V){ InterpValue R; R.Ty = Ty_Array; R.A = V; return R; }
+	// value of a variable without initializer
+	static InterpValue getZero(ValType T){
+		return T == Ty_Int ? getInt(0) : T == Ty_Array ? getArray(nullptr) : getDouble(0.0);
+	}
+
+	// sitofp / fptosi like codegen, None (after an error) between an array
+	// and a number, see Interp.cpp
+	Optional<InterpValue> convertTo(ValType T) const;
+};
+
+
+// what checkPure finds out about the body of a function, see Memo.cpp
+struct PurityInfo{
+	Symbol Self;					// the function checked
+	bool Recursive = false;			// it calls itself
+	SmallVector<Symbol, 4> Callees;	// the other functions it calls
+};
+
+
+// the most arguments the interpreter passes in a call of native code, see
+// CallNativeN in Interp.cpp
+static const unsigned MaxNativeCallArgs = 6;
+
+
+// ExprAST, nodes live in the ASTArena of their top-level item
 class ExprAST{
 public:
 	virtual ~ExprAST() = default ;
 	virtual Value * codegen() = 0;
+	// tree-walking interpreter, see Interp.cpp
+	virtual Optional<InterpValue> eval(InterpFrame &Frame) = 0;
+	// the type codegen gives this expression, without evaluating it
+	virtual ValType evalType(InterpFrame &Frame) = 0;
+	// an int known at parse time, for loops with such a step count in ints
+	virtual bool isIntConstant() const { return false; }
+	// no for loop inside, cheaper to interpret once than to compile, and no
+	// call the interpreter can't make, see HandleTopLevelExpression
+	virtual bool isLoopFree() const { return true; }
+	// no side effect and no memory read, the value only depends on the
+	// variables, so a function with such a body can be memoized
+	virtual bool checkPure(PurityInfo &PI) const = 0;
+	// '=' with this expression on the left, Val is the right-hand side
+	virtual Value * codegenStore(Value * Val);
+	virtual Optional<InterpValue> evalStore(InterpFrame &Frame, InterpValue Val);
 };
 
 
-// NumberExprAST
+// NumberExprAST, an int literal keeps its exact 64 bit value
 class NumberExprAST : public ExprAST{
 	double Val;
+	bool IsInt;
+	int64_t IntVal;
 public:
-	NumberExprAST(double _Val) : Val(_Val) {}
+	NumberExprAST(double _Val, bool _IsInt = false, int64_t _IntVal = 0)
+		: Val(_Val), IsInt(_IsInt), IntVal(_IntVal) {}
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isIntConstant() const override { return IsInt; }
 };
 
 
 // VariableExprAST
 class VariableExprAST : public ExprAST{
-	std::string Name;
+	Symbol Name;
 
 public:
-	VariableExprAST(const std::string &Name) : Name(Name) {}
+	VariableExprAST(Symbol Name) : Name(Name) {}
 
 	Value * codegen() override;
-	const std::string & getName() const { return Name; }
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	Value * codegenStore(Value * Val) override;
+	Optional<InterpValue> evalStore(InterpFrame &Frame, InterpValue Val) override;
+	Symbol getName() const { return Name; }
+};
+
+
+// IndexExprAST, an array element: Array[Index]
+// there is no bounds check
+class IndexExprAST : public ExprAST{
+	ExprAST *Array, *Index;
+
+public:
+	IndexExprAST(ExprAST *_Array, ExprAST *_Index) : Array(_Array), Index(_Index) {}
+
+	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override { return Array->isLoopFree() && Index->isLoopFree(); }
+	Value * codegenStore(Value * Val) override;
+	Optional<InterpValue> evalStore(InterpFrame &Frame, InterpValue Val) override;
 };
 
 
 // BinaryExprAST
 class BinaryExprAST : public ExprAST{
 	char Op;
-	std::unique_ptr<ExprAST> LHS, RHS;
+	ExprAST *LHS, *RHS;
+	Symbol OpFn; // "binary" Op, the function of a user defined operator
 
 public:
-	BinaryExprAST(char _Op, std::unique_ptr<ExprAST> _LHS, std::unique_ptr<ExprAST> _RHS)
-		: Op(_Op), LHS(std::move(_LHS)), RHS(std::move(_RHS)) {}
+	BinaryExprAST(char _Op, ExprAST *_LHS, ExprAST *_RHS, Symbol _OpFn)
+		: Op(_Op), LHS(_LHS), RHS(_RHS), OpFn(_OpFn) {}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isIntConstant() const override{
+		return (Op == '+' || Op == '-' || Op == '*') && LHS->isIntConstant() &&
+			   RHS->isIntConstant();
+	}
+	bool isLoopFree() const override { return LHS->isLoopFree() && RHS->isLoopFree(); }
 };
 
 
+// one 'name : type = init' of a var/in, Init may be null
+struct VarDecl{
+	Symbol Name;
+	ExprAST *Init;
+	ValType Ty;
+};
+
 // VarExprAST, for var/in
 class VarExprAST : public ExprAST{
-	std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-	std::unique_ptr<ExprAST> Body;
+	ArrayRef<VarDecl> VarNames;
+	ExprAST *Body;
 
 public:
-	VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> _VarNames,
-					std::unique_ptr<ExprAST> _Body)
-		: VarNames(std::move(_VarNames)), Body(std::move(_Body)) {}
+	VarExprAST(ArrayRef<VarDecl> _VarNames, ExprAST *_Body)
+		: VarNames(_VarNames), Body(_Body) {}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override{
+		return Body->isLoopFree() && llvm::all_of(VarNames, [](const VarDecl &Var){
+				   return !Var.Init || Var.Init->isLoopFree();
+			   });
+	}
 };
 
 // IfExprAST, for if/then/else.
 class IfExprAST : public ExprAST{
-	std::unique_ptr<ExprAST> Cond, Then, Else;
+	ExprAST *Cond, *Then, *Else;
 
 public:
-	IfExprAST(std::unique_ptr<ExprAST> _Cond, std::unique_ptr<ExprAST> _Then,
-			  std::unique_ptr<ExprAST> _Else)
-		: Cond(std::move(_Cond)), Then(std::move(_Then)), Else(std::move(_Else)){}
+	IfExprAST(ExprAST *_Cond, ExprAST *_Then, ExprAST *_Else)
+		: Cond(_Cond), Then(_Then), Else(_Else){}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override{
+		return Cond->isLoopFree() && Then->isLoopFree() && Else->isLoopFree();
+	}
 };
 
 
 // ForExprAST, for for/in
 class ForExprAST : public ExprAST{
-	std::string VarName;
-	std::unique_ptr<ExprAST> Start, End, Step, Body;
+	Symbol VarName;
+	ExprAST *Start, *End, *Step, *Body;
+
+public:
+	ForExprAST(Symbol _VarName, ExprAST *_Start, ExprAST *_End, ExprAST *_Step,
+			   ExprAST *_Body)
+		: VarName(_VarName), Start(_Start), End(_End), Step(_Step), Body(_Body) {}
+
+	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override { return false; }
+};
+
+
+// PForExprAST, for pfor/in: the iterations run in parallel, see IR.cpp
+// End is evaluated once, as the bound the variable stays below. with a
+// reduction operator ('+' or '*') the value is the sum or product of the
+// body's values, otherwise 0
+class PForExprAST : public ExprAST{
+	Symbol VarName;
+	char Reduction; // 0, '+' or '*'
+	ExprAST *Start, *End, *Step, *Body;
 
 public:
-	ForExprAST(const std::string & _VarName, std::unique_ptr<ExprAST> _Start,
-			   std::unique_ptr<ExprAST> _End, std::unique_ptr<ExprAST> _Step,
-			   std::unique_ptr<ExprAST> _Body)
-		: VarName(_VarName), Start(std::move(_Start)), End(std::move(_End)),
-		  Step(std::move(_Step)), Body(std::move(_Body)) {}
+	PForExprAST(Symbol _VarName, char _Reduction, ExprAST *_Start, ExprAST *_End,
+				ExprAST *_Step, ExprAST *_Body)
+		: VarName(_VarName), Reduction(_Reduction), Start(_Start), End(_End), Step(_Step),
+		  Body(_Body) {}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override { return false; }
 };
 
 
 // UnaryExprAST, for a unary operator
 class UnaryExprAST : public ExprAST{
 	char Opcode;
-	std::unique_ptr<ExprAST> Operand;
+	ExprAST *Operand;
+	Symbol OpFn; // "unary" Opcode
 
 public:
-	UnaryExprAST(char _Opcode, std::unique_ptr<ExprAST> _Operand)
-		: Opcode(_Opcode), Operand(std::move(_Operand)) {}
+	UnaryExprAST(char _Opcode, ExprAST *_Operand, Symbol _OpFn)
+		: Opcode(_Opcode), Operand(_Operand), OpFn(_OpFn) {}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	bool isLoopFree() const override { return Operand->isLoopFree(); }
 };
 
 // CallExprAST
 class CallExprAST : public ExprAST{
-	std::string Callee;
-	std::vector<std::unique_ptr<ExprAST>> Args;
+	Symbol Callee;
+	ArrayRef<ExprAST *> Args;
 
 public:
-	CallExprAST(const std::string &_Callee, std::vector<std::unique_ptr<ExprAST>> _Args)
-		: Callee(_Callee), Args(std::move(_Args)) {}
+	CallExprAST(Symbol _Callee, ArrayRef<ExprAST *> _Args)
+		: Callee(_Callee), Args(_Args) {}
 
 	Value * codegen() override;
+	Optional<InterpValue> eval(InterpFrame &Frame) override;
+	ValType evalType(InterpFrame &Frame) override;
+	bool checkPure(PurityInfo &PI) const override;
+	// the callee is compiled code, the call costs the same either way. one with
+	// more arguments than the interpreter passes is left to the JIT
+	bool isLoopFree() const override{
+		return Args.size() <= MaxNativeCallArgs &&
+			   llvm::all_of(Args, [](ExprAST * Arg){ return Arg->isLoopFree(); });
+	}
 };
 
 
 // PrototypeAST, represent the "protype" for a  function
-// since all type is double, we don't need to save it
-// which captures its argument names as well as if it is an operator
+// which captures its argument names and types as well as if it is an operator
 class PrototypeAST{
 	std::string Name;
+	Symbol Sym; // interned Name
 	std::vector<std::string> Args;
+	std::vector<Symbol> ArgSyms;
 	bool IsOperator;
 	unsigned Precedence; // Precedence if a binary op
+	std::vector<ValType> ArgTypes;
+	ValType RetType;
 
 public:
+	// no ArgTypes means all arguments are doubles
 	PrototypeAST(const std::string &_Name, std::vector<std::string> _Args,
-				 bool _IsOperator = false, unsigned _Prec = 0)
-		: Name(_Name), Args(std::move(_Args)), IsOperator(_IsOperator),
-		  Precedence(_Prec) {}
+				 bool _IsOperator = false, unsigned _Prec = 0,
+				 std::vector<ValType> _ArgTypes = {}, ValType _RetType = Ty_Double)
+		: Name(_Name), Sym(Symbols.intern(_Name)), Args(std::move(_Args)), IsOperator(_IsOperator),
+		  Precedence(_Prec), ArgTypes(std::move(_ArgTypes)), RetType(_RetType) {
+		ArgTypes.resize(Args.size(), Ty_Double);
+		for(auto &Arg : Args)
+			ArgSyms.push_back(Symbols.intern(Arg));
+	}
 	
 	const std::string &getName() const { return Name; }
+	Symbol getSym() const { return Sym; }
+	const std::vector<std::string> &getArgs() const { return Args; }
+	const std::vector<Symbol> &getArgSyms() const { return ArgSyms; }
+	const std::vector<ValType> &getArgTypes() const { return ArgTypes; }
+	ValType getRetType() const { return RetType; }
 
 	Function * codegen();
 
@@ -162,114 +341,183 @@ public:
 	unsigned getBinaryPrecedence() const { return Precedence; }
 };
 
-// FunctionAST
+// FunctionAST, owns the arena holding its body
 class FunctionAST{
 	std::unique_ptr<PrototypeAST> Proto;
-	std::unique_ptr<ExprAST> Body;
+	ExprAST *Body;
+	std::unique_ptr<ASTArena> Arena;
 
 public:
-	FunctionAST(std::unique_ptr<PrototypeAST> _Proto, std::unique_ptr<ExprAST> _Body)
-		: Proto(std::move(_Proto)), Body(std::move(_Body)) {}
-		
-	Function * codegen();
-};
+	FunctionAST(std::unique_ptr<PrototypeAST> _Proto, ExprAST *_Body,
+				std::unique_ptr<ASTArena> _Arena)
+		: Proto(std::move(_Proto)), Body(_Body), Arena(std::move(_Arena)) {}
 
-}// end anonymous namespace
+	const ASTArena &getArena() const { return *Arena; }
+	const PrototypeAST &getProto() const { return *Proto; }
+	ExprAST * getBody() const { return Body; }
 
+	Function * codegen();
+};
 
-static int getNextToken();
 
 // LogError*
-std::unique_ptr<ExprAST> LogError(const char *);
+ExprAST * LogError(const char *);
 std::unique_ptr<PrototypeAST> LogErrorP(const char *);
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr();
-
-// parenexpr := '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr();
-
-// identifierexpr
-// 	::= identifier
-// 	::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr();
-
-// primary
-// 	::= identifierexpr
-// 	::= numberexpr
-// 	::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary();
-
-// Operator-Precedence Parsing
-// BinopPrecedence, holds the precedence for each binary operator that is defined
-static std::map<char, int> BinopPrecedence; 
-
-// GetTokPrecedence
-static int GetTokPrecedence();
-
-// expression
-// 	::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression();
-
-// binoprhs
-// 	::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int , std::unique_ptr<ExprAST> );
-
-// prototype
-// 	::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype();
-
-// unary
-//    ::= primary
-//    ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary();
-
-// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition();
-
-// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern();
+// Parser, the recursive descent parser of one source: it owns the lexer, the
+// current token, the arena the nodes of the current item go to and the binary
+// operators the source defined. parsers of different sources share nothing but
+// the symbol table, so they can run on different threads
+class Parser{
+	std::unique_ptr<Lexer> Lex;
+	int CurTok = 0;	// the current token, it is key->number or char
+	ASTArena * CurArena = nullptr;
+
+	// Operator-Precedence Parsing
+	// BinopPrecedence, holds the precedence for each binary operator that is defined,
+	// indexed by the operator char, 0 means it is not a binary operator
+	int BinopPrecedence[128];
+
+	// create an AST node in the arena of the current top-level item
+	template <typename T, typename... ArgsT>
+	T * NewNode(ArgsT &&... Args){
+		return CurArena->create<T>(std::forward<ArgsT>(Args)...);
+	}
 
-// ifexpr := 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr();
+	// symbol of the function behind operator Op, "binary" Op or "unary" Op
+	Symbol getOperatorSym(StringRef Prefix, char Op);
 
-// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr();
+	// numberexpr ::= number
+	ExprAST * ParseNumberExpr();
 
-// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+	// parenexpr := '(' expression ')'
+	ExprAST * ParseParenExpr();
 
-// Top-Level Parsing
-static void HandleDefinition();
-static void HandleExtern();
-static void HandleTopLevelExpression();
+	// identifierexpr
+	// 	::= identifier
+	// 	::= identifier '(' expression* ')'
+	// 	::= identifier '[' expression ']'
+	ExprAST * ParseIdentifierExpr();
 
-// top := definition | extern1 | expression | ';'
-static void MainLoop();
+	// primary
+	// 	::= identifierexpr
+	// 	::= numberexpr
+	// 	::= parenexpr
+	ExprAST * ParsePrimary();
 
+	// GetTokPrecedence
+	int GetTokPrecedence();
 
+	// expression
+	// 	::= primary binoprhs
+	ExprAST * ParseExpression();
 
+	// binoprhs
+	// 	::= ('+' primary)*
+	ExprAST * ParseBinOpRHS(int , ExprAST * );
 
+	// type ::= 'int' | 'double' | 'array', after a ':'
+	bool ParseType(ValType &Ty);
 
+	// prototype
+	// 	::= id '(' (id (':' type)?)* ')' (':' type)?
+	std::unique_ptr<PrototypeAST> ParsePrototype();
 
+	// unary
+	//    ::= primary
+	//    ::= '!' unary
+	ExprAST * ParseUnary();
 
+	// ifexpr := 'if' expression 'then' expression 'else' expression
+	ExprAST * ParseIfExpr();
 
+	// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+	ExprAST * ParseForExpr();
 
+	// pforexpr ::= 'pfor' ('+' | '*')? identifier '=' expr ',' expr (',' expr)? 'in' expression
+	ExprAST * ParsePForExpr();
 
+	// varexpr ::= 'var' identifier (':' type)? ('=' expression)?
+	// 					 (',' identifier (':' type)? ('=' expression)?)* 'in' expression
+	ExprAST * ParseVarExpr();
 
+public:
+	// the built-in binary operators only, L may be set later
+	explicit Parser(std::unique_ptr<Lexer> L = nullptr);
+
+	// parse another source, the operators defined so far stay
+	void setLexer(std::unique_ptr<Lexer> L) { Lex = std::move(L); }
+	// start from the operators another parser knows
+	void copyOperators(const Parser &From){
+		std::copy(std::begin(From.BinopPrecedence), std::end(From.BinopPrecedence), BinopPrecedence);
+	}
+	// install the binary operators L defines without parsing it, from the
+	// tokens of 'def binary' prototypes. a parser of one piece of a source
+	// then knows the operators of the others, before they are parsed
+	void scanOperators(Lexer &L);
+	Lexer & getLexer() { return *Lex; }
 
+	int getCurTok() const { return CurTok; }
+	int getNextToken();
 
+	// definition ::= 'def' prototype expression
+	std::unique_ptr<FunctionAST> ParseDefinition();
 
+	// external ::= 'extern' prototype
+	std::unique_ptr<PrototypeAST> ParseExtern();
 
+	// toplevelexpr ::= expression
+	std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+};
 
+// the parser of the REPL (and of batch mode, the server, -aot)
+extern std::unique_ptr<Parser> TheParser;
 
+// Top-Level Parsing
+void HandleDefinition();
+void HandleExtern();
+void HandleTopLevelExpression();
 
+// top := definition | extern1 | expression | ';'
+void MainLoop();
 
+// print "ready>" before each line, the compile server doesn't
+extern bool ReplPrompt;
 
+// -repl-stats summary, one line per kind of item
+void PrintReplStats();
 
+// print the -time-passes report of the calling thread
+void PrintPassTimings();
 
+// Top-Level Parsing and JIT Driver options
+extern llvm::cl::opt<bool> FastMath;
+extern llvm::cl::opt<bool> HostCPU;
+extern llvm::cl::opt<char> OptLevel;
 
+// batch mode: parse the whole input first, emit every function into one module,
+// optimize that module once and hand it to the JIT in one step,
+// then run the top-level expressions in source order
+struct BatchItem{
+	std::unique_ptr<FunctionAST> Fn;		// definition or top-level expression
+	std::unique_ptr<PrototypeAST> Extern;
+	std::string ExprName;					// set for top-level expressions
+};
 
+// parse the rest of the input, top-level expressions are named ExprPrefix + N
+// in source order and listed in ExprNames. returns false if an item had an
+// error, the others are kept
+bool ParseBatchItems(Parser &P, std::vector<BatchItem> &Items,
+					 std::vector<std::string> &ExprNames, const std::string &ExprPrefix);
 
+// codegen every item into TheModule, returns false if one had an error
+bool CodegenBatchItems(std::vector<BatchItem> &Items);
 
+// batch -j N: codegen, optimize and compile the items on N worker threads and
+// add their object files to the JIT. returns false on error
+bool BatchCompileParallel(std::vector<BatchItem> &Items, unsigned NumThreads);
 
+// batch mode over TheParser, and several input files parsed in parallel
+// both return the end-to-end time in seconds, or a negative value on error
+double BatchMain(unsigned NumThreads);
+double MultiFileMain(const std::vector<std::string> &Files, unsigned NumThreads);
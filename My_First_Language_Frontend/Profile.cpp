@@ -0,0 +1,381 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IR.hpp"
+#include "Inline.hpp"
+#include "Paser.hpp"
+#include "Profile.hpp"
+#include "Trace.hpp"
+
+// profile guided optimization
+// -pgo-instrument compiles REPL definitions with a counter on the function entry
+// and on both edges of every if / for branch. once a function was entered
+// -pgo-hot times it is compiled again from its AST, without counters and with the
+// counts as !prof branch weights and function entry count, and swapped in like a
+// redefinition. the counts are what the inliner and block placement go by.
+// -profile-out saves the profile at exit, -profile-use feeds it to every later
+// compile (REPL, batch, -aot)
+//
+// the profile file is text:
+// 	toy-profile 1
+// 	<name> <entries> <branch sites> <taken> <not taken> ...
+
+thread_local ProfileCodegen * CurProfileCG;
+
+cl::opt<bool>
+PGOInstrument("pgo-instrument",
+			  cl::desc("Compile REPL definitions with entry and branch counters, recompile hot ones with their profile"),
+			  cl::init(false));
+
+static cl::opt<unsigned>
+PGOHot("pgo-hot",
+	   cl::desc("Calls after which an instrumented function is recompiled with its profile"),
+	   cl::init(1000));
+
+static cl::opt<std::string>
+ProfileUse("profile-use",
+		   cl::desc("Compile with the profile in <file>, written by -profile-out"),
+		   cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string>
+ProfileOut("profile-out",
+		   cl::desc("Write the profile to <file> at exit, '-' for stdout"),
+		   cl::value_desc("file"), cl::init(""));
+
+static const char ProfileMagic[] = "toy-profile 1";
+
+// counters of instrumented code, JIT-ed code increments them through their
+// address, so they live in a deque that never moves them
+static std::deque<BranchCounts> CounterSlab;
+
+// a REPL definition compiled with counters
+struct InstrumentedFunction{
+	std::unique_ptr<FunctionAST> AST;		// compiled again once it is hot
+	std::vector<BranchCounts *> Counters;	// entry counter first, then the branch sites
+	bool Recompiled = false;
+};
+
+static DenseMap<Symbol, InstrumentedFunction> InstrumentedFunctions;
+static DenseMap<Symbol, FunctionProfile> LoadedProfiles;	// -profile-use
+static unsigned NumProfileRecompiles;
+
+
+const FunctionProfile * LookupProfile(Symbol Sym){
+	auto It = LoadedProfiles.find(Sym);
+	return It == LoadedProfiles.end() ? nullptr : &It->second;
+}
+
+bool HaveProfileUse(){
+	return !ProfileUse.empty();
+}
+
+// the counts so far of an instrumented function
+static FunctionProfile LiveProfile(const InstrumentedFunction & IF){
+	FunctionProfile P;
+	P.Entries = IF.Counters[0]->Taken;
+	for(size_t I = 1; I < IF.Counters.size(); ++I)
+		P.Branches.push_back(*IF.Counters[I]);
+	return P;
+}
+
+// the live counts of Sym plus the -profile-use ones, as long as both
+// come from the same code
+static FunctionProfile MergedProfile(Symbol Sym){
+	auto Loaded = LoadedProfiles.find(Sym);
+	auto Live = InstrumentedFunctions.find(Sym);
+	if(Live == InstrumentedFunctions.end())
+		return Loaded->second;
+
+	FunctionProfile P = LiveProfile(Live->second);
+	if(Loaded != LoadedProfiles.end() && Loaded->second.Branches.size() == P.Branches.size()){
+		P.Entries += Loaded->second.Entries;
+		for(size_t I = 0; I != P.Branches.size(); ++I){
+			P.Branches[I].Taken += Loaded->second.Branches[I].Taken;
+			P.Branches[I].NotTaken += Loaded->second.Branches[I].NotTaken;
+		}
+	}
+	return P;
+}
+
+// every function with a profile, by name
+static std::map<std::string, FunctionProfile> CollectProfiles(){
+	std::map<std::string, FunctionProfile> All;
+	for(auto & KV : LoadedProfiles)
+		All[Symbols.getName(KV.first).str()] = MergedProfile(KV.first);
+	for(auto & KV : InstrumentedFunctions)
+		All[Symbols.getName(KV.first).str()] = MergedProfile(KV.first);
+	return All;
+}
+
+
+// counter instrumentation and annotation, called by codegen
+
+static BranchCounts * NewCounter(){
+	CounterSlab.emplace_back();
+	return &CounterSlab.back();
+}
+
+// the address of a counter, as a constant in the JIT-ed code
+static Value * CounterAddress(IRBuilder<> & B, uint64_t * Counter){
+	return ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)Counter), B.getInt64Ty()->getPointerTo());
+}
+
+// an atomic add: pfor bodies run on the pool threads and -async-eval
+// expressions on the workers, a function may count on several at once.
+// monotonic, the counts only have to add up, they order nothing
+static void EmitIncrement(IRBuilder<> & B, Value * Ptr){
+	B.CreateAtomicRMW(AtomicRMWInst::Add, Ptr, B.getInt64(1), AtomicOrdering::Monotonic);
+}
+
+// branch weights within the 32 bits !prof has
+static MDNode * BranchWeights(LLVMContext & Ctx, const BranchCounts & BC){
+	uint64_t Scale = std::max(BC.Taken, BC.NotTaken) / UINT32_MAX + 1;
+	return MDBuilder(Ctx).createBranchWeights(BC.Taken / Scale, BC.NotTaken / Scale);
+}
+
+void ProfileFunctionEntry(Function * F){
+	ProfileCodegen * PCG = CurProfileCG;
+	if(!PCG || !PCG->Counters)
+		return;
+	BranchCounts * C = NewCounter();
+	PCG->Counters->push_back(C);
+	EmitIncrement(*Builder, CounterAddress(*Builder, &C->Taken));
+}
+
+void ProfileBranch(BranchInst * Br){
+	ProfileCodegen * PCG = CurProfileCG;
+	if(!PCG)
+		return;
+	unsigned Site = PCG->NextBranch++;
+
+	if(PCG->Counters){
+		// counts[!cond]++, Taken and NotTaken are next to each other
+		BranchCounts * C = NewCounter();
+		PCG->Counters->push_back(C);
+		IRBuilder<> B(Br);
+		Value * Index = B.CreateZExt(B.CreateNot(Br->getCondition()), B.getInt64Ty());
+		EmitIncrement(B, B.CreateInBoundsGEP(B.getInt64Ty(), CounterAddress(B, &C->Taken), Index));
+	}
+
+	if(PCG->Weights && Site < PCG->Weights->Branches.size()){
+		const BranchCounts & BC = PCG->Weights->Branches[Site];
+		if(BC.Taken || BC.NotTaken){
+			Br->setMetadata(LLVMContext::MD_prof, BranchWeights(Br->getContext(), BC));
+			PCG->Annotated.push_back(Br);
+		}
+	}
+}
+
+void FinishProfile(Function * F){
+	ProfileCodegen * PCG = CurProfileCG;
+	if(!PCG || !PCG->Weights)
+		return;
+
+	// another number of branch sites, the profile is from an older definition
+	if(PCG->NextBranch != PCG->Weights->Branches.size()){
+		for(BranchInst * Br : PCG->Annotated)
+			Br->setMetadata(LLVMContext::MD_prof, nullptr);
+		fprintf(stderr, "Warning: profile of %s doesn't match its definition, ignored\n",
+				F->getName().str().c_str());
+		return;
+	}
+	F->setEntryCount(Function::ProfileCount(PCG->Weights->Entries, Function::PCT_Real));
+}
+
+
+// the detailed summary cutoffs llvm-profdata uses, in parts per million
+static const uint32_t SummaryCutoffs[] = {10000, 100000, 200000, 300000, 400000, 500000,
+										  600000, 700000, 800000, 900000, 950000, 990000,
+										  999000, 999900, 999990, 999999};
+
+void AttachProfileSummary(Module & M){
+	if(M.getProfileSummary(false))
+		return;
+	bool HasCounts = false;
+	for(Function & F : M)
+		HasCounts |= F.hasProfileData();
+	if(!HasCounts)
+		return;
+
+	// every count of the profile, like llvm-profdata does for a whole program
+	std::vector<uint64_t> Counts;
+	uint64_t Total = 0, MaxInternal = 0, MaxFunction = 0;
+	unsigned NumFunctions = 0;
+	for(auto & KV : CollectProfiles()){
+		const FunctionProfile & P = KV.second;
+		++NumFunctions;
+		Counts.push_back(P.Entries);
+		MaxFunction = std::max(MaxFunction, P.Entries);
+		for(const BranchCounts & BC : P.Branches){
+			Counts.push_back(BC.Taken);
+			Counts.push_back(BC.NotTaken);
+			MaxInternal = std::max({MaxInternal, BC.Taken, BC.NotTaken});
+		}
+	}
+	for(uint64_t C : Counts)
+		Total += C;
+	std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+
+	// for each cutoff, the smallest count among the hottest counts that add up to it
+	SummaryEntryVector Detailed;
+	uint64_t Sum = 0;
+	size_t I = 0;
+	for(uint32_t Cutoff : SummaryCutoffs){
+		double Needed = (double)Total * Cutoff / ProfileSummary::Scale;
+		while(I < Counts.size() && Sum < Needed)
+			Sum += Counts[I++];
+		Detailed.push_back({Cutoff, I ? Counts[I - 1] : 0, (uint64_t)I});
+	}
+
+	ProfileSummary PS(ProfileSummary::PSK_Instr, Detailed, Total, Counts.empty() ? 0 : Counts[0],
+					  MaxInternal, MaxFunction, Counts.size(), NumFunctions);
+	M.setProfileSummary(PS.getMD(M.getContext()), ProfileSummary::PSK_Instr);
+}
+
+
+// REPL side
+
+// codegen of a REPL definition under -pgo-instrument
+Function * CodegenInstrumented(FunctionAST & FnAST, std::vector<BranchCounts *> & Counters){
+	ProfileCodegen PCG;
+	PCG.Counters = &Counters;
+	PCG.Weights = LookupProfile(FnAST.getProto().getSym());
+	ProfileCodegenScope Scope(PCG);
+	return FnAST.codegen();
+}
+
+// the definition and counters of a function compiled by CodegenInstrumented,
+// a redefinition drops the counts of the old one
+void KeepInstrumented(Symbol Sym, std::unique_ptr<FunctionAST> FnAST,
+					  std::vector<BranchCounts *> Counters){
+	InstrumentedFunction & IF = InstrumentedFunctions[Sym];
+	IF.AST = std::move(FnAST);
+	IF.Counters = std::move(Counters);
+	IF.Recompiled = false;
+}
+
+// compile every instrumented function that got hot again, with its profile
+// and no counters, and swap it in
+void RecompileHotFunctions(){
+	if(!PGOInstrument)
+		return;
+	for(auto & KV : InstrumentedFunctions){
+		InstrumentedFunction & IF = KV.second;
+		if(IF.Recompiled || IF.Counters[0]->Taken < PGOHot)
+			continue;
+		IF.Recompiled = true;
+
+		FunctionProfile Profile = MergedProfile(KV.first);
+		ProfileCodegen PCG;
+		PCG.Weights = &Profile;
+		Function * F;
+		{
+			ProfileCodegenScope Scope(PCG);
+			F = IF.AST->codegen();
+		}
+		if(!F){
+			InitializeModuleAndPassManager();
+			continue;
+		}
+
+		std::string BodyName = RenameToBody(F, KV.first);
+		PrepareDefinition(F, KV.first, false);
+		OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+		PublishDefinition(F, KV.first);
+		{
+			TraceScope Span(TP_JIT, Symbols.getName(KV.first));
+			TheJIT->addModule(std::move(TheModule));
+		}
+		InitializeModuleAndPassManager();
+		SwapInBody(KV.first, BodyName);
+		++NumProfileRecompiles;
+		fprintf(stderr, "Recompiled %s with its profile after %llu calls\n",
+				Symbols.getName(KV.first).str().c_str(), (unsigned long long)Profile.Entries);
+	}
+}
+
+
+// profile files
+
+bool LoadProfile(){
+	if(ProfileUse.empty())
+		return true;
+	auto Buf = MemoryBuffer::getFile(ProfileUse);
+	if(!Buf){
+		fprintf(stderr, "Error: can't read profile %s: %s\n", ProfileUse.c_str(),
+				Buf.getError().message().c_str());
+		return false;
+	}
+
+	SmallVector<StringRef, 0> Lines;
+	(*Buf)->getBuffer().split(Lines, '\n', -1, false);
+	if(Lines.empty() || Lines[0].trim() != ProfileMagic){
+		fprintf(stderr, "Error: %s is not a toy profile\n", ProfileUse.c_str());
+		return false;
+	}
+
+	for(size_t L = 1; L < Lines.size(); ++L){
+		SmallVector<StringRef, 16> Fields;
+		Lines[L].trim().split(Fields, ' ', -1, false);
+		if(Fields.empty())
+			continue;
+
+		FunctionProfile P;
+		size_t NumBranches = 0;
+		bool Bad = Fields.size() < 3 || Fields[1].getAsInteger(10, P.Entries) ||
+				   Fields[2].getAsInteger(10, NumBranches) || Fields.size() != 3 + 2 * NumBranches;
+		for(size_t I = 0; !Bad && I != NumBranches; ++I){
+			BranchCounts BC;
+			Bad = Fields[3 + 2 * I].getAsInteger(10, BC.Taken) ||
+				  Fields[4 + 2 * I].getAsInteger(10, BC.NotTaken);
+			P.Branches.push_back(BC);
+		}
+		if(Bad){
+			fprintf(stderr, "Error: %s:%zu: malformed profile line\n", ProfileUse.c_str(), L + 1);
+			return false;
+		}
+		LoadedProfiles[Symbols.intern(Fields[0])] = std::move(P);
+	}
+	return true;
+}
+
+// the -profile-out exit hook
+void WriteProfile(){
+	if(ProfileOut.empty())
+		return;
+	std::error_code EC;
+	raw_fd_ostream OS(ProfileOut, EC);
+	if(EC){
+		fprintf(stderr, "Error: can't write profile %s: %s\n", ProfileOut.c_str(), EC.message().c_str());
+		return;
+	}
+	OS << ProfileMagic << "\n";
+	for(auto & KV : CollectProfiles()){
+		OS << KV.first << ' ' << KV.second.Entries << ' ' << KV.second.Branches.size();
+		for(const BranchCounts & BC : KV.second.Branches)
+			OS << ' ' << BC.Taken << ' ' << BC.NotTaken;
+		OS << '\n';
+	}
+}
+
+void PrintProfileStats(){
+	if(PGOInstrument)
+		fprintf(stderr, "pgo: %u instrumented functions, %u recompiled with their profile\n",
+				InstrumentedFunctions.size(), NumProfileRecompiles);
+}
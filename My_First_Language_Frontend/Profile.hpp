@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "Paser.hpp"
+#include "Symbol.hpp"
+
+// profile guided optimization, see Profile.cpp
+// a branch site is a conditional branch of an if or a for, numbered in the
+// order codegen emits them, so the same definition numbers them the same way
+// every time it is compiled
+
+// how often a branch site went each way
+// the entry counter of a function uses Taken only
+struct BranchCounts{
+	uint64_t Taken = 0;
+	uint64_t NotTaken = 0;
+};
+
+// the profile of one function
+struct FunctionProfile{
+	uint64_t Entries = 0;
+	std::vector<BranchCounts> Branches;	// by branch site
+};
+
+// what codegen of the current function does about profiles
+struct ProfileCodegen{
+	std::vector<BranchCounts *> * Counters = nullptr;	// instrument, entry counter first, then the sites
+	const FunctionProfile * Weights = nullptr;			// annotate with this profile
+	unsigned NextBranch = 0;
+	std::vector<llvm::BranchInst *> Annotated;			// dropped again if the site count is off
+};
+
+extern thread_local ProfileCodegen * CurProfileCG;
+
+// makes PCG the profile state of the function compiled on this thread
+class ProfileCodegenScope{
+	ProfileCodegen * Saved;
+public:
+	ProfileCodegenScope(ProfileCodegen & PCG) : Saved(CurProfileCG) { CurProfileCG = &PCG; }
+	~ProfileCodegenScope() { CurProfileCG = Saved; }
+};
+
+// codegen hooks, they do nothing without a profile or counters
+void ProfileFunctionEntry(llvm::Function * F);
+void ProfileBranch(llvm::BranchInst * Br);
+void FinishProfile(llvm::Function * F);
+
+// the -profile-use profile of a function, or nullptr
+const FunctionProfile * LookupProfile(Symbol Sym);
+
+// true when -profile-use names a profile to compile with
+bool HaveProfileUse();
+
+// give M a profile summary when its functions have entry counts,
+// the inliner and block placement only trust the counts with one
+void AttachProfileSummary(llvm::Module & M);
+
+// REPL side, with -pgo-instrument
+extern llvm::cl::opt<bool> PGOInstrument;
+
+// codegen of a REPL definition with counters, the entry counter first
+llvm::Function * CodegenInstrumented(FunctionAST & FnAST, std::vector<BranchCounts *> & Counters);
+
+// the definition and counters of a function compiled by CodegenInstrumented,
+// a redefinition drops the counts of the old one
+void KeepInstrumented(Symbol Sym, std::unique_ptr<FunctionAST> FnAST,
+					  std::vector<BranchCounts *> Counters);
+
+// between REPL lines: compile every instrumented function that got hot again,
+// with its profile and no counters, and swap it in
+void RecompileHotFunctions();
+
+// read the -profile-use file, false when it can't be read or is malformed
+bool LoadProfile();
+
+// at exit: the -profile-out file, and the -repl-stats line
+void WriteProfile();
+void PrintProfileStats();
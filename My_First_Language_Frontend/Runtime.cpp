@@ -0,0 +1,330 @@
+// runtime of the JIT-ed code: the functions Kaleidoscope programs call as
+// externs. it is the static library toyrt, linked into every executable that
+// runs Kaleidoscope code (toy, toy-bench) and into the executables compiled
+// ahead of time (toy -aot)
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Runtime.hpp"
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+/// arrayalloc - runtime of array(n): n doubles set to 0, the first one 64 byte
+/// aligned, with the length as an int64_t in the 8 bytes before it. arrays are
+/// never freed.
+extern "C" DLLEXPORT double *arrayalloc(int64_t N) {
+  if (N < 0)
+    N = 0;
+  size_t Bytes = 64 + ((size_t)N * sizeof(double) + 63) / 64 * 64;
+  char *Mem = (char *)aligned_alloc(64, Bytes);
+  if (!Mem) {
+    fprintf(stderr, "Error: out of memory in array(%lld)\n", (long long)N);
+    exit(1);
+  }
+  memset(Mem, 0, Bytes);
+  double *Data = (double *)(Mem + 64);
+  ((int64_t *)Data)[-1] = N;
+  return Data;
+}
+
+/// printresult - what the REPL prints for a top-level expression, the main of
+/// an -aot executable calls it for each one.
+extern "C" DLLEXPORT void printresult(double X) {
+  fprintf(stderr, "Evaluated to %f\n", X);
+}
+
+/// pforrun - runtime of pfor: Body(Begin, End, Env) runs the iterations
+/// [Begin, End) of the N and returns their reduction by Op ('+', '*', or 0 for
+/// none, then the result is 0).
+///
+/// The iterations are cut into chunks, every worker thread (the caller is
+/// worker 0) starts with an even share of them, takes its own chunks from the
+/// front and, once out of work, steals the back half of another worker's. A
+/// worker reduces the chunks it ran, the caller combines the workers' results.
+/// In deterministic mode the chunks only depend on N, and their results are
+/// combined in order: the same value for any number of threads and any
+/// schedule. A pfor run by a pfor body runs on its thread, in order. Threads
+/// that start a pfor at the same time (toy -async-eval) take turns.
+///
+/// pforconfig sets the threads (0: one per CPU), the iterations per chunk (0:
+/// about 8 chunks per thread, 256 chunks when deterministic) and the mode, an
+/// executable compiled with -aot takes them from TOY_PFOR_THREADS,
+/// TOY_PFOR_CHUNK and TOY_PFOR_DETERMINISTIC.
+typedef double (*PForBody)(int64_t, int64_t, void *);
+
+struct PForJob {
+  PForBody Body;
+  void *Env;
+  int64_t N, Grain, Op;
+  double *ChunkResults; // deterministic mode, by chunk
+};
+
+struct PForWorker {
+  pthread_mutex_t Lock; // guards Next and End
+  int64_t Next, End;    // the chunks it still owns
+  double Partial;       // the reduction of the chunks it ran
+};
+
+static struct {
+  pthread_mutex_t RunLock = PTHREAD_MUTEX_INITIALIZER; // held by the running pfor
+  pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER; // guards the job hand-off
+  pthread_cond_t Wake = PTHREAD_COND_INITIALIZER, Done = PTHREAD_COND_INITIALIZER;
+  PForWorker *Workers = nullptr;
+  unsigned NumWorkers = 0;
+  pid_t Owner = 0; // the workers are threads of this process, not of a fork
+  uint64_t Generation = 0, StartGeneration = 0;
+  PForJob *Job = nullptr;
+  unsigned Busy = 0; // workers still in the job
+  int64_t Threads = -1, Chunk = -1, Deterministic = -1;
+} PFor;
+
+static thread_local bool InPFor;
+
+/// pforactive - 1 while this thread runs the iterations of a pfor: the runtime
+/// is on its stack, see toycancelpoint in Async.cpp.
+extern "C" DLLEXPORT int64_t pforactive() { return InPFor; }
+
+static int64_t envOr(const char *Name, int64_t Default) {
+  const char *V = getenv(Name);
+  return V && *V ? atoll(V) : Default;
+}
+
+extern "C" DLLEXPORT void pforconfig(int64_t Threads, int64_t Chunk, int64_t Deterministic) {
+  PFor.Threads = Threads < 0 ? 0 : Threads;
+  PFor.Chunk = Chunk < 0 ? 0 : Chunk;
+  PFor.Deterministic = Deterministic != 0;
+}
+
+static double combine(int64_t Op, double A, double B) { return Op == '*' ? A * B : A + B; }
+
+// the next chunk of worker Id: its own, else the back half of another's
+static bool takeChunk(unsigned Id, int64_t &C) {
+  PForWorker &Self = PFor.Workers[Id];
+  pthread_mutex_lock(&Self.Lock);
+  bool Own = Self.Next < Self.End;
+  if (Own)
+    C = Self.Next++;
+  pthread_mutex_unlock(&Self.Lock);
+  if (Own)
+    return true;
+
+  for (unsigned I = 1; I < PFor.NumWorkers; ++I) {
+    PForWorker &Victim = PFor.Workers[(Id + I) % PFor.NumWorkers];
+    pthread_mutex_lock(&Victim.Lock);
+    int64_t Left = Victim.End - Victim.Next;
+    int64_t From = Victim.End - (Left + 1) / 2, To = Victim.End;
+    if (Left > 0)
+      Victim.End = From;
+    pthread_mutex_unlock(&Victim.Lock);
+    if (Left <= 0)
+      continue;
+    pthread_mutex_lock(&Self.Lock);
+    C = From;
+    Self.Next = From + 1;
+    Self.End = To;
+    pthread_mutex_unlock(&Self.Lock);
+    return true;
+  }
+  return false;
+}
+
+static void runChunks(PForJob *J, unsigned Id) {
+  double Acc = J->Op == '*' ? 1 : 0;
+  int64_t C;
+  while (takeChunk(Id, C)) {
+    int64_t Begin = C * J->Grain, End = Begin + J->Grain < J->N ? Begin + J->Grain : J->N;
+    double R = J->Body(Begin, End, J->Env);
+    if (J->ChunkResults)
+      J->ChunkResults[C] = R;
+    else
+      Acc = combine(J->Op, Acc, R);
+  }
+  PFor.Workers[Id].Partial = Acc;
+}
+
+static void *pforWorker(void *Arg) {
+  unsigned Id = (unsigned)(uintptr_t)Arg;
+  InPFor = true;
+  uint64_t Seen = PFor.StartGeneration;
+  pthread_mutex_lock(&PFor.Lock);
+  while (1) {
+    while (PFor.Generation == Seen)
+      pthread_cond_wait(&PFor.Wake, &PFor.Lock);
+    Seen = PFor.Generation;
+    PForJob *J = PFor.Job;
+    pthread_mutex_unlock(&PFor.Lock);
+    runChunks(J, Id);
+    pthread_mutex_lock(&PFor.Lock);
+    if (--PFor.Busy == 0)
+      pthread_cond_signal(&PFor.Done);
+  }
+  return nullptr;
+}
+
+// the settings pforconfig left unset come from the environment
+static void readConfig() {
+  if (PFor.Threads < 0)
+    PFor.Threads = envOr("TOY_PFOR_THREADS", 0);
+  if (PFor.Chunk < 0)
+    PFor.Chunk = envOr("TOY_PFOR_CHUNK", 0);
+  if (PFor.Deterministic < 0)
+    PFor.Deterministic = envOr("TOY_PFOR_DETERMINISTIC", 0) != 0;
+}
+
+// the iterations per chunk of a pfor of N iterations run by W workers
+static int64_t grainOf(int64_t N, unsigned W) {
+  int64_t Chunks = PFor.Deterministic ? 256 : 8 * (int64_t)W;
+  return PFor.Chunk ? PFor.Chunk : (N + Chunks - 1) / Chunks;
+}
+
+// the workers of this process, started by its first pfor
+static void startWorkers() {
+  if (PFor.Workers && PFor.Owner == getpid())
+    return;
+  // a forked child has the memory of the workers but not their threads
+  pthread_mutex_init(&PFor.Lock, nullptr);
+  pthread_cond_init(&PFor.Wake, nullptr);
+  pthread_cond_init(&PFor.Done, nullptr);
+  PFor.Owner = getpid();
+  PFor.Busy = 0;
+  PFor.StartGeneration = PFor.Generation;
+  readConfig();
+
+  long N = PFor.Threads ? PFor.Threads : sysconf(_SC_NPROCESSORS_ONLN);
+  PFor.NumWorkers = N < 1 ? 1 : (unsigned)N;
+  PFor.Workers = (PForWorker *)calloc(PFor.NumWorkers, sizeof(PForWorker));
+  if (!PFor.Workers) {
+    fprintf(stderr, "Error: out of memory in pfor\n");
+    exit(1);
+  }
+  for (unsigned I = 0; I != PFor.NumWorkers; ++I)
+    pthread_mutex_init(&PFor.Workers[I].Lock, nullptr);
+  for (unsigned I = 1; I < PFor.NumWorkers; ++I) {
+    pthread_t T;
+    pthread_attr_t Attr;
+    pthread_attr_init(&Attr);
+    pthread_attr_setdetachstate(&Attr, PTHREAD_CREATE_DETACHED);
+    // the JIT-ed code recurses on these stacks like on the main one
+    pthread_attr_setstacksize(&Attr, 8 << 20);
+    int Err = pthread_create(&T, &Attr, pforWorker, (void *)(uintptr_t)I);
+    pthread_attr_destroy(&Attr);
+    if (Err) {
+      PFor.NumWorkers = I;
+      break;
+    }
+  }
+}
+
+extern "C" DLLEXPORT double pforrun(int64_t N, int64_t Op, PForBody Body, void *Env) {
+  double Identity = Op == '*' ? 1 : 0;
+  if (N <= 0)
+    return Identity * (Op != 0);
+  bool Nested = InPFor;
+  if (!Nested)
+    pthread_mutex_lock(&PFor.RunLock);
+  startWorkers();
+
+  PForJob J;
+  J.Body = Body;
+  J.Env = Env;
+  J.N = N;
+  J.Op = Op;
+  unsigned W = Nested ? 1 : PFor.NumWorkers;
+  J.Grain = grainOf(N, PFor.NumWorkers);
+  int64_t NumChunks = (N + J.Grain - 1) / J.Grain;
+  J.ChunkResults = PFor.Deterministic ? (double *)malloc(NumChunks * sizeof(double)) : nullptr;
+  if (PFor.Deterministic && !J.ChunkResults) {
+    fprintf(stderr, "Error: out of memory in pfor\n");
+    exit(1);
+  }
+
+  double R;
+  if (W == 1) {
+    // nested, or one thread: all chunks here, in order
+    R = Identity;
+    InPFor = true;
+    for (int64_t C = 0; C != NumChunks; ++C) {
+      int64_t Begin = C * J.Grain, End = Begin + J.Grain < N ? Begin + J.Grain : N;
+      R = combine(Op, R, Body(Begin, End, Env));
+    }
+    InPFor = Nested;
+  } else {
+    for (unsigned I = 0; I != W; ++I) {
+      PFor.Workers[I].Next = NumChunks * I / W;
+      PFor.Workers[I].End = NumChunks * (I + 1) / W;
+    }
+    pthread_mutex_lock(&PFor.Lock);
+    PFor.Job = &J;
+    PFor.Busy = W - 1;
+    ++PFor.Generation;
+    pthread_cond_broadcast(&PFor.Wake);
+    pthread_mutex_unlock(&PFor.Lock);
+
+    InPFor = true;
+    runChunks(&J, 0);
+    InPFor = false;
+
+    pthread_mutex_lock(&PFor.Lock);
+    while (PFor.Busy)
+      pthread_cond_wait(&PFor.Done, &PFor.Lock);
+    pthread_mutex_unlock(&PFor.Lock);
+
+    R = Identity;
+    if (J.ChunkResults)
+      for (int64_t C = 0; C != NumChunks; ++C)
+        R = combine(Op, R, J.ChunkResults[C]);
+    else
+      for (unsigned I = 0; I != W; ++I)
+        R = combine(Op, R, PFor.Workers[I].Partial);
+  }
+  free(J.ChunkResults);
+  if (!Nested)
+    pthread_mutex_unlock(&PFor.RunLock);
+  return Op ? R : 0;
+}
+
+/// pforgrain - the iterations per chunk of a pfor of N iterations in
+/// deterministic mode, 0 otherwise. The interpreter reduces such a pfor chunk
+/// by chunk like pforrun, so it has the same value in either tier.
+extern "C" DLLEXPORT int64_t pforgrain(int64_t N) {
+  readConfig();
+  return PFor.Deterministic && N > 0 ? grainOf(N, 1) : 0;
+}
+
+/// toyisalevel - the ISA level of this CPU, for the resolvers of functions
+/// compiled with toy -aot -multiversion: 2 with AVX-512 (F, VL, DQ and BW),
+/// 1 with AVX2 and FMA, 0 otherwise. Resolvers run while the program is
+/// relocated, before any constructor, so it initializes the CPU model itself.
+extern "C" DLLEXPORT int64_t toyisalevel() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+    return 0;
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw"))
+    return 2;
+  return 1;
+#else
+  return 0;
+#endif
+}
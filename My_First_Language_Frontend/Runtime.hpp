@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+/// The runtime functions the driver calls itself, see Runtime.cpp for them
+/// and for the rest of the runtime of the JIT-ed code.
+
+extern "C" {
+/// Runtime of array(n), the interpreter allocates its arrays the same way.
+double *arrayalloc(int64_t N);
+/// 1 while this thread runs the iterations of a pfor.
+int64_t pforactive();
+/// The threads, chunk size and mode of pfor, -pfor-threads and friends.
+void pforconfig(int64_t Threads, int64_t Chunk, int64_t Deterministic);
+/// The iterations per chunk of a deterministic pfor of N iterations, else 0.
+int64_t pforgrain(int64_t N);
+}
@@ -0,0 +1,105 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Paser.hpp"
+#include "Server.hpp"
+
+// compile server: toy -serve=<socket> [prelude.k]
+// the server initializes the target and the JIT once and compiles the input
+// file, the prelude, before it listens. every connection is a session of its
+// own: a child process forked from the warm server, so the JIT, the prelude's
+// definitions and the inline library are there without any work, and sessions
+// run concurrently without sharing any compiler state. a session is a REPL,
+// definitions stay for its later requests, and a crash ends only that session.
+// see Server.hpp for the protocol, toy-client for a client and load test
+
+cl::opt<std::string>
+ServeSocket("serve",
+			cl::desc("Compile the input as a prelude, then serve sessions on the Unix domain socket <path>"),
+			cl::value_desc("path"), cl::init(""));
+
+// run the requests of one session, what the REPL prints goes back as the response
+static int ServeSession(int Conn){
+	// stderr goes to a file, emptied before every request
+	FILE * Out = tmpfile();
+	if(!Out || dup2(fileno(Out), STDERR_FILENO) < 0)
+		return 1;
+	ReplPrompt = false;
+
+	std::string Request, Response;
+	while(ReadFrame(Conn, Request)){
+		if(ftruncate(STDERR_FILENO, 0) < 0 || lseek(STDERR_FILENO, 0, SEEK_SET) < 0)
+			return 1;
+
+		TheParser->setLexer(std::make_unique<Lexer>(MemoryBuffer::getMemBufferCopy(Request, "request")));
+		TheParser->getNextToken();
+		MainLoop();
+		fflush(stderr);
+
+		off_t Len = lseek(STDERR_FILENO, 0, SEEK_CUR);
+		Response.resize(Len < 0 ? 0 : Len);
+		if(Len > 0 && pread(STDERR_FILENO, &Response[0], Len, 0) != Len)
+			return 1;
+		if(!WriteFrame(Conn, Response))
+			break;
+	}
+	return 0;
+}
+
+int RunServer(){
+	// the prelude, compiled once for every session
+	MainLoop();
+
+	sockaddr_un Addr;
+	if(!SocketAddress(ServeSocket, Addr)){
+		fprintf(stderr, "Error: socket path %s is too long\n", ServeSocket.c_str());
+		return 1;
+	}
+	// the socket of an earlier server is replaced, anything else at the path is left alone
+	struct stat St;
+	if(lstat(ServeSocket.c_str(), &St) == 0){
+		if(!S_ISSOCK(St.st_mode)){
+			fprintf(stderr, "Error: %s exists and is not a socket\n", ServeSocket.c_str());
+			return 1;
+		}
+		unlink(ServeSocket.c_str());
+	}
+	int Listen = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(Listen < 0 || bind(Listen, (sockaddr *)&Addr, sizeof(Addr)) < 0 || listen(Listen, SOMAXCONN) < 0){
+		fprintf(stderr, "Error: can't listen on %s: %s\n", ServeSocket.c_str(), strerror(errno));
+		return 1;
+	}
+
+	// sessions are never waited for, the kernel reaps them
+	signal(SIGCHLD, SIG_IGN);
+	fprintf(stderr, "\nServing on %s\n", ServeSocket.c_str());
+
+	while(1){
+		int Conn = accept(Listen, nullptr, nullptr);
+		if(Conn < 0){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Error: accept on %s: %s\n", ServeSocket.c_str(), strerror(errno));
+			return 1;
+		}
+
+		pid_t Pid = fork();
+		if(Pid == 0){
+			close(Listen);
+			_exit(ServeSession(Conn));
+		}
+		if(Pid < 0)
+			fprintf(stderr, "Error: can't start a session: %s\n", strerror(errno));
+		close(Conn);
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "llvm/Support/CommandLine.h"
+
+// the compile server protocol (toy -serve, toy-client)
+// a connection to the Unix domain socket is a session. the client sends a
+// request, Kaleidoscope source, and reads back the response, everything the
+// REPL printed for it: results and diagnostics. both are framed as
+// 	<length in decimal>\n<length bytes>
+
+// the server side, see Server.cpp
+// -serve=<path>, empty when toy is not a compile server
+extern llvm::cl::opt<std::string> ServeSocket;
+// compile the prelude, then serve sessions. it only returns on an error
+int RunServer();
+
+static bool WriteAll(int Fd, const char *Data, size_t Len){
+	while(Len){
+		ssize_t N = write(Fd, Data, Len);
+		if(N < 0 && errno == EINTR)
+			continue;
+		if(N <= 0)
+			return false;
+		Data += N;
+		Len -= N;
+	}
+	return true;
+}
+
+static bool WriteFrame(int Fd, const std::string &Data){
+	std::string Header = std::to_string(Data.size()) + "\n";
+	return WriteAll(Fd, Header.data(), Header.size()) && WriteAll(Fd, Data.data(), Data.size());
+}
+
+// false at the end of the connection or on a malformed frame
+static bool ReadFrame(int Fd, std::string &Data){
+	size_t Len = 0;
+	unsigned Digits = 0;
+	while(1){
+		char C;
+		ssize_t N = read(Fd, &C, 1);
+		if(N < 0 && errno == EINTR)
+			continue;
+		if(N <= 0)
+			return false;
+		if(C == '\n')
+			break;
+		if(C < '0' || C > '9' || ++Digits > 12)
+			return false;
+		Len = Len * 10 + (C - '0');
+	}
+	if(!Digits)
+		return false;
+
+	Data.resize(Len);
+	size_t Got = 0;
+	while(Got < Len){
+		ssize_t N = read(Fd, &Data[Got], Len - Got);
+		if(N < 0 && errno == EINTR)
+			continue;
+		if(N <= 0)
+			return false;
+		Got += N;
+	}
+	return true;
+}
+
+// the address of the socket at Path, false when the path is too long
+static bool SocketAddress(const std::string &Path, sockaddr_un &Addr){
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	if(Path.size() >= sizeof(Addr.sun_path))
+		return false;
+	memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+	return true;
+}
+
+// a new session with the server at Path, -1 on error
+static int ConnectToServer(const std::string &Path){
+	sockaddr_un Addr;
+	if(!SocketAddress(Path, Addr)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(Fd < 0)
+		return -1;
+	if(connect(Fd, (sockaddr *)&Addr, sizeof(Addr)) < 0){
+		int Err = errno;
+		close(Fd);
+		errno = Err;
+		return -1;
+	}
+	return Fd;
+}
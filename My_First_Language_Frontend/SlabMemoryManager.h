@@ -0,0 +1,353 @@
+//===- SlabMemoryManager.h - Pooled JIT memory for many small modules -----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A memory manager for a JIT that loads one tiny module per definition and per
+// top-level expression. SectionMemoryManager maps at least a page per section
+// kind for every module; here all modules carve their sections out of shared
+// slabs, and the memory of a removed module is reused by later ones.
+//
+// Code and read-only data slabs are mapped twice from one memfd: a read-write
+// view the linker writes through, and a read-execute (code) or read-only view
+// the sections are linked to run at. So many modules share a code page, and
+// still no page is ever writable and executable at the same time.
+//
+// Slabs stay shared with forked children (toy -serve). A process only carves
+// sections out of the slabs it mapped itself, so no process writes into code
+// that another one may be running.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+class SlabPool {
+public:
+  enum Kind { Code, ROData, RWData, NumKinds };
+
+  // A section: written at Local, linked and run at Target.
+  struct Block {
+    uint8_t *Local = nullptr;
+    uint8_t *Target = nullptr;
+    size_t Size = 0;      // as carved out, a multiple of MinAlign
+    size_t Requested = 0; // as asked for
+    Kind K = RWData;
+  };
+
+  // bytes as the sections asked for them
+  struct Stats {
+    uint64_t BytesAllocated = 0; // every section ever handed out
+    uint64_t BytesReused = 0;    // of those, in memory of removed modules
+    uint64_t BytesInUse = 0;     // sections of the modules still loaded
+    uint64_t BytesMapped = 0;
+    uint64_t BytesWasted = 0;    // mapped but not in use: padding, free space
+    uint64_t BytesFree = 0;      // of that, what later sections can use
+    unsigned Mappings = 0;
+  };
+
+  explicit SlabPool(size_t SlabSize = 256 * 1024)
+      : PageSize(sys::Process::getPageSizeEstimate()),
+        SlabSize(alignTo(SlabSize, PageSize)) {}
+
+  ~SlabPool() {
+    for (auto &S : Slabs) {
+      if (S->Owner != getpid())
+        continue;
+      munmap(S->Local, S->Size);
+      if (S->Target != S->Local)
+        munmap(S->Target, S->Size);
+    }
+  }
+
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  Block allocate(Kind K, size_t Requested, unsigned Alignment) {
+    std::lock_guard<std::mutex> Lock(M);
+    Alignment = std::max(Alignment, MinAlign);
+    size_t Size = alignTo(std::max<size_t>(Requested, 1), MinAlign);
+    pid_t Self = getpid();
+
+    // first fit among the free ranges, then the untouched tails
+    for (auto &S : Slabs)
+      if (S->K == K && S->Owner == Self)
+        for (auto &F : S->Free)
+          if (carve(*S, F.first, F.second, Size, Alignment, /*Tail=*/false))
+            return block(*S, LastOffset, Size, Requested);
+    for (auto &S : Slabs)
+      if (S->K == K && S->Owner == Self &&
+          carve(*S, S->Used, S->Size - S->Used, Size, Alignment, true))
+        return block(*S, LastOffset, Size, Requested);
+
+    Slab *S = newSlab(K, std::max(SlabSize, alignTo(Size + Alignment, PageSize)));
+    if (!S)
+      return Block();
+    carve(*S, 0, S->Size, Size, Alignment, true);
+    return block(*S, LastOffset, Size, Requested);
+  }
+
+  // Give the memory of B back, later sections may reuse it.
+  void release(const Block &B) {
+    if (!B.Local)
+      return;
+    std::lock_guard<std::mutex> Lock(M);
+    InUse -= B.Requested;
+    Slab *S = findSlab(B.Local);
+    if (!S || S->Owner != getpid())
+      return;
+    size_t Off = B.Local - S->Local;
+    S->Allocated -= B.Size;
+    // an empty slab is untouched again, else merge with the free neighbours
+    if (!S->Allocated) {
+      S->Free.clear();
+      S->Used = 0;
+      return;
+    }
+    size_t Len = B.Size;
+    auto Next = S->Free.lower_bound(Off);
+    if (Next != S->Free.end() && Off + Len == Next->first) {
+      Len += Next->second;
+      Next = S->Free.erase(Next);
+    }
+    if (Next != S->Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Off) {
+        Prev->second += Len;
+        Len = 0;
+      }
+    }
+    if (Len)
+      S->Free[Off] = Len;
+    // a free range at the end of the bump area joins the tail
+    if (!S->Free.empty()) {
+      auto Last = std::prev(S->Free.end());
+      if (Last->first + Last->second == S->Used) {
+        S->Used = Last->first;
+        S->Free.erase(Last);
+      }
+    }
+  }
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> Lock(M);
+    Stats St;
+    St.BytesAllocated = Allocated;
+    St.BytesReused = Reused;
+    St.BytesInUse = InUse;
+    pid_t Self = getpid();
+    for (auto &S : Slabs) {
+      St.Mappings += S->Target == S->Local ? 1 : 2;
+      St.BytesMapped += S->Size;
+      if (S->Owner != Self)
+        continue;
+      St.BytesFree += S->Size - S->Used;
+      for (auto &F : S->Free)
+        St.BytesFree += F.second;
+    }
+    St.BytesWasted = St.BytesMapped - St.BytesInUse;
+    return St;
+  }
+
+private:
+  struct Slab {
+    Kind K;
+    uint8_t *Local;
+    uint8_t *Target;
+    size_t Size;
+    size_t Used = 0;                 // bump pointer, [Used, Size) is untouched
+    size_t Allocated = 0;            // bytes of live sections
+    size_t HighWater = 0;            // [0, HighWater) was handed out before
+    std::map<size_t, size_t> Free;   // offset -> length, below Used
+    pid_t Owner;
+  };
+
+  // Take Size bytes aligned to Alignment out of [Off, Off + Len) of S, the
+  // bytes before and after stay free. Sets LastOffset and LastReused.
+  bool carve(Slab &S, size_t Off, size_t Len, size_t Size, unsigned Alignment,
+             bool Tail) {
+    size_t Start =
+        alignTo((uintptr_t)S.Target + Off, Alignment) - (uintptr_t)S.Target;
+    if (Start + Size > Off + Len)
+      return false;
+    if (Tail) {
+      if (Start != Off)
+        S.Free[Off] = Start - Off;
+      S.Used = Start + Size;
+    } else {
+      S.Free.erase(Off);
+      if (Start != Off)
+        S.Free[Off] = Start - Off;
+      if (Start + Size != Off + Len)
+        S.Free[Start + Size] = Off + Len - Start - Size;
+    }
+    S.Allocated += Size;
+    LastOffset = Start;
+    LastReused = Start < S.HighWater;
+    S.HighWater = std::max(S.HighWater, Start + Size);
+    return true;
+  }
+
+  Block block(Slab &S, size_t Off, size_t Size, size_t Requested) {
+    Allocated += Requested;
+    InUse += Requested;
+    if (LastReused)
+      Reused += Requested;
+    Block B;
+    B.Local = S.Local + Off;
+    B.Target = S.Target + Off;
+    B.Size = Size;
+    B.Requested = Requested;
+    B.K = S.K;
+    return B;
+  }
+
+  Slab *newSlab(Kind K, size_t Size) {
+    auto S = std::make_unique<Slab>();
+    S->K = K;
+    S->Size = Size;
+    S->Owner = getpid();
+    if (K == RWData) {
+      void *P = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (P == MAP_FAILED)
+        return nullptr;
+      S->Local = S->Target = (uint8_t *)P;
+    } else {
+      // the writable and the executable / read-only view of one memfd
+      int Fd = memfd_create("toy-jit", MFD_CLOEXEC);
+      if (Fd < 0 || ftruncate(Fd, Size) < 0) {
+        if (Fd >= 0)
+          close(Fd);
+        return nullptr;
+      }
+      int Prot = K == Code ? PROT_READ | PROT_EXEC : PROT_READ;
+      void *W = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+      void *X = mmap(nullptr, Size, Prot, MAP_SHARED, Fd, 0);
+      close(Fd);
+      if (W == MAP_FAILED || X == MAP_FAILED) {
+        if (W != MAP_FAILED)
+          munmap(W, Size);
+        if (X != MAP_FAILED)
+          munmap(X, Size);
+        return nullptr;
+      }
+      S->Local = (uint8_t *)W;
+      S->Target = (uint8_t *)X;
+    }
+    Slabs.push_back(std::move(S));
+    return Slabs.back().get();
+  }
+
+  Slab *findSlab(const uint8_t *Local) {
+    for (auto &S : Slabs)
+      if (Local >= S->Local && Local < S->Local + S->Size)
+        return S.get();
+    return nullptr;
+  }
+
+  static constexpr unsigned MinAlign = 16;
+
+  std::mutex M;
+  const size_t PageSize;
+  const size_t SlabSize;
+  std::vector<std::unique_ptr<Slab>> Slabs;
+  size_t LastOffset = 0;
+  bool LastReused = false;
+  uint64_t Allocated = 0, Reused = 0, InUse = 0;
+};
+
+// The memory manager of one module, its sections come from a shared SlabPool
+// and go back to it when the module is removed.
+class SlabMemoryManager : public RTDyldMemoryManager {
+public:
+  explicit SlabMemoryManager(std::shared_ptr<SlabPool> Pool)
+      : Pool(std::move(Pool)) {}
+
+  ~SlabMemoryManager() override {
+    deregisterEHFrames();
+    for (auto &B : Blocks)
+      Pool->release(B);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    return allocate(SlabPool::Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    return allocate(IsReadOnly ? SlabPool::ROData : SlabPool::RWData, Size,
+                    Alignment);
+  }
+
+  // Link every section at the address it runs at, before the relocations.
+  void notifyObjectLoaded(RuntimeDyld &RTDyld,
+                          const object::ObjectFile &Obj) override {
+    for (auto &B : Blocks)
+      if (B.Local != B.Target)
+        RTDyld.mapSectionAddress(B.Local, (uint64_t)(uintptr_t)B.Target);
+  }
+
+  // The unwinder reads the frames where they are linked to run.
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override {
+    registerEHFramesInProcess((uint8_t *)(uintptr_t)LoadAddr, Size);
+    EHFrames.push_back({(uint8_t *)(uintptr_t)LoadAddr, Size});
+  }
+
+  void deregisterEHFrames() override {
+    for (auto &F : EHFrames)
+      deregisterEHFramesInProcess(F.first, F.second);
+    EHFrames.clear();
+  }
+
+  // The views already have their final permissions, only the instruction
+  // cache may need a flush.
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    for (auto &B : Blocks)
+      if (B.K == SlabPool::Code)
+        sys::Memory::InvalidateInstructionCache(B.Target, B.Size);
+    return false;
+  }
+
+private:
+  uint8_t *allocate(SlabPool::Kind K, uintptr_t Size, unsigned Alignment) {
+    SlabPool::Block B = Pool->allocate(K, Size, Alignment);
+    if (B.Local)
+      Blocks.push_back(B);
+    return B.Local;
+  }
+
+  std::shared_ptr<SlabPool> Pool;
+  std::vector<SlabPool::Block> Blocks;
+  std::vector<std::pair<uint8_t *, size_t>> EHFrames;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
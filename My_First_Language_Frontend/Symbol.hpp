@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorHandling.h"
+
+// Symbol, an interned identifier: the same name always gets the same id, so
+// the symbol tables (DenseMap / ScopedHashTable) hash and compare an integer
+// instead of a string
+using Symbol = unsigned;
+
+// SymbolTable, interns every identifier the lexers read
+// parser threads intern under a lock (a Lexer keeps the names it has seen, so
+// it rarely asks), getName doesn't lock: the names are kept in chunks that never
+// move, and a symbol only reaches another thread after it was interned
+class SymbolTable{
+	static constexpr unsigned ChunkBits = 12;
+	static constexpr unsigned ChunkSize = 1u << ChunkBits;
+	static constexpr unsigned MaxChunks = 1u << 12;
+
+	mutable std::mutex Lock;
+	llvm::StringMap<Symbol> Ids;
+	// id -> name, the key stored in Ids
+	std::unique_ptr<llvm::StringRef[]> Names[MaxChunks];
+	std::atomic<Symbol> NumNames{0};
+
+public:
+	Symbol intern(llvm::StringRef Name){
+		std::lock_guard<std::mutex> Guard(Lock);
+		Symbol Next = NumNames.load(std::memory_order_relaxed);
+		auto R = Ids.try_emplace(Name, Next);
+		if(R.second){
+			// every chunk is in use, ChunkSize * MaxChunks names
+			if((Next >> ChunkBits) == MaxChunks)
+				llvm::report_fatal_error("too many identifiers, the symbol table is full");
+			std::unique_ptr<llvm::StringRef[]> & Chunk = Names[Next >> ChunkBits];
+			if(!Chunk)
+				Chunk.reset(new llvm::StringRef[ChunkSize]);
+			Chunk[Next & (ChunkSize - 1)] = R.first->getKey();
+			NumNames.store(Next + 1, std::memory_order_release);
+		}
+		return R.first->second;
+	}
+
+	// id of a name that was interned before, or ~0U
+	Symbol find(llvm::StringRef Name) const{
+		std::lock_guard<std::mutex> Guard(Lock);
+		auto It = Ids.find(Name);
+		return It == Ids.end() ? ~0U : It->second;
+	}
+
+	llvm::StringRef getName(Symbol Sym) const { return Names[Sym >> ChunkBits][Sym & (ChunkSize - 1)]; }
+	size_t size() const { return NumNames.load(std::memory_order_acquire); }
+};
+
+// the one table of the process, see lexer.cpp
+extern SymbolTable Symbols;
@@ -0,0 +1,202 @@
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "IR.hpp"
+#include "Trace.hpp"
+
+using namespace llvm;
+
+// phase tracing
+// every top-level item is a span, and inside it a span per phase: parse (with
+// the time the lexer took), codegen, optimize, JIT (machine code for the
+// module), lookup (linking it and finding the entry), run or interpret.
+// -trace writes all spans as Chrome trace events (chrome://tracing, Perfetto),
+// LLVM's -stats prints the totals per phase at exit, the functions that took
+// longest and the modules the driver made.
+// spans are kept per thread, batch workers have their own timeline
+
+bool TraceEnabled;
+thread_local uint64_t TraceLexNanos, TraceTokens;
+
+static cl::opt<std::string>
+TraceFile("trace",
+		  cl::desc("Write a timeline of the phases of every top-level item as Chrome trace "
+				   "events (JSON) to <file> at exit"),
+		  cl::value_desc("file"));
+
+static cl::opt<unsigned>
+StatsTop("stats-top",
+		 cl::desc("Functions listed by -stats, the ones that took longest"),
+		 cl::init(10));
+
+static const char * const TracePhaseNames[TP_NumPhases] = {
+	"item", "parse", "codegen", "optimize", "jit", "lookup", "run", "interpret"};
+
+struct TraceEvent{
+	TracePhase Phase;
+	uint64_t Start, End, Lex;
+	std::string Detail;
+};
+
+// the spans of one thread, they outlive it
+struct TraceBuffer{
+	unsigned Tid;
+	std::vector<TraceEvent> Events;
+	uint64_t LexNanos = 0, Tokens = 0;	// of the thread, when it was done
+};
+
+static std::mutex TraceLock;
+static std::deque<TraceBuffer> TraceBuffers;
+static thread_local TraceBuffer * ThreadTrace;
+static uint64_t TraceEpoch;
+
+// modules the driver made, and removed from the JIT again
+// every module or object added to the JIT is in a jit span
+std::atomic<unsigned> NumModulesCreated, NumModulesRemoved;
+
+void InitTrace(){
+	TraceEnabled = !TraceFile.empty() || AreStatisticsEnabled();
+	TraceEpoch = TraceNow();
+}
+
+static TraceBuffer & GetThreadTrace(){
+	if(!ThreadTrace){
+		std::lock_guard<std::mutex> Lock(TraceLock);
+		TraceBuffers.emplace_back();
+		ThreadTrace = &TraceBuffers.back();
+		ThreadTrace->Tid = TraceBuffers.size();
+	}
+	return *ThreadTrace;
+}
+
+void RecordSpan(TracePhase Phase, const std::string & Detail, uint64_t Start, uint64_t End,
+				uint64_t Lex){
+	TraceBuffer & B = GetThreadTrace();
+	B.Events.push_back({Phase, Start, End, Lex, Detail});
+	B.LexNanos = TraceLexNanos;
+	B.Tokens = TraceTokens;
+}
+
+// the function M defines, or the first of them and how many more
+// a body behind a stub goes by the name of the stub, see RenameToBody
+std::string ModuleDetail(const Module & M){
+	std::string First;
+	unsigned More = 0;
+	for(const Function & F : M){
+		// imported bodies aren't compiled, see Inline.cpp
+		if(F.isDeclaration() || F.hasLocalLinkage() || F.hasAvailableExternallyLinkage())
+			continue;
+		if(!First.empty()){
+			++More;
+			continue;
+		}
+		StringRef Name = F.getName();
+		std::pair<StringRef, StringRef> Body = Name.rsplit('.');
+		unsigned Version;
+		Symbol Sym;
+		if(!Body.second.getAsInteger(10, Version) && (Sym = Symbols.find(Body.first)) != ~0U &&
+		   BodyVersions.count(Sym))
+			Name = Body.first;
+		First = Name.str();
+	}
+	return More ? First + " +" + std::to_string(More) : First;
+}
+
+
+static json::Value TraceEventJSON(const TraceEvent & E, unsigned Tid){
+	std::string Name = TracePhaseNames[E.Phase];
+	if(!E.Detail.empty())
+		Name += " " + E.Detail;
+	json::Object Args;
+	if(!E.Detail.empty())
+		Args["function"] = E.Detail;
+	if(E.Lex)
+		Args["lex_us"] = E.Lex / 1000.0;
+	return json::Object{
+		{"name", std::move(Name)}, {"cat", TracePhaseNames[E.Phase]}, {"ph", "X"},
+		{"ts", (E.Start - TraceEpoch) / 1000.0}, {"dur", (E.End - E.Start) / 1000.0},
+		{"pid", 1}, {"tid", (int64_t)Tid}, {"args", std::move(Args)}};
+}
+
+// -trace, at exit when every other thread is done
+void WriteTrace(){
+	if(TraceFile.empty())
+		return;
+	json::Array Events;
+	for(const TraceBuffer & B : TraceBuffers){
+		Events.push_back(json::Object{
+			{"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", (int64_t)B.Tid},
+			{"args", json::Object{{"name", B.Tid == 1 ? "toy" : "worker " + std::to_string(B.Tid - 1)}}}});
+		for(const TraceEvent & E : B.Events)
+			Events.push_back(TraceEventJSON(E, B.Tid));
+	}
+	std::error_code EC;
+	raw_fd_ostream OS(TraceFile, EC, sys::fs::OF_Text);
+	if(EC){
+		fprintf(stderr, "Error: can't write %s: %s\n", TraceFile.c_str(), EC.message().c_str());
+		return;
+	}
+	OS << json::Value(json::Object{{"traceEvents", std::move(Events)}, {"displayTimeUnit", "ms"}});
+	OS << "\n";
+}
+
+// -stats: the time per phase, the functions that took longest and the modules
+void PrintTraceStats(){
+	if(!AreStatisticsEnabled())
+		return;
+	uint64_t Total[TP_NumPhases] = {}, Max[TP_NumPhases] = {};
+	unsigned Count[TP_NumPhases] = {};
+	uint64_t LexNanos = 0, Tokens = 0;
+	// per function: the time of its phases, items are made of those
+	StringMap<uint64_t> ByFunction;
+	for(const TraceBuffer & B : TraceBuffers){
+		LexNanos += B.LexNanos;
+		Tokens += B.Tokens;
+		for(const TraceEvent & E : B.Events){
+			uint64_t D = E.End - E.Start;
+			Total[E.Phase] += D;
+			Max[E.Phase] = std::max(Max[E.Phase], D);
+			++Count[E.Phase];
+			if(E.Phase != TP_Item && !E.Detail.empty())
+				ByFunction[E.Detail] += D;
+		}
+	}
+
+	fprintf(stderr, "phase        spans   total ms    mean us     max us\n");
+	if(Tokens)
+		fprintf(stderr, "%-9s %8llu %10.3f %10.3f            (tokens, mean per token)\n", "lex",
+				(unsigned long long)Tokens, LexNanos / 1e6, LexNanos / 1e3 / Tokens);
+	for(unsigned P = 0; P != TP_NumPhases; ++P)
+		if(Count[P])
+			fprintf(stderr, "%-9s %8u %10.3f %10.3f %10.3f\n", TracePhaseNames[P], Count[P],
+					Total[P] / 1e6, Total[P] / 1e3 / Count[P], Max[P] / 1e3);
+
+	std::vector<std::pair<uint64_t, StringRef>> Slowest;
+	for(auto & KV : ByFunction)
+		Slowest.push_back({KV.second, KV.first()});
+	std::sort(Slowest.begin(), Slowest.end(),
+			  [](const std::pair<uint64_t, StringRef> & A, const std::pair<uint64_t, StringRef> & B){
+				  return A.first > B.first;
+			  });
+	if(Slowest.size() > StatsTop)
+		Slowest.resize(StatsTop);
+	if(!Slowest.empty())
+		fprintf(stderr, "slowest functions (parse to run):\n");
+	for(auto & S : Slowest)
+		fprintf(stderr, "  %10.3f ms  %s\n", S.first / 1e6, S.second.str().c_str());
+
+	fprintf(stderr, "modules: %u created, %u added to the JIT, %u removed\n",
+			NumModulesCreated.load(), Count[TP_JIT], NumModulesRemoved.load());
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+// phase tracing, see Trace.cpp
+
+// what a span measures, a top-level item holds the spans of its phases
+enum TracePhase{
+	TP_Item, TP_Parse, TP_Codegen, TP_Optimize, TP_JIT, TP_Lookup, TP_Run, TP_Interpret,
+	TP_NumPhases
+};
+
+// set by InitTrace when there is a trace to write or -stats to print
+extern bool TraceEnabled;
+
+// the time getNextToken spent in the lexer on this thread, and its tokens
+extern thread_local uint64_t TraceLexNanos, TraceTokens;
+
+inline uint64_t TraceNow(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// before anything is traced: turns tracing on for -trace and -stats
+void InitTrace();
+
+// at exit: the -stats summary, and the -trace file once every other thread is done
+void PrintTraceStats();
+void WriteTrace();
+
+// modules the driver made, and removed from the JIT again
+extern std::atomic<unsigned> NumModulesCreated, NumModulesRemoved;
+
+// the detail of a jit span: the function M defines, or the first of them and
+// how many more
+std::string ModuleDetail(const llvm::Module & M);
+
+// Lex is the lexer time inside the span
+void RecordSpan(TracePhase Phase, const std::string & Detail, uint64_t Start, uint64_t End,
+				uint64_t Lex);
+
+// one span of Phase, from the constructor to the destructor
+// without tracing it costs a test of TraceEnabled at both ends
+class TraceScope{
+	TracePhase Phase;
+	uint64_t Start = 0;
+	uint64_t LexStart = 0;
+	std::string Detail;		// the function, when the phase is about one
+public:
+	TraceScope(TracePhase Phase, llvm::StringRef Detail = "") : Phase(Phase) {
+		if(TraceEnabled){
+			this->Detail = Detail.str();
+			LexStart = TraceLexNanos;
+			Start = TraceNow();
+		}
+	}
+	~TraceScope(){
+		if(TraceEnabled)
+			RecordSpan(Phase, Detail, Start, TraceNow(), TraceLexNanos - LexStart);
+	}
+	// the function is only known once it is parsed
+	void setDetail(llvm::StringRef D){
+		if(TraceEnabled)
+			Detail = D.str();
+	}
+	TraceScope(const TraceScope &) = delete;
+	TraceScope & operator=(const TraceScope &) = delete;
+};
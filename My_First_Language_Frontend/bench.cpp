@@ -0,0 +1,565 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include "IR.hpp"
+#include "Paser.hpp"
+#include "Runtime.hpp"
+
+using namespace llvm::orc;
+
+// toy-bench: generates synthetic Kaleidoscope programs and times every phase
+// of compiling and running them, one run per shape and size
+//
+//   toy-bench -shape=all -size=100,1000 -o=bench.json
+//   toy-bench -shape=loops -size=500 -emit-source=loops.k
+//   toy-bench -shape=mandelbrot -size=1000 -pfor-threads=1,2,4,8
+//   toy-bench -shape=mixed -size=1000 -parse-threads=1,4 -compile-threads=1,4
+//
+// each run happens in a child process, so its peak RSS is its own. the output
+// is one JSON document, the same keys in every version and every run so runs of
+// two builds can be compared, null where a run didn't measure something. the thread options are for scaling, each one varies a single
+// stage: the threads of the pfor pool, the parsers, and the batch -j compile
+// workers. every run is repeated with each combination of their counts
+
+
+static cl::list<std::string>
+Shapes("shape",
+	   cl::desc("Program shapes to generate: functions, expressions, loops, mixed, "
+				"mandelbrot or all (all but mandelbrot)"),
+	   cl::CommaSeparated, cl::ZeroOrMore);
+
+static cl::list<unsigned>
+Sizes("size",
+	  cl::desc("Number of generated functions, the grid side for mandelbrot, one run per size "
+			   "(default 100,1000)"),
+	  cl::CommaSeparated, cl::ZeroOrMore);
+
+static cl::list<unsigned>
+PForThreads("pfor-threads",
+			cl::desc("Threads of the pfor pool, every run is repeated with each (default 1)"),
+			cl::CommaSeparated, cl::ZeroOrMore);
+
+static cl::list<unsigned>
+ParseThreads("parse-threads",
+			 cl::desc("Parsers, the input is parsed in that many pieces at once, every run is "
+					  "repeated with each (default 1)"),
+			 cl::CommaSeparated, cl::ZeroOrMore);
+
+static cl::list<unsigned>
+CompileThreads("compile-threads",
+			   cl::desc("Batch -j compile workers, every run is repeated with each (default 1)"),
+			   cl::CommaSeparated, cl::ZeroOrMore);
+
+static cl::opt<unsigned>
+Depth("depth",
+	  cl::desc("Nesting depth of the expressions in the expressions shape"),
+	  cl::init(32));
+
+static cl::opt<unsigned>
+Seed("seed", cl::desc("Seed of the program generator"), cl::init(1));
+
+static cl::opt<unsigned>
+Repeat("repeat", cl::desc("Runs per shape and size"), cl::init(1));
+
+static cl::opt<std::string>
+OutputFilename("o", cl::desc("Write the JSON report to this file instead of stdout"),
+			   cl::value_desc("file"), cl::init("-"));
+
+static cl::opt<std::string>
+EmitSource("emit-source",
+		   cl::desc("Write the program of the first shape and size to this file and exit"),
+		   cl::value_desc("file"));
+
+
+// program generator
+
+enum BenchShape{ Shape_Functions, Shape_Expressions, Shape_Loops, Shape_Mixed, Shape_Mandelbrot };
+static const char * const ShapeNames[] = {"functions", "expressions", "loops", "mixed", "mandelbrot"};
+
+class ProgramGenerator{
+	std::mt19937 Rng;
+	std::string Src;
+	unsigned NumExprs = 0;
+
+	unsigned pick(unsigned N){ return std::uniform_int_distribution<unsigned>(0, N - 1)(Rng); }
+
+	// a chain of calls: fK calls fK-1, the first run walks all of them
+	void emitCallChain(unsigned K){
+		if(K == 0)
+			Src += "def f0(x y) x * 0.5 + y;\n";
+		else
+			Src += "def f" + std::to_string(K) + "(x y) f" + std::to_string(K - 1) +
+				   "(y, x * 1.5 - " + std::to_string(K) + ") * 0.5 + x;\n";
+	}
+
+	// Depth levels of arithmetic, compares and ifs over the arguments
+	void emitExpr(unsigned Depth){
+		static const char * const Leaves[] = {"a", "b", "c", "1.5", "2", "0.25"};
+		static const char Ops[] = {'+', '-', '*', '<'};
+		if(Depth == 0){
+			Src += Leaves[pick(6)];
+			return;
+		}
+		if(pick(8) == 0){
+			Src += "(if ";
+			Src += Leaves[pick(3)];
+			Src += " < ";
+			Src += Leaves[3 + pick(3)];
+			Src += " then ";
+			emitExpr(Depth - 1);
+			Src += " else ";
+			Src += Leaves[pick(6)];
+			Src += ")";
+			return;
+		}
+		Src += "(";
+		Src += Leaves[pick(6)];
+		Src += " ";
+		Src += Ops[pick(4)];
+		Src += " ";
+		emitExpr(Depth - 1);
+		Src += ")";
+	}
+
+	void emitDeep(unsigned K){
+		Src += "def e" + std::to_string(K) + "(a b c) ";
+		emitExpr(Depth);
+		Src += ";\n";
+	}
+
+	// an array fill, a reduction over it and an int nested loop
+	void emitLoops(unsigned K){
+		std::string N = std::to_string(K % 7 + 1);
+		Src += "def l" + std::to_string(K) + "(n:int) var s = 0, a:array = array(n) in\n"
+			   "  (for i = 0, i < n - 1 in a[i] = i * " + N + ") :\n"
+			   "  (for j = 0, j < n - 1 in s = s + a[j] * 0.5) :\n"
+			   "  (for i = 0, i < n - 1 in for j = 0, j < " + N + " in s = s + i * j) : s;\n";
+	}
+
+	// the iteration counts of a Side x Side grid over the Mandelbrot set, summed
+	// by a pfor over the rows: the run time is the pfor pool at work
+	void emitMandelbrot(unsigned Side){
+		Src += "def unary-(v) 0-v;\n"
+			   "def binary | 5 (a b) if a then 1 else if b then 1 else 0;\n"
+			   "def mandelconverger(real imag iters creal cimag)\n"
+			   "  if 255 < iters | 4 < real*real + imag*imag then iters\n"
+			   "  else mandelconverger(real*real - imag*imag + creal, 2*real*imag + cimag, iters+1, creal, cimag);\n"
+			   "def mandelconverge(real imag) mandelconverger(real, imag, 0, real, imag);\n"
+			   "def pmandel(xmin xstep nx ymin ystep ny)\n"
+			   "  pfor + j = 0, ny in pfor + i = 0, nx in mandelconverge(xmin + i*xstep, ymin + j*ystep);\n";
+		emitTopLevel(formatv("pmandel(-2.3, {0:f9}, {1}, -1.3, {2:f9}, {1})", 3.9 / Side, Side, 2.8 / Side).str());
+	}
+
+	void emitTopLevel(const std::string &Call){
+		Src += Call + ";\n";
+		++NumExprs;
+	}
+
+public:
+	explicit ProgramGenerator(unsigned Seed) : Rng(Seed) {}
+
+	// every 50th function (and the last one) is called from a top-level expression
+	std::string generate(BenchShape Shape, unsigned Size){
+		Src.clear();
+		NumExprs = 0;
+		if(Shape == Shape_Mandelbrot){
+			emitMandelbrot(Size);
+			return Src;
+		}
+		if(Shape == Shape_Loops || Shape == Shape_Mixed)
+			Src += "def binary : 1 (x y) y;\n";
+
+		unsigned Chain = 0;
+		for(unsigned K = 0; K < Size; ++K){
+			BenchShape S = Shape == Shape_Mixed ? (BenchShape)(K % 3) : Shape;
+			bool Call = K % 50 == 49 || K + 1 == Size;
+			std::string Idx = std::to_string(K);
+			switch(S){
+				case Shape_Functions:
+					emitCallChain(Chain);
+					if(Call)
+						emitTopLevel("f" + std::to_string(Chain) + "(1, 2)");
+					++Chain;
+					break;
+				case Shape_Expressions:
+					emitDeep(K);
+					if(Call)
+						emitTopLevel("e" + Idx + "(1, 2, 3)");
+					break;
+				default:
+					emitLoops(K);
+					if(Call)
+						emitTopLevel("l" + Idx + "(100)");
+					break;
+			}
+		}
+		return Src;
+	}
+
+	unsigned getNumTopLevelExprs() const { return NumExprs; }
+};
+
+
+// one run, in the child process
+
+static double MillisSince(std::chrono::steady_clock::time_point T0){
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - T0).count();
+}
+
+// peak resident set size of this process in KB
+static long PeakRSSKB(){
+	struct rusage Usage;
+	if(getrusage(RUSAGE_SELF, &Usage))
+		return -1;
+#ifdef __APPLE__
+	return Usage.ru_maxrss / 1024; // bytes there
+#else
+	return Usage.ru_maxrss;
+#endif
+}
+
+// cut Src into at most N pieces of about the same size, each one but the first
+// starting at a definition
+static std::vector<std::string> SplitAtDefs(const std::string &Src, unsigned N){
+	std::vector<std::string> Pieces;
+	size_t Begin = 0;
+	for(unsigned K = 1; K < N; ++K){
+		size_t Cut = Src.find("\ndef ", std::max(Begin, Src.size() * K / N));
+		if(Cut == std::string::npos)
+			break;
+		Pieces.push_back(Src.substr(Begin, Cut + 1 - Begin));
+		Begin = Cut + 1;
+	}
+	Pieces.push_back(Src.substr(Begin));
+	return Pieces;
+}
+
+// parse Src in N pieces at the same time, each on a thread with a Parser of its
+// own. a pre-scan of Src gives TheParser the operators every piece defines, the
+// parsers start with those (the pre-scan counts in parse_ms). the items come
+// out in source order
+static bool ParsePieces(const std::string &Src, unsigned N, std::vector<BatchItem> &Items,
+						std::vector<std::string> &ExprNames, json::Object &Result){
+	auto T0 = std::chrono::steady_clock::now();
+	Lexer Scan(MemoryBuffer::getMemBuffer(Src, "toy-bench"));
+	TheParser->scanOperators(Scan);
+	std::vector<std::string> Pieces = SplitAtDefs(Src, N);
+	std::vector<std::vector<BatchItem>> PieceItems(Pieces.size());
+	std::vector<std::vector<std::string>> PieceExprs(Pieces.size());
+	std::vector<char> Ok(Pieces.size());
+	auto ParsePiece = [&](size_t I, Parser &P){
+		P.setLexer(std::make_unique<Lexer>(MemoryBuffer::getMemBuffer(Pieces[I], "toy-bench")));
+		P.getNextToken();
+		Ok[I] = ParseBatchItems(P, PieceItems[I], PieceExprs[I],
+								"__bench_expr." + std::to_string(I) + ".");
+	};
+	std::vector<std::thread> Workers;
+	for(size_t I = 0; I < Pieces.size(); ++I)
+		Workers.emplace_back([&, I](){
+			Parser P;
+			P.copyOperators(*TheParser);
+			ParsePiece(I, P);
+		});
+	for(auto &T : Workers)
+		T.join();
+	Result["parse_ms"] = MillisSince(T0);
+
+	for(size_t I = 0; I < Pieces.size(); ++I){
+		if(!Ok[I])
+			return false;
+		for(auto &Item : PieceItems[I])
+			Items.push_back(std::move(Item));
+		ExprNames.insert(ExprNames.end(), PieceExprs[I].begin(), PieceExprs[I].end());
+	}
+	return true;
+}
+
+// what RunOne reports, every run has all of them
+static const char * const RunKeys[] = {
+	"startup_ms", "lex_ms", "tokens", "parse_ms", "irgen_ms", "ir_instructions", "optimize_ms",
+	"jit_ms", "compile_ms", "functions", "first_exec_ms", "checksum", "total_ms", "peak_rss_kb",
+};
+
+// the threads of one run, each stage has its own count
+struct ThreadConfig{
+	unsigned PFor = 1;			// the pfor pool
+	unsigned Parse = 1;			// parsers, each takes a piece of the input
+	unsigned Compile = 1;		// batch -j workers
+};
+
+// lex, parse, generate IR, optimize, JIT and run Src, the same steps as batch
+// mode (-batch -j Threads.Compile) with a clock around each. parsing lexes the
+// input again, the parser alone takes parse_ms - lex_ms. with more than one
+// parse thread the input is parsed in that many pieces at once. compile_ms is
+// IR generation, optimization and JIT codegen together: with more than one
+// compile thread they run on the batch -j workers and only compile_ms is timed,
+// irgen_ms, ir_instructions, optimize_ms and jit_ms are null
+static bool RunOne(const std::string &Src, const ThreadConfig &Threads, json::Object &Result){
+	for(const char *Key : RunKeys)
+		Result[Key] = nullptr;
+	using Clock = std::chrono::steady_clock;
+	auto Start = Clock::now();
+	pforconfig(Threads.PFor, 0, 0);
+
+	TheJIT = std::make_unique<KaleidoscopeJIT>();
+	InitializeModuleAndPassManager();
+	Result["startup_ms"] = MillisSince(Start);
+
+	// lex
+	TheParser = std::make_unique<Parser>(std::make_unique<Lexer>(MemoryBuffer::getMemBuffer(Src, "toy-bench")));
+	Lexer &Lex = TheParser->getLexer();
+	auto T0 = Clock::now();
+	size_t NumTokens = 0;
+	while(Lex.gettok() != tok_eof)
+		++NumTokens;
+	Result["lex_ms"] = MillisSince(T0);
+	Result["tokens"] = (int64_t)NumTokens;
+
+	// parse
+	std::vector<BatchItem> Items;
+	std::vector<std::string> ExprNames;
+	if(Threads.Parse > 1){
+		if(!ParsePieces(Src, Threads.Parse, Items, ExprNames, Result))
+			return false;
+	}else{
+		Lex.reset();
+		T0 = Clock::now();
+		TheParser->getNextToken();
+		if(!ParseBatchItems(*TheParser, Items, ExprNames, "__bench_expr."))
+			return false;
+		Result["parse_ms"] = MillisSince(T0);
+	}
+
+	auto TC = Clock::now();
+	std::vector<std::string> Defined;
+	if(Threads.Compile > 1){
+		// IR generation, optimization and codegen on the workers, one object each
+		for(auto &Item : Items)
+			if(Item.Fn)
+				Defined.push_back(Item.ExprName.empty() ? Item.Fn->getProto().getName()
+														: Item.ExprName);
+		if(!BatchCompileParallel(Items, Threads.Compile))
+			return false;
+	}else{
+		// IR generation, everything into one module
+		T0 = Clock::now();
+		if(!CodegenBatchItems(Items))
+			return false;
+		// the outlined pfor bodies are internal, the optimizer may inline or rename
+		// them, so only the functions the source defines are looked up
+		for(auto &F : *TheModule)
+			if(!F.isDeclaration() && !F.hasLocalLinkage())
+				Defined.push_back(F.getName().str());
+		Result["irgen_ms"] = MillisSince(T0);
+		size_t NumInsts = 0;
+		for(auto &F : *TheModule)
+			NumInsts += F.getInstructionCount();
+		Result["ir_instructions"] = (int64_t)NumInsts;
+
+		// optimize
+		T0 = Clock::now();
+		OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+		Result["optimize_ms"] = MillisSince(T0);
+
+		// JIT codegen
+		T0 = Clock::now();
+		TheJIT->addModule(std::move(TheModule));
+		InitializeModuleAndPassManager();
+	}
+	Result["functions"] = (int64_t)Defined.size();
+
+	// the addresses are looked up so everything is linked too
+	for(auto &Name : Defined){
+		auto Sym = TheJIT->findSymbol(Name);
+		if(!Sym || !Sym.getAddress())
+			return false;
+	}
+	if(Threads.Compile <= 1)
+		Result["jit_ms"] = MillisSince(T0);
+	Result["compile_ms"] = MillisSince(TC);
+
+	// first execution of the top-level expressions
+	T0 = Clock::now();
+	double Checksum = 0;
+	for(auto &Name : ExprNames){
+		double (*FP)() = (double (*)())(intptr_t)cantFail(TheJIT->findSymbol(Name).getAddress());
+		Checksum += FP();
+	}
+	Result["first_exec_ms"] = MillisSince(T0);
+	Result["checksum"] = Checksum;
+
+	Result["total_ms"] = MillisSince(Start);
+	Result["peak_rss_kb"] = (int64_t)PeakRSSKB();
+	return true;
+}
+
+// run Src in a child process and parse the JSON object it sends back
+static Optional<json::Value> RunInChild(const std::string &Src, const ThreadConfig &Threads){
+	int Pipe[2];
+	if(pipe(Pipe))
+		return None;
+	fflush(stdout);
+	fflush(stderr);
+	pid_t Pid = fork();
+	if(Pid < 0)
+		return None;
+	if(Pid == 0){
+		close(Pipe[0]);
+		json::Object Result;
+		bool Ok = RunOne(Src, Threads, Result);
+		Result["ok"] = Ok;
+		std::string Out;
+		raw_string_ostream OS(Out);
+		OS << json::Value(std::move(Result));
+		OS.flush();
+		for(size_t Done = 0; Done < Out.size(); ){
+			ssize_t N = write(Pipe[1], Out.data() + Done, Out.size() - Done);
+			if(N <= 0)
+				_exit(1);
+			Done += N;
+		}
+		_exit(Ok ? 0 : 1);
+	}
+
+	close(Pipe[1]);
+	std::string In;
+	char Buf[4096];
+	ssize_t N;
+	while((N = read(Pipe[0], Buf, sizeof(Buf))) > 0)
+		In.append(Buf, N);
+	close(Pipe[0]);
+	int Status;
+	waitpid(Pid, &Status, 0);
+
+	auto V = json::parse(In);
+	if(!V){
+		consumeError(V.takeError());
+		fprintf(stderr, "Error: the run crashed or wrote no report\n");
+		return None;
+	}
+	return std::move(*V);
+}
+
+
+int main(int argc, char **argv){
+	cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope frontend benchmark\n");
+
+	if(OptLevel < '0' || OptLevel > '3'){
+		fprintf(stderr, "Error: invalid optimization level -O%c\n", (char)OptLevel);
+		return 1;
+	}
+
+	std::vector<BenchShape> Runs;
+	if(Shapes.empty())
+		Shapes.push_back("all");
+	for(auto &Name : Shapes){
+		if(Name == "all"){
+			Runs.insert(Runs.end(), {Shape_Functions, Shape_Expressions, Shape_Loops, Shape_Mixed});
+			continue;
+		}
+		auto It = std::find(std::begin(ShapeNames), std::end(ShapeNames), Name);
+		if(It == std::end(ShapeNames)){
+			fprintf(stderr, "Error: unknown shape %s\n", Name.c_str());
+			return 1;
+		}
+		Runs.push_back((BenchShape)(It - std::begin(ShapeNames)));
+	}
+	if(Sizes.empty()){
+		Sizes.push_back(100);
+		Sizes.push_back(1000);
+	}
+	for(auto *Counts : {&PForThreads, &ParseThreads, &CompileThreads})
+		if(Counts->empty())
+			Counts->push_back(1);
+	std::vector<ThreadConfig> Configs;
+	for(unsigned PFor : PForThreads)
+		for(unsigned Parse : ParseThreads)
+			for(unsigned Compile : CompileThreads)
+				Configs.push_back({PFor, Parse, Compile});
+
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	InitializeNativeTargetAsmParser();
+
+	ProgramGenerator Gen(Seed);
+	if(!EmitSource.empty()){
+		std::error_code EC;
+		raw_fd_ostream OS(EmitSource, EC, sys::fs::OF_Text);
+		if(EC){
+			fprintf(stderr, "Error: can't write %s: %s\n", EmitSource.c_str(), EC.message().c_str());
+			return 1;
+		}
+		OS << Gen.generate(Runs[0], Sizes[0]);
+		return 0;
+	}
+
+	json::Array Results;
+	bool HadError = false;
+	for(BenchShape Shape : Runs){
+		for(unsigned Size : Sizes){
+			std::string Src = Gen.generate(Shape, Size);
+			for(const ThreadConfig &Threads : Configs)
+			for(unsigned R = 0; R < Repeat; ++R){
+				auto Result = RunInChild(Src, Threads);
+				if(!Result){
+					HadError = true;
+					continue;
+				}
+				json::Object &Obj = *Result->getAsObject();
+				Obj["shape"] = ShapeNames[Shape];
+				Obj["size"] = (int64_t)Size;
+				Obj["pfor_threads"] = (int64_t)Threads.PFor;
+				Obj["parse_threads"] = (int64_t)Threads.Parse;
+				Obj["compile_threads"] = (int64_t)Threads.Compile;
+				Obj["repeat"] = (int64_t)R;
+				Obj["source_bytes"] = (int64_t)Src.size();
+				Obj["top_level_exprs"] = (int64_t)Gen.getNumTopLevelExprs();
+				if(!Obj.getBoolean("ok").getValueOr(false))
+					HadError = true;
+				fprintf(stderr, "%-11s size %5u, threads pfor %2u parse %2u compile %2u: total %8.1f ms, "
+						"compile %8.1f ms, first exec %8.1f ms, peak RSS %ld KB\n", ShapeNames[Shape], Size,
+						Threads.PFor, Threads.Parse, Threads.Compile,
+						Obj.getNumber("total_ms").getValueOr(0),
+						Obj.getNumber("compile_ms").getValueOr(0),
+						Obj.getNumber("first_exec_ms").getValueOr(0),
+						(long)Obj.getInteger("peak_rss_kb").getValueOr(0));
+				Results.push_back(std::move(*Result));
+			}
+		}
+	}
+
+	std::error_code EC;
+	raw_fd_ostream OS(OutputFilename, EC, sys::fs::OF_Text);
+	if(EC){
+		fprintf(stderr, "Error: can't write %s: %s\n", OutputFilename.c_str(), EC.message().c_str());
+		return 1;
+	}
+	json::Object Report{
+		{"benchmark", "toy-bench"},
+		{"llvm_version", LLVM_VERSION_STRING},
+		{"opt_level", std::string(1, (char)OptLevel)},
+		{"fast_math", (bool)FastMath},
+		{"depth", (int64_t)Depth},
+		{"seed", (int64_t)Seed},
+		{"cpus", (int64_t)std::thread::hardware_concurrency()},
+		{"runs", std::move(Results)},
+	};
+	OS << formatv("{0:2}", json::Value(std::move(Report))) << "\n";
+	return HadError;
+}
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Server.hpp"
+
+using namespace llvm;
+
+// toy-client: talks to a compile server (toy -serve=<socket>)
+//
+//   toy-client -socket=/tmp/toy.sock lib.k -e='fib(20);'
+//   toy-client -socket=/tmp/toy.sock -load-test -clients=8 -requests=1000 -setup=lib.k -e='fib(20);'
+//
+// every input is one request of one session, the responses go to stdout. the
+// load test runs -clients sessions at once, each sends its -setup once and then
+// the inputs -requests times, and reports requests per second and latencies
+
+
+static cl::opt<std::string>
+SocketPath("socket", cl::desc("Unix domain socket of the server"),
+		   cl::value_desc("path"), cl::init("/tmp/toy.sock"));
+
+static cl::list<std::string>
+InputFiles(cl::Positional, cl::desc("<input files, '-' for stdin>"), cl::ZeroOrMore);
+
+static cl::list<std::string>
+Snippets("e", cl::desc("Send <source> as a request, after the input files"),
+		 cl::value_desc("source"), cl::ZeroOrMore);
+
+static cl::opt<bool>
+LoadTest("load-test", cl::desc("Measure requests per second instead of printing responses"),
+		 cl::init(false));
+
+static cl::opt<unsigned>
+Clients("clients", cl::desc("Concurrent sessions of the load test"), cl::init(4));
+
+static cl::opt<unsigned>
+Requests("requests", cl::desc("Requests per session of the load test"), cl::init(100));
+
+static cl::opt<std::string>
+SetupFile("setup", cl::desc("Source each load test session sends once before it is timed"),
+		  cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool>
+Reconnect("reconnect", cl::desc("Open a new session for every load test request"),
+		  cl::init(false));
+
+
+static bool ReadInput(const std::string &Name, std::string &Source){
+	auto Buf = MemoryBuffer::getFileOrSTDIN(Name);
+	if(!Buf){
+		fprintf(stderr, "Error: can't read %s: %s\n", Name.c_str(), Buf.getError().message().c_str());
+		return false;
+	}
+	Source = (*Buf)->getBuffer().str();
+	return true;
+}
+
+// a request and its response on Fd, false when the session is gone
+static bool RoundTrip(int Fd, const std::string &Request, std::string &Response){
+	return WriteFrame(Fd, Request) && ReadFrame(Fd, Response);
+}
+
+static int Connect(){
+	int Fd = ConnectToServer(SocketPath);
+	if(Fd < 0)
+		fprintf(stderr, "Error: can't connect to %s: %s\n", SocketPath.c_str(), strerror(errno));
+	return Fd;
+}
+
+
+struct SessionResult{
+	std::vector<double> LatenciesUs;
+	unsigned Failed = 0;
+	unsigned Diagnostics = 0;	// responses with an error message
+};
+
+static void RunLoadSession(const std::string &Setup, const std::vector<std::string> &Inputs,
+						   SessionResult &R){
+	using Clock = std::chrono::steady_clock;
+	std::string Response;
+	int Fd = -1;
+
+	for(unsigned I = 0; I != Requests; ++I){
+		for(const std::string &Input : Inputs){
+			auto T0 = Clock::now();
+			// a new session pays for the fork and the setup, both are timed
+			if(Fd < 0){
+				Fd = Connect();
+				if(Fd < 0 || (!Setup.empty() && !RoundTrip(Fd, Setup, Response))){
+					++R.Failed;
+					if(Fd >= 0)
+						close(Fd);
+					Fd = -1;
+					continue;
+				}
+			}
+			if(!RoundTrip(Fd, Input, Response)){
+				++R.Failed;
+				close(Fd);
+				Fd = -1;
+				continue;
+			}
+			R.LatenciesUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - T0).count());
+			if(Response.find("Error") != std::string::npos)
+				++R.Diagnostics;
+			if(Reconnect){
+				close(Fd);
+				Fd = -1;
+			}
+		}
+	}
+	if(Fd >= 0)
+		close(Fd);
+}
+
+static int RunLoadTest(const std::vector<std::string> &Inputs){
+	std::string Setup;
+	if(!SetupFile.empty() && !ReadInput(SetupFile, Setup))
+		return 1;
+
+	std::vector<SessionResult> Results(std::max(1u, (unsigned)Clients));
+	std::vector<std::thread> Threads;
+	auto T0 = std::chrono::steady_clock::now();
+	for(SessionResult &R : Results)
+		Threads.emplace_back(RunLoadSession, std::cref(Setup), std::cref(Inputs), std::ref(R));
+	for(std::thread &T : Threads)
+		T.join();
+	double Sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - T0).count();
+
+	std::vector<double> All;
+	unsigned Failed = 0, Diagnostics = 0;
+	for(SessionResult &R : Results){
+		All.insert(All.end(), R.LatenciesUs.begin(), R.LatenciesUs.end());
+		Failed += R.Failed;
+		Diagnostics += R.Diagnostics;
+	}
+	std::sort(All.begin(), All.end());
+	double Sum = 0;
+	for(double Us : All)
+		Sum += Us;
+
+	printf("%u sessions%s, %zu requests in %.3f s: %.1f requests/s\n", (unsigned)Results.size(),
+		   Reconnect ? " (one per request)" : "", All.size(), Sec, All.size() / Sec);
+	if(!All.empty())
+		printf("latency: mean %.1f us, median %.1f us, p99 %.1f us, max %.1f us\n", Sum / All.size(),
+			   All[All.size() / 2], All[All.size() * 99 / 100], All.back());
+	printf("failed %u, with diagnostics %u\n", Failed, Diagnostics);
+	return Failed != 0;
+}
+
+
+int main(int argc, char **argv){
+	cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compile server client\n");
+	// a session whose server died fails its write with EPIPE, the load test
+	// counts it instead of being killed
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<std::string> Inputs;
+	for(const std::string &Name : InputFiles){
+		Inputs.emplace_back();
+		if(!ReadInput(Name, Inputs.back()))
+			return 1;
+	}
+	for(const std::string &Source : Snippets)
+		Inputs.push_back(Source);
+	if(Inputs.empty()){
+		Inputs.emplace_back();
+		if(!ReadInput("-", Inputs.back()))
+			return 1;
+	}
+
+	if(LoadTest)
+		return RunLoadTest(Inputs);
+
+	int Fd = Connect();
+	if(Fd < 0)
+		return 1;
+	std::string Response;
+	for(const std::string &Input : Inputs){
+		if(!RoundTrip(Fd, Input, Response)){
+			fprintf(stderr, "Error: the session ended\n");
+			return 1;
+		}
+		fwrite(Response.data(), 1, Response.size(), stdout);
+	}
+	close(Fd);
+	return 0;
+}
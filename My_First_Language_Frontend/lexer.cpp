@@ -1,15 +1,151 @@
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "lexer.hpp"
 
-static int gettok(){
-	static int LastChar = ' ';
+SymbolTable Symbols;
+
+// set NumVal / NumIsInt / IntNumVal from the text of a number token
+void Lexer::setNumVal(const char *NumStr){
+	NumVal = strtod(NumStr, 0);
+	NumIsInt = !strchr(NumStr, '.');
+	if(NumIsInt){
+		errno = 0;
+		IntNumVal = strtoll(NumStr, 0, 10);
+		// too big for an int, keep it as a double
+		if(errno == ERANGE)
+			NumIsInt = false;
+	}
+}
+
+std::unique_ptr<Lexer> Lexer::fromFile(const std::string &FileName){
+	// MemoryBuffer mmaps large files and reads small ones / stdin into memory,
+	// the buffer is always null terminated
+	auto BufOrErr = llvm::MemoryBuffer::getFileOrSTDIN(FileName);
+	if(!BufOrErr){
+		fprintf(stderr, "Error: can't read %s: %s\n", FileName.c_str(),
+				BufOrErr.getError().message().c_str());
+		return nullptr;
+	}
+	return std::make_unique<Lexer>(std::move(*BufOrErr));
+}
+
+Lexer::Lexer(std::unique_ptr<llvm::MemoryBuffer> Buf) : Buffer(std::move(Buf)){
+	BufCur = Buffer->getBufferStart();
+	BufEnd = Buffer->getBufferEnd();
+}
+
+void Lexer::reset(){
+	if(Buffer)
+		BufCur = Buffer->getBufferStart();
+}
+
+Symbol Lexer::intern(llvm::StringRef Name){
+	auto R = Seen.try_emplace(Name, 0);
+	if(R.second)
+		R.first->second = Symbols.intern(Name);
+	return R.first->second;
+}
+
+// perfect hash for the keywords, (5 * s[0] + 3 * s[1] + 3 * len) & 15
+// gives every keyword its own slot, so one memcmp decides
+struct KeywordEntry{
+	const char *Name;
+	int Tok;
+};
+
+static const KeywordEntry KeywordTable[16] = {
+	{nullptr, 0},		{nullptr, 0},		{"unary", tok_unary},	{"extern", tok_extern},
+	{"for", tok_for},	{"if", tok_if},		{nullptr, 0},		{"binary", tok_binary},
+	{"then", tok_then},	{"else", tok_else},	{"var", tok_var},	{nullptr, 0},
+	{"def", tok_def},	{"in", tok_in},		{"pfor", tok_pfor},	{nullptr, 0},
+};
+
+static int lookupKeyword(const char *S, size_t Len){
+	// keywords are 2..6 chars long
+	if(Len < 2 || Len > 6)
+		return tok_identifier;
+
+	unsigned H = ((unsigned char)S[0] * 5 + (unsigned char)S[1] * 3 + Len * 3) & 15;
+	const KeywordEntry &E = KeywordTable[H];
+	if(E.Name && strlen(E.Name) == Len && memcmp(E.Name, S, Len) == 0)
+		return E.Tok;
+	return tok_identifier;
+}
+
+// gettok for the buffered mode, same grammar as the getchar() path below
+// but works on a pointer into the buffer and never copies identifiers
+int Lexer::gettokBuffered(){
+	const char *Cur = BufCur;
+
+	while(1){
+		// skip whitespace
+		while(Cur != BufEnd && isspace((unsigned char)*Cur))
+			++Cur;
+
+		// Commmets, skip to end of line and try again
+		if(Cur != BufEnd && *Cur == '#'){
+			while(Cur != BufEnd && *Cur != '\n' && *Cur != '\r')
+				++Cur;
+			continue;
+		}
+		break;
+	}
+
+	if(Cur == BufEnd){
+		BufCur = Cur;
+		return tok_eof;
+	}
+
+	const char *TokStart = Cur;
+	CurSpan.Offset = TokStart - Buffer->getBufferStart();
+
+	// Identifier: [a-zA-Z][a-zA-Z0-9]*
+	if(isalpha((unsigned char)*Cur)){
+		while(++Cur != BufEnd && isalnum((unsigned char)*Cur))
+			;
+		CurSpan.Length = Cur - TokStart;
+		BufCur = Cur;
+		int Tok = lookupKeyword(TokStart, CurSpan.Length);
+		if(Tok == tok_identifier)
+			IdentifierSym = intern(llvm::StringRef(TokStart, CurSpan.Length));
+		return Tok;
+	}
+
+	// Number[0-9.]+
+	if(isdigit((unsigned char)*Cur) || *Cur == '.'){
+		while(++Cur != BufEnd && (isdigit((unsigned char)*Cur) || *Cur == '.'))
+			;
+		CurSpan.Length = Cur - TokStart;
+		BufCur = Cur;
+
+		// strtod directly on the buffer would also accept "1e5", "0x10" ...
+		// so convert a copy of the span, like the getchar() path does
+		// usual literals fit inline, a longer one goes to the heap whole
+		llvm::SmallString<64> NumStr(llvm::StringRef(TokStart, CurSpan.Length));
+		setNumVal(NumStr.c_str());
+		return tok_number;
+	}
+
+	// return ascii value.
+	CurSpan.Length = 1;
+	BufCur = Cur + 1;
+	return (unsigned char)*Cur;
+}
+
+int Lexer::gettok(){
+	if(Buffer)
+		return gettokBuffered();
 
 	// skip whitespace
 	while(isspace(LastChar))
@@ -41,6 +177,9 @@ static int gettok(){
 			return tok_unary;
 		if(IdentifierStr == "var")
 			return tok_var;
+		if(IdentifierStr == "pfor")
+			return tok_pfor;
+		IdentifierSym = intern(IdentifierStr);
 		return tok_identifier;
 	}
 
@@ -53,7 +192,7 @@ static int gettok(){
 		}while(isdigit(LastChar) || LastChar == '.');
 
 		// TODO: add check for 1.12.12. 
-		NumVal = strtod(NumStr.c_str(), 0);
+		setNumVal(NumStr.c_str());
 		return	tok_number;
 	}
 
@@ -1,6 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "Symbol.hpp"
 enum Token
 {
 	tok_eof = -1,
@@ -26,8 +33,75 @@ enum Token
 
 	// var definition
 	tok_var = -13,
+
+	// parallel for
+	tok_pfor = -14,
+};
+
+// (offset, length) of the current token inside the source buffer,
+// only valid when the lexer reads from a buffer
+struct TokenSpan{
+	size_t Offset;
+	size_t Length;
 };
 
-// save current string / number
-static std::string IdentifierStr; 
-static double NumVal;
\ No newline at end of file
+// Lexer, turns one source into tokens. everything it knows about the current
+// token is its own, so lexers of different sources can run on different threads
+// it reads a whole buffer (a mapped file) or, without one, getchar() from stdin
+// as the REPL always did. only one lexer may read stdin
+class Lexer{
+	// source buffer, null when lexing from getchar()
+	std::unique_ptr<llvm::MemoryBuffer> Buffer;
+	const char * BufCur = nullptr;
+	const char * BufEnd = nullptr;
+	int LastChar = ' ';				// getchar() path, the char after the token
+
+	// the current token
+	std::string IdentifierStr;		// getchar() path only
+	Symbol IdentifierSym = 0;		// interned name of the current identifier
+	double NumVal = 0;
+	// a literal without '.' that fits in 64 bits is an int, NumVal holds it too
+	bool NumIsInt = false;
+	int64_t IntNumVal = 0;
+	TokenSpan CurSpan = {0, 0};
+
+	// the symbols of the names this lexer has seen, so it doesn't go to the
+	// shared table (and its lock) for every identifier
+	llvm::StringMap<Symbol> Seen;
+
+	void setNumVal(const char * NumStr);
+	int gettokBuffered();
+
+public:
+	// lex stdin with getchar()
+	Lexer() = default;
+	// lex from Buf, which must be null terminated
+	explicit Lexer(std::unique_ptr<llvm::MemoryBuffer> Buf);
+
+	// map (or read) the whole file into memory and lex from it, "-" means stdin
+	// returns null (and says why) if the file can't be read
+	static std::unique_ptr<Lexer> fromFile(const std::string & FileName);
+
+	int gettok();
+
+	// rewind a buffer lexer to the start of its buffer
+	void reset();
+
+	// the symbol of Name, through the names this lexer has seen
+	Symbol intern(llvm::StringRef Name);
+
+	Symbol getIdentifierSym() const { return IdentifierSym; }
+	double getNumVal() const { return NumVal; }
+	bool isIntNum() const { return NumIsInt; }
+	int64_t getIntNumVal() const { return IntNumVal; }
+	const TokenSpan & getSpan() const { return CurSpan; }
+	size_t getBufferSize() const { return Buffer ? Buffer->getBufferSize() : 0; }
+
+	// name of the current identifier token, points into the source buffer
+	// when there is one, so the caller must copy it if it needs to keep it
+	llvm::StringRef getIdentifierStr() const{
+		if(Buffer)
+			return llvm::StringRef(Buffer->getBufferStart() + CurSpan.Offset, CurSpan.Length);
+		return IdentifierStr;
+	}
+};
@@ -0,0 +1,38 @@
+#!/bin/sh
+# regressions of the interpreter against the JIT: every tests/*.k runs JIT-only
+# (-tier-threshold=0) and interpreted (-tier-threshold=1000), with its pfor
+# loops deterministic on 1, 2 and 4 threads, and every run has to print the
+# values of tests/<name>.expected
+#   tests/run.sh ./build/toy
+# with -update it writes the .expected files from the JIT-only run on 1 thread
+TOY=${1:?usage: run.sh path/to/toy [-update]}
+DIR=$(dirname "$0")
+Fail=0
+
+# the values and the errors of a run, without the prompts and the IR
+run(){
+	"$TOY" -tier-threshold=$1 -pfor-deterministic -pfor-threads=$2 "$3" 2>&1 </dev/null |
+		grep -o 'Evaluated to .*\|Error: .*'
+}
+
+if [ "$2" = -update ]; then
+	for K in "$DIR"/*.k; do
+		run 0 1 "$K" > "${K%.k}.expected"
+	done
+	exit 0
+fi
+
+for K in "$DIR"/*.k; do
+	Expected="${K%.k}.expected"
+	for Tier in 0 1000; do
+		for Threads in 1 2 4; do
+			if ! run $Tier $Threads "$K" | diff -u "$Expected" - > /dev/null; then
+				echo "FAIL: $K -tier-threshold=$Tier -pfor-threads=$Threads"
+				run $Tier $Threads "$K" | diff -u "$Expected" -
+				Fail=1
+			fi
+		done
+	done
+done
+[ $Fail = 0 ] && echo "all regressions passed"
+exit $Fail
@@ -1,60 +1,572 @@
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <map>
 #include <memory>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
-#include "Paser.cpp"
 //#include "KaleidoscopeJIT.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Async.hpp"
+#include "IR.hpp"
+#include "Interp.hpp"
+#include "Memo.hpp"
+#include "Multiversion.hpp"
+#include "ObjectCache.hpp"
+#include "Paser.hpp"
+#include "Profile.hpp"
+#include "Runtime.hpp"
+#include "Server.hpp"
+#include "Trace.hpp"
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
+using namespace llvm;
+using namespace llvm::orc;
+
+
+static cl::opt<std::string>
+InputFilename(cl::Positional, cl::desc("<input file>"), cl::init("-"));
+
+static cl::list<std::string>
+ExtraInputs(cl::Positional, cl::ZeroOrMore,
+			cl::desc("<more input files>: parse them concurrently, with the operators the "
+					 "first file defines, and compile all files into one module like -batch"));
+
+static cl::opt<unsigned>
+ParseThreads("parse-threads",
+			 cl::desc("Threads that parse the input files when there are several (0: one per CPU)"),
+			 cl::init(0));
+
+static cl::opt<bool>
+BufferedLexer("buffered-lexer",
+			  cl::desc("Map the whole input into memory and lex from the buffer"),
+			  cl::init(false));
+
+static cl::opt<bool>
+LexBench("lex-bench",
+		 cl::desc("Measure lexer throughput (MB/s) of the getchar and buffered paths, then exit"),
+		 cl::init(false));
+
+static cl::opt<bool>
+Batch("batch",
+	  cl::desc("Parse the whole input, compile it as one module and run the top-level "
+			   "expressions in order"),
+	  cl::init(false));
+
+static cl::opt<unsigned>
+Threads("j",
+		cl::desc("Number of codegen worker threads in batch mode"),
+		cl::init(1));
+
+static cl::opt<bool>
+CompareRepl("compare-repl",
+			cl::desc("With -batch, run the input again through the REPL path and report "
+					 "the speedup (top-level expressions are evaluated twice)"),
+			cl::init(false));
+
+static cl::opt<std::string>
+ObjectCacheDir("object-cache",
+			   cl::desc("Directory of the persistent object cache, reuse compiled objects "
+						"across runs"),
+			   cl::value_desc("dir"));
+
+static cl::opt<unsigned>
+ObjectCacheSizeMB("object-cache-size",
+				  cl::desc("Disk budget of the object cache in MB, the least recently used "
+						   "objects are evicted beyond it (0: no limit)"),
+				  cl::value_desc("MB"), cl::init(64));
+
+static cl::opt<unsigned>
+ArrayBench("array-bench",
+		   cl::desc("Time the dot product and saxpy kernels written in Kaleidoscope against "
+					"the same loops in C, on arrays of N doubles, then exit"),
+		   cl::value_desc("N"), cl::init(0));
+
+static cl::opt<std::string>
+AOTOutput("aot",
+		  cl::desc("Compile the input ahead of time instead of running it: into an executable, "
+				   "or only into an object file if <file> ends in .o"),
+		  cl::value_desc("file"));
+
+static cl::opt<bool>
+LTO("lto",
+	cl::desc("With -aot, optimize the whole program with the link time pipeline, every "
+			 "function but main is internal"),
+	cl::init(false));
+
+// the build passes the path of toyrt, see CMakeLists.txt
+#ifndef TOY_RUNTIME_LIB
+#define TOY_RUNTIME_LIB ""
 #endif
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+static cl::opt<std::string>
+RuntimeLib("runtime-lib",
+		   cl::desc("Static runtime library (toyrt) that -aot executables are linked with"),
+		   cl::value_desc("path"), cl::init(TOY_RUNTIME_LIB));
+
+static cl::opt<std::string>
+Linker("linker",
+	   cl::desc("C compiler driver that links -aot executables"),
+	   cl::init("cc"));
+
+static cl::opt<bool>
+JITSlabPool("jit-slab-pool",
+			cl::desc("Pack the code and data of all JIT modules into shared slabs, reused "
+					 "when a module is removed, instead of mapping pages per module"),
+			cl::init(true));
+
+static cl::opt<bool>
+JITMemoryStats("jit-memory-stats",
+			   cl::desc("Report the memory of the JIT'd code at exit"),
+			   cl::init(false));
+
+// the pfor runtime, see Runtime.cpp. without any of these it goes by the
+// TOY_PFOR_* environment variables, like executables compiled with -aot
+static cl::opt<unsigned>
+PForThreads("pfor-threads",
+			cl::desc("Threads that run the iterations of a pfor (0: one per CPU)"),
+			cl::init(0));
+
+static cl::opt<unsigned>
+PForChunk("pfor-chunk",
+		  cl::desc("Iterations of a pfor per chunk, the unit of work stealing (0: automatic)"),
+		  cl::init(0));
+
+static cl::opt<bool>
+PForDeterministic("pfor-deterministic",
+				  cl::desc("Cut pfor loops into chunks by their length only and reduce them in order, "
+						   "so a reduction has the same value for any number of threads"),
+				  cl::init(false));
+
+static std::unique_ptr<KaleidoscopeObjectCache> TheObjectCache;
+
+// process wide numbers, to compare the pool with a memory manager per module
+static void PrintProcessMemory(){
+	unsigned Maps = 0;
+	if(FILE * F = fopen("/proc/self/maps", "r")){
+		for(int C; (C = fgetc(F)) != EOF;)
+			Maps += C == '\n';
+		fclose(F);
+	}
+	long Pages = 0, Resident = 0;
+	if(FILE * F = fopen("/proc/self/statm", "r")){
+		if(fscanf(F, "%ld %ld", &Pages, &Resident) != 2)
+			Resident = 0;
+		fclose(F);
+	}
+	fprintf(stderr, "process: %u mappings, %ld KiB resident\n", Maps,
+			Resident * (long)sys::Process::getPageSizeEstimate() / 1024);
+}
+
+static void PrintJITMemoryStats(){
+#ifdef __linux__
+	if(SlabPool * Pool = TheJIT ? TheJIT->getMemoryPool() : nullptr){
+		SlabPool::Stats St = Pool->getStats();
+		fprintf(stderr, "jit memory: %llu KiB allocated, %llu KiB reused, %llu KiB in use, "
+				"%llu KiB mapped in %u mappings, %llu KiB wasted (%llu KiB free)\n",
+				(unsigned long long)St.BytesAllocated / 1024, (unsigned long long)St.BytesReused / 1024,
+				(unsigned long long)St.BytesInUse / 1024, (unsigned long long)St.BytesMapped / 1024,
+				St.Mappings, (unsigned long long)St.BytesWasted / 1024,
+				(unsigned long long)St.BytesFree / 1024);
+	}
+#endif
+	PrintProcessMemory();
+}
+
+
+// everything the driver reports when it is done
+static void PrintExitStats(){
+	if(TheObjectCache)
+		TheObjectCache->printStats(Batch && Threads > 1);
+	if(TierThreshold)
+		PrintTierStats();
+	PrintReplStats();
+	PrintProfileStats();
+	PrintMemoStats();
+	PrintPassTimings();
+	if(JITMemoryStats)
+		PrintJITMemoryStats();
+	PrintTraceStats();
+	WriteProfile();
+	WriteTrace();
+}
+
+
+// lex the whole input with both lexer paths and report MB/s
+static int RunLexerBenchmark(){
+	if(InputFilename == "-"){
+		fprintf(stderr, "Error: -lex-bench needs an input file\n");
+		return 1;
+	}
+
+	using Clock = std::chrono::steady_clock;
+
+	// getchar() path
+	if(!freopen(InputFilename.c_str(), "r", stdin)){
+		fprintf(stderr, "Error: can't open %s\n", InputFilename.c_str());
+		return 1;
+	}
+	size_t CharToks = 0;
+	auto T0 = Clock::now();
+	Lexer CharLex;
+	while(CharLex.gettok() != tok_eof)
+		++CharToks;
+	double CharSec = std::chrono::duration<double>(Clock::now() - T0).count();
+
+	// buffered path, loading the file is part of the measured time
+	T0 = Clock::now();
+	std::unique_ptr<Lexer> BufLex = Lexer::fromFile(InputFilename);
+	if(!BufLex)
+		return 1;
+	size_t BufToks = 0;
+	while(BufLex->gettok() != tok_eof)
+		++BufToks;
+	double BufSec = std::chrono::duration<double>(Clock::now() - T0).count();
+
+	double MB = BufLex->getBufferSize() / (1024.0 * 1024.0);
+	fprintf(stderr, "input: %.2f MB\n", MB);
+	fprintf(stderr, "getchar:  %zu tokens, %.3f s, %.1f MB/s\n", CharToks, CharSec, MB / CharSec);
+	fprintf(stderr, "buffered: %zu tokens, %.3f s, %.1f MB/s\n", BufToks, BufSec, MB / BufSec);
+	if(CharToks != BufToks)
+		fprintf(stderr, "Warning: token count mismatch\n");
+	return 0;
+}
+
+
+// the kernels of -array-bench. a for loop tests its end condition before the
+// increment, so 'i < n - 1' runs the body for i = 0 .. n-1
+static const char ArrayBenchSource[] =
+	"def binary : 1 (x y) y;\n"
+	"def dot(x:array y:array n:int)\n"
+	"  var s = 0 in (for i = 0, i < n - 1 in s = s + x[i] * y[i]) : s;\n"
+	"def saxpy(a y:array x:array n:int)\n"
+	"  for i = 0, i < n - 1 in y[i] = a * x[i] + y[i];\n";
+
+// the same loops in C, __restrict matches the noalias of array arguments
+static double CDot(const double * __restrict X, const double * __restrict Y, int64_t N){
+	double S = 0;
+	for(int64_t i = 0; i < N; ++i)
+		S = S + X[i] * Y[i];
+	return S;
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
+static double CSaxpy(double A, double * __restrict Y, const double * __restrict X, int64_t N){
+	for(int64_t i = 0; i < N; ++i)
+		Y[i] = A * X[i] + Y[i];
+	return 0;
+}
+
+static bool HasVectorCode(const Function &F){
+	for(auto &BB : F)
+		for(auto &I : BB)
+			if(I.getType()->isVectorTy())
+				return true;
+	return false;
+}
+
+// ahead of time compilation, in the style of chapter 8
+// main of an -aot executable: run the top-level expressions in source order and
+// print each result the way the REPL does
+static void EmitMain(ArrayRef<std::string> ExprNames){
+	Type * DoubleTy = Type::getDoubleTy(*TheContext);
+	Function * PrintResult = Function::Create(
+		FunctionType::get(Type::getVoidTy(*TheContext), {DoubleTy}, false),
+		Function::ExternalLinkage, "printresult", TheModule.get());
+	Function * Main = Function::Create(FunctionType::get(Type::getInt32Ty(*TheContext), false),
+									   Function::ExternalLinkage, "main", TheModule.get());
+
+	Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Main));
+	for(auto &Name : ExprNames)
+		Builder->CreateCall(PrintResult,
+							Builder->CreateCall(TheModule->getFunction(Name), {}, "result"));
+	Builder->CreateRet(Builder->getInt32(0));
+	verifyFunction(*Main);
 }
 
+// link Obj with the runtime into the executable Exe, through the C compiler driver
+static bool LinkExecutable(StringRef Obj, StringRef Exe){
+	if(RuntimeLib.empty()){
+		fprintf(stderr, "Error: no runtime library, pass -runtime-lib=<path of libtoyrt.a>\n");
+		return false;
+	}
+	auto Program = sys::findProgramByName(Linker);
+	if(!Program){
+		fprintf(stderr, "Error: can't find the linker %s\n", Linker.c_str());
+		return false;
+	}
+
+	StringRef Args[] = {*Program, Obj, RuntimeLib, "-lm", "-lpthread", "-o", Exe};
+	std::string ErrMsg;
+	if(sys::ExecuteAndWait(*Program, Args, None, {}, 0, 0, &ErrMsg)){
+		fprintf(stderr, "Error: linking %s failed %s\n", Exe.str().c_str(), ErrMsg.c_str());
+		return false;
+	}
+	return true;
+}
+
+// compile the whole input into one module, like batch mode, add a main and
+// write it out as an object file for the host. the executable needs no JIT
+// at run time, so it starts as fast as any other program
+static int CompileAOT(){
+	std::vector<BatchItem> Items;
+	std::vector<std::string> ExprNames;
+	if(!ParseBatchItems(*TheParser, Items, ExprNames, "__toplevel.") || !CodegenBatchItems(Items))
+		return 1;
+	EmitMain(ExprNames);
+
+	// position independent code, the system linker makes PIEs by default
+	// EngineBuilder picks the large code model of a JIT unless told, the linker
+	// can't resolve its GOT64 relocations against an ifunc
+	// with -multiversion the code outside the versions runs on any CPU
+	std::unique_ptr<TargetMachine> TM(selectHostTarget(HostCPU && !Multiversion, Reloc::PIC_,
+													   CodeModel::Small));
+	TheModule->setTargetTriple(TM->getTargetTriple().str());
+	TheModule->setDataLayout(TM->createDataLayout());
+
+	// with the whole program in one module nothing but main is called from
+	// outside: internal functions can be inlined everywhere and dropped after
+	if(LTO)
+		for(auto &F : *TheModule)
+			if(!F.isDeclaration() && F.getName() != "main")
+				F.setLinkage(GlobalValue::InternalLinkage);
+	MultiversionModule(*TheModule);
+	OptimizeModule(*TheModule, TM.get(), LTO);
+
+	bool ObjectOnly = StringRef(AOTOutput).endswith(".o");
+	SmallString<128> ObjPath(AOTOutput);
+	if(!ObjectOnly){
+		if(std::error_code EC = sys::fs::createTemporaryFile("toy", "o", ObjPath)){
+			fprintf(stderr, "Error: can't create a temporary file: %s\n", EC.message().c_str());
+			return 1;
+		}
+	}
+
+	{
+		std::error_code EC;
+		raw_fd_ostream Dest(ObjPath, EC, sys::fs::OF_None);
+		if(EC){
+			fprintf(stderr, "Error: can't write %s: %s\n", ObjPath.c_str(), EC.message().c_str());
+			return 1;
+		}
+		legacy::PassManager Pass;
+		if(TM->addPassesToEmitFile(Pass, Dest, nullptr, CGFT_ObjectFile)){
+			fprintf(stderr, "Error: the target can't emit an object file\n");
+			return 1;
+		}
+		Pass.run(*TheModule);
+	}
+
+	bool Ok = ObjectOnly || LinkExecutable(ObjPath, AOTOutput);
+	if(!ObjectOnly)
+		sys::fs::remove(ObjPath);
+	if(Ok && Multiversion)
+		fprintf(stderr, "%u functions multiversioned\n", NumMultiversioned);
+	if(Ok)
+		fprintf(stderr, "Wrote %s\n", AOTOutput.c_str());
+	return !Ok;
+}
+
+
+// JIT the kernels, run both versions and report the time per call
+static int RunArrayBenchmark(){
+	int64_t N = ArrayBench;
+	Parser P(std::make_unique<Lexer>(MemoryBuffer::getMemBuffer(ArrayBenchSource, "array-bench")));
+	P.getNextToken();
+	while(P.getCurTok() != tok_eof){
+		if(P.getCurTok() == ';'){
+			P.getNextToken();
+			continue;
+		}
+		auto FnAST = P.ParseDefinition();
+		if(!FnAST || !FnAST->codegen())
+			return 1;
+	}
+	OptimizeModule(*TheModule, &TheJIT->getTargetMachine());
+	bool DotVec = HasVectorCode(*TheModule->getFunction("dot"));
+	bool SaxpyVec = HasVectorCode(*TheModule->getFunction("saxpy"));
+	TheJIT->addModule(std::move(TheModule));
+	InitializeModuleAndPassManager();
+
+	using DotFn = double (*)(const double *, const double *, int64_t);
+	using SaxpyFn = double (*)(double, double *, const double *, int64_t);
+	DotFn ToyDot = (DotFn)(intptr_t)cantFail(TheJIT->findSymbol("dot").getAddress());
+	SaxpyFn ToySaxpy = (SaxpyFn)(intptr_t)cantFail(TheJIT->findSymbol("saxpy").getAddress());
+	// volatile so the C calls are not inlined and hoisted out of the timing loop
+	DotFn volatile CDotFn = CDot;
+	SaxpyFn volatile CSaxpyFn = CSaxpy;
+
+	double * X = arrayalloc(N);
+	double * Y = arrayalloc(N);
+	for(int64_t i = 0; i < N; ++i){
+		X[i] = (i % 7) * 0.5;
+		Y[i] = 1.0;
+	}
+
+	using Clock = std::chrono::steady_clock;
+	unsigned Reps = std::max<int64_t>(1, 100000000 / std::max<int64_t>(N, 1));
+	auto MicrosPerCall = [Reps](Clock::time_point T0){
+		return std::chrono::duration<double, std::micro>(Clock::now() - T0).count() / Reps;
+	};
+
+	double ToyS = 0, CS = 0;
+	auto T0 = Clock::now();
+	for(unsigned R = 0; R < Reps; ++R)
+		ToyS += ToyDot(X, Y, N);
+	double ToyDotUs = MicrosPerCall(T0);
+	T0 = Clock::now();
+	for(unsigned R = 0; R < Reps; ++R)
+		CS += CDotFn(X, Y, N);
+	double CDotUs = MicrosPerCall(T0);
+	if(std::fabs(ToyS - CS) > 1e-9 * std::fabs(CS))
+		fprintf(stderr, "Warning: dot results differ: %f vs %f\n", ToyS, CS);
+
+	T0 = Clock::now();
+	for(unsigned R = 0; R < Reps; ++R)
+		ToySaxpy(1e-6, Y, X, N);
+	double ToySaxpyUs = MicrosPerCall(T0);
+	T0 = Clock::now();
+	for(unsigned R = 0; R < Reps; ++R)
+		CSaxpyFn(1e-6, Y, X, N);
+	double CSaxpyUs = MicrosPerCall(T0);
+
+	fprintf(stderr, "array-bench n=%lld, %u calls each, -O%c%s, cpu %s\n", (long long)N, Reps,
+			(char)OptLevel, FastMath ? " -fast-math" : "",
+			HostCPU ? TheJIT->getTargetMachine().getTargetCPU().str().c_str() : "generic");
+	fprintf(stderr, "dot:   toy %.3f us, C %.3f us, toy/C %.2f, vectorized %s\n",
+			ToyDotUs, CDotUs, ToyDotUs / CDotUs, DotVec ? "yes" : "no");
+	fprintf(stderr, "saxpy: toy %.3f us, C %.3f us, toy/C %.2f, vectorized %s\n",
+			ToySaxpyUs, CSaxpyUs, ToySaxpyUs / CSaxpyUs, SaxpyVec ? "yes" : "no");
+	return 0;
+}
+
+
+int main(int argc, char **argv){
+	cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope toy frontend\n");
+
+	if(OptLevel < '0' || OptLevel > '3'){
+		fprintf(stderr, "Error: invalid optimization level -O%c\n", (char)OptLevel);
+		return 1;
+	}
+
+	if(LexBench)
+		return RunLexerBenchmark();
+
+	InitTrace();
+
+	if(!LoadProfile())
+		return 1;
+
+	// several input files, each one gets a lexer of its own, see MultiFileMain
+	bool MultiFile = !ExtraInputs.empty();
+	if(MultiFile && (!AOTOutput.empty() || !ServeSocket.empty())){
+		fprintf(stderr, "Error: -aot and -serve take one input file\n");
+		return 1;
+	}
+
+	// pick the lexer input, batch mode needs the whole file anyway
+	std::unique_ptr<Lexer> Lex;
+	if(!ServeSocket.empty() && InputFilename == "-"){
+		// a server without a prelude, it doesn't read stdin
+		Lex = std::make_unique<Lexer>(MemoryBuffer::getMemBuffer("", "prelude"));
+	}else if(BufferedLexer || Batch || !AOTOutput.empty() || !ServeSocket.empty()){
+		if(!MultiFile && !(Lex = Lexer::fromFile(InputFilename)))
+			return 1;
+	}else if(!MultiFile && InputFilename != "-" && !freopen(InputFilename.c_str(), "r", stdin)){
+		fprintf(stderr, "Error: can't open %s\n", InputFilename.c_str());
+		return 1;
+	}
+	if(!Lex)
+		Lex = std::make_unique<Lexer>();
+	TheParser = std::make_unique<Parser>(std::move(Lex));
+
+	if(PForThreads.getNumOccurrences() || PForChunk.getNumOccurrences() ||
+	   PForDeterministic.getNumOccurrences())
+		pforconfig(PForThreads, PForChunk, PForDeterministic);
 
-int main(){
 	InitializeNativeTarget();
 	InitializeNativeTargetAsmPrinter();
 	InitializeNativeTargetAsmParser();
 
-	// Install standard binary operators.
-	// 1 is loweset precedence
-	BinopPrecedence['='] = 2;
-	BinopPrecedence['<'] = 10;
-	BinopPrecedence['+'] = 20;
-	BinopPrecedence['-'] = 20;
-	BinopPrecedence['*'] = 40; // highest precedence
+	if(ArrayBench){
+		TheJIT = std::make_unique<KaleidoscopeJIT>(nullptr, JITSlabPool, HostCPU);
+		InitializeModuleAndPassManager();
+		return RunArrayBenchmark();
+	}
 
 	// Prime the first token
-	fprintf(stderr, "ready>");
-	getNextToken();
+	if(!MultiFile){
+		fprintf(stderr, "ready>");
+		TheParser->getNextToken();
+	}
 
 
-	TheJIT = std::make_unique<KaleidoscopeJIT>();
+	if(!ObjectCacheDir.empty()){
+		// the cache key needs the same TargetMachine settings the JIT compiles with
+		std::unique_ptr<TargetMachine> TM(selectHostTarget(HostCPU));
+		TheObjectCache = std::make_unique<KaleidoscopeObjectCache>(ObjectCacheDir, *TM,
+																	(uint64_t)ObjectCacheSizeMB << 20);
+	}
+	TheJIT = std::make_unique<KaleidoscopeJIT>(TheObjectCache.get(), JITSlabPool, HostCPU);
 	
 
 	InitializeModuleAndPassManager();
 
+	if(MultiFile){
+		std::vector<std::string> Files(1, InputFilename);
+		Files.insert(Files.end(), ExtraInputs.begin(), ExtraInputs.end());
+		double Sec = MultiFileMain(Files, ParseThreads);
+		PrintExitStats();
+		return Sec < 0;
+	}
+
+	if(!AOTOutput.empty())
+		return CompileAOT();
+
+	// the REPL and the server, batch mode runs the expressions itself
+	if(!Batch)
+		InitAsyncEval();
+
+	if(!ServeSocket.empty())
+		return RunServer();
+
+	if(Batch){
+		double BatchSec = BatchMain(std::max(1u, (unsigned)Threads));
+		if(BatchSec < 0 || !CompareRepl){
+			PrintExitStats();
+			return BatchSec < 0;
+		}
+
+		// same input through the REPL path, with a fresh JIT
+		TheParser->getLexer().reset();
+		TheJIT = std::make_unique<KaleidoscopeJIT>(TheObjectCache.get(), JITSlabPool, HostCPU);
+		InitializeModuleAndPassManager();
+		auto T0 = std::chrono::steady_clock::now();
+		TheParser->getNextToken();
+		MainLoop();
+		double ReplSec = std::chrono::duration<double>(
+							std::chrono::steady_clock::now() - T0).count();
+		fprintf(stderr, "\nrepl: total %.3f s, batch speedup %.2fx\n", ReplSec, ReplSec / BatchSec);
+		PrintExitStats();
+		return 0;
+	}
 
 	// run
 	MainLoop();
 
+	PrintExitStats();
+
 	// print out all of the generated code
 	//TheModule->print(errs(), nullptr);
 
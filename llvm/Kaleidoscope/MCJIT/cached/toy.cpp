@@ -1,6 +1,7 @@
 #define MINIMAL_STDERR_OUTPUT
 
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
 #include "llvm/ExecutionEngine/ObjectCache.h"
@@ -15,16 +16,22 @@
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeValue.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar.h"
+#include <algorithm>
 #include <cctype>
 #include <cstdio>
 #include <map>
 #include <string>
+#include <system_error>
 #include <vector>
+#include <unistd.h>
 using namespace llvm;
 
 //===----------------------------------------------------------------------===//
@@ -41,6 +48,24 @@ UseObjectCache("use-object-cache",
                cl::desc("Enable use of the MCJIT object caching"),
                cl::init(false));
 
+cl::opt<std::string>
+ObjectCacheDir("object-cache-dir",
+               cl::desc("Directory of the MCJIT object cache"),
+               cl::value_desc("directory"),
+               cl::init("toy_object_cache"));
+
+cl::opt<unsigned>
+ObjectCacheSizeMB("object-cache-size",
+                  cl::desc("Disk budget of the MCJIT object cache in MB, the least "
+                           "recently used objects are evicted beyond it (0: no limit)"),
+                  cl::value_desc("MB"),
+                  cl::init(64));
+
+cl::opt<bool>
+ObjectCacheStats("object-cache-stats",
+                 cl::desc("Print the hits, misses and evictions of the object cache at exit"),
+                 cl::init(false));
+
 //===----------------------------------------------------------------------===//
 // Lexer
 //===----------------------------------------------------------------------===//
@@ -669,66 +694,240 @@ std::string MakeLegalFunctionName(std::string Name)
 // MCJIT object cache class
 //===----------------------------------------------------------------------===//
 
+/// MCJITObjectCache - An on-disk cache of the objects MCJIT generates.
+///
+/// An entry is named after an MD5 of everything the object depends on: the
+/// module's bitcode (after the function passes) and the target triple, CPU,
+/// features and codegen opt level, so a stale entry can never be hit.  Every
+/// module is cached, not only the ones read with -input-IR.
+///
+/// Several processes may share the directory.  An entry is written to a
+/// temporary file and renamed into place, so readers only see whole objects,
+/// and two writers of the same key write the same bytes.  A hit maps the file
+/// instead of reading it; the mapping outlives the file if another process
+/// evicts or replaces it.  When the entries outgrow the -object-cache-size
+/// budget, the least recently used ones are removed (a hit refreshes the
+/// modification time).
 class MCJITObjectCache : public ObjectCache {
 public:
-  MCJITObjectCache() {
-    // Set IR cache directory
-    sys::fs::current_path(CacheDir);
-    sys::path::append(CacheDir, "toy_object_cache");
+  MCJITObjectCache() : Budget((uint64_t)ObjectCacheSizeMB << 20), CacheBytes(0),
+                       SizeKnown(false), Hits(0), Misses(0), Evictions(0) {
+    CacheDir = StringRef(ObjectCacheDir);
+    sys::fs::make_absolute(CacheDir);
   }
 
   virtual ~MCJITObjectCache() {
   }
 
+  /// setTarget - Describe the code the engines generate, part of every key.
+  void setTarget(const TargetMachine &TM) {
+    TargetKey.clear();
+    raw_string_ostream OS(TargetKey);
+    OS << "toy-mcjit-objcache-1" << '\0' << TM.getTargetTriple() << '\0'
+       << TM.getTargetCPU() << '\0' << TM.getTargetFeatureString() << '\0'
+       << (int)TM.getOptLevel();
+    OS.flush();
+  }
+
   virtual void notifyObjectCompiled(const Module *M, const MemoryBuffer *Obj) {
-    // Get the ModuleID
-    const std::string ModuleID = M->getModuleIdentifier();
-
-    // If we've flagged this as an IR file, cache it
-    if (0 == ModuleID.compare(0, 3, "IR:")) {
-      std::string IRFileName = ModuleID.substr(3);
-      SmallString<128>IRCacheFile = CacheDir;
-      sys::path::append(IRCacheFile, IRFileName);
-      if (!sys::fs::exists(CacheDir.str()) && sys::fs::create_directory(CacheDir.str())) {
-        fprintf(stderr, "Unable to create cache directory\n");
+    std::string Key;
+    std::map<const Module *, std::string>::iterator It = PendingKeys.find(M);
+    if (It != PendingKeys.end()) {
+      Key = It->second;
+      PendingKeys.erase(It);
+    } else {
+      Key = computeKey(M);
+    }
+
+    if (sys::fs::create_directories(CacheDir.str())) {
+      fprintf(stderr, "Unable to create cache directory\n");
+      return;
+    }
+
+    // Write a temporary file and rename it over the entry: a reader never
+    // sees half an object, and the rename is atomic if another process
+    // stores the same entry at the same time.
+    SmallString<128> Path = getPath(Key);
+    SmallString<128> TmpPath;
+    int FD;
+    if (sys::fs::createUniqueFile(Path.str() + ".tmp-%%%%%%", FD, TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj->getBuffer();
+      OS.close();
+      if (OS.has_error()) {
+        OS.clear_error();
+        sys::fs::remove(TmpPath.str());
         return;
       }
-      std::string ErrStr;
-      raw_fd_ostream IRObjectFile(IRCacheFile.c_str(), ErrStr, raw_fd_ostream::F_Binary);
-      IRObjectFile << Obj->getBuffer();
     }
+    if (sys::fs::rename(TmpPath.str(), Path.str())) {
+      sys::fs::remove(TmpPath.str());
+      return;
+    }
+
+    CacheBytes += Obj->getBufferSize();
+    if (Budget && (!SizeKnown || CacheBytes > Budget))
+      evict(Path);
   }
 
   // MCJIT will call this function before compiling any module
   // MCJIT takes ownership of both the MemoryBuffer object and the memory
   // to which it refers.
   virtual MemoryBuffer* getObject(const Module* M) {
-    // Get the ModuleID
-    const std::string ModuleID = M->getModuleIdentifier();
-
-    // If we've flagged this as an IR file, cache it
-    if (0 == ModuleID.compare(0, 3, "IR:")) {
-      std::string IRFileName = ModuleID.substr(3);
-      SmallString<128> IRCacheFile = CacheDir;
-      sys::path::append(IRCacheFile, IRFileName);
-      if (!sys::fs::exists(IRCacheFile.str())) {
-        // This file isn't in our cache
-        return NULL;
-      }
-      std::unique_ptr<MemoryBuffer> IRObjectBuffer;
-      MemoryBuffer::getFile(IRCacheFile.c_str(), IRObjectBuffer, -1, false);
-      // MCJIT will want to write into this buffer, and we don't want that
-      // because the file has probably just been mmapped.  Instead we make
-      // a copy.  The filed-based buffer will be released when it goes
-      // out of scope.
-      return MemoryBuffer::getMemBufferCopy(IRObjectBuffer->getBuffer());
+    std::string Key = computeKey(M);
+    SmallString<128> Path = getPath(Key);
+
+    MemoryBuffer *Buf = MappedObject::open(Path);
+    if (Buf) {
+      ++Hits;
+      return Buf;
     }
 
+    // notifyObjectCompiled stores the object under the same key
+    ++Misses;
+    PendingKeys[M] = Key;
     return NULL;
   }
 
+  void printStats() const {
+    fprintf(stderr, "object cache %s: %u hits, %u misses, %u evictions\n",
+            CacheDir.str().str().c_str(), Hits, Misses, Evictions);
+  }
+
 private:
+  /// MappedObject - A cached object, mapped copy-on-write.  MCJIT writes
+  /// the load addresses of the sections into the image, only the pages it
+  /// touches are copied and the file is never changed.
+  class MappedObject : public MemoryBuffer {
+    sys::fs::mapped_file_region Region;
+
+    MappedObject(int FD, uint64_t Size, std::error_code &EC)
+      : Region(FD, /*closefd=*/false, sys::fs::mapped_file_region::priv, Size,
+               0, EC) {
+      if (!EC)
+        init(Region.const_data(), Region.const_data() + Size,
+             /*RequiresNullTerminator=*/false);
+    }
+
+  public:
+    /// open - Map the entry at Path, or null when there is no usable one.
+    static MemoryBuffer *open(const Twine &Path) {
+      int FD;
+      if (sys::fs::openFileForRead(Path, FD))
+        return NULL;
+      sys::fs::file_status Status;
+      std::error_code EC = sys::fs::status(FD, Status);
+      MappedObject *Obj = NULL;
+      if (!EC && Status.getSize() > 0) {
+        Obj = new MappedObject(FD, Status.getSize(), EC);
+        if (EC || !isObject(Obj->getBuffer())) {
+          // Not an object this process wrote; compile the module again
+          // and replace it.
+          delete Obj;
+          Obj = NULL;
+        } else {
+          // Recently used, for the eviction order.
+          sys::fs::setLastModificationAndAccessTime(FD, sys::TimeValue::now());
+        }
+      }
+      ::close(FD);
+      return Obj;
+    }
+
+    virtual const char *getBufferIdentifier() const {
+      return "toy object cache entry";
+    }
+    virtual BufferKind getBufferKind() const { return MemoryBuffer_MMap; }
+  };
+
+  static bool isObject(StringRef Buffer) {
+    sys::fs::file_magic Magic = sys::fs::identify_magic(Buffer);
+    return Magic == sys::fs::file_magic::elf_relocatable ||
+           Magic == sys::fs::file_magic::macho_object ||
+           Magic == sys::fs::file_magic::coff_object;
+  }
+
+  std::string computeKey(const Module *M) {
+    SmallString<0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    OS.flush();
+
+    MD5 Hash;
+    Hash.update(TargetKey);
+    Hash.update(Bitcode.str());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Hex;
+    MD5::stringifyResult(Result, Hex);
+    return Hex.str();
+  }
+
+  SmallString<128> getPath(const std::string &Key) {
+    SmallString<128> Path = CacheDir;
+    sys::path::append(Path, Key + ".o");
+    return Path;
+  }
+
+  /// evict - Bring the cache under its budget (to 3/4 of it, so this doesn't
+  /// run after every store).  The directory is scanned each time, other
+  /// processes add and remove entries too.  Keep is the entry just stored.
+  void evict(StringRef Keep) {
+    struct Entry {
+      sys::TimeValue Used;
+      uint64_t Size;
+      std::string Path;
+      bool operator<(const Entry &RHS) const { return Used < RHS.Used; }
+    };
+    std::vector<Entry> Entries;
+    uint64_t Total = 0;
+    sys::TimeValue Now = sys::TimeValue::now();
+
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(CacheDir.str(), EC), E; I != E && !EC;
+         I.increment(EC)) {
+      sys::fs::file_status Status;
+      if (I->status(Status) || !sys::fs::is_regular_file(Status))
+        continue;
+      StringRef Name = sys::path::filename(I->path());
+      if (Name.find(".o.tmp-") != StringRef::npos) {
+        // Left by a process that died while writing.
+        if ((Now - Status.getLastModificationTime()).seconds() > 600)
+          sys::fs::remove(I->path());
+        continue;
+      }
+      if (!Name.endswith(".o"))
+        continue;
+      Total += Status.getSize();
+      if (I->path() != Keep) {
+        Entry En = { Status.getLastModificationTime(), Status.getSize(), I->path() };
+        Entries.push_back(En);
+      }
+    }
+
+    std::sort(Entries.begin(), Entries.end());
+    uint64_t Target = Budget / 4 * 3;
+    for (size_t I = 0; I != Entries.size() && Total > Target; ++I) {
+      // Another process may have evicted it already.
+      if (sys::fs::remove(Entries[I].Path, /*IgnoreNonExisting=*/false))
+        continue;
+      Total -= Entries[I].Size;
+      ++Evictions;
+    }
+    CacheBytes = Total;
+    SizeKnown = true;
+  }
+
   SmallString<128> CacheDir;
+  std::string TargetKey;
+  // Keys computed by getObject, for notifyObjectCompiled on a miss.
+  std::map<const Module *, std::string> PendingKeys;
+  uint64_t Budget;
+  uint64_t CacheBytes;  // of the entries, as of the last scan
+  bool SizeKnown;
+  unsigned Hits, Misses, Evictions;
 };
 
 //===----------------------------------------------------------------------===//
@@ -749,6 +948,7 @@ public:
   void closeCurrentModule();
   void addModule(Module *M);
   void dump();
+  void printCacheStats() const { OurObjectCache.printStats(); }
 
 private:
   typedef std::vector<Module*> ModuleVector;
@@ -904,8 +1104,10 @@ ExecutionEngine *MCJITHelper::compileModule(Module *M) {
     exit(1);
   }
 
-  if (UseObjectCache)
+  if (UseObjectCache) {
+    OurObjectCache.setTarget(*NewEngine->getTargetMachine());
     NewEngine->setObjectCache(&OurObjectCache);
+  }
 
   // Get the ModuleID so we can identify IR input files
   const std::string ModuleID = M->getModuleIdentifier();
@@ -1540,6 +1742,9 @@ int main(int argc, char **argv) {
   // Run the main "interpreter loop" now.
   MainLoop();
 
+  if (UseObjectCache && ObjectCacheStats)
+    TheHelper->printCacheStats();
+
 #ifndef MINIMAL_STDERR_OUTPUT
   // Print out all of the generated code.
   TheHelper->print(errs());